@@ -8,6 +8,55 @@
 
 #include "driver.h"
 #include <linux/delay.h>
+#include <linux/highmem.h>
+#include <linux/crc32c.h>
+#include <linux/ktime.h>
+
+// Use "insmod miniahci.ko bounce_size=0" to turn bounce buffers off
+static uint bounce_size = 64; // Per port bounce buffer size in KB
+module_param(bounce_size, uint, 0);
+
+// Small buffers are copied, that's cheaper than pinning and mapping
+static uint bounce_threshold = 4096; // Bytes
+module_param(bounce_threshold, uint, 0);
+
+// Status page entry is written by the port lock holder only, readers retry while the sequence is odd or changed.
+// A command is counted once its outcome is final, injected faults and timeouts included
+void ahci_live_update(ahci_channel_t *pChannel, bool command, bool failed)
+{
+    ahci_port_live_t *pLive = pChannel->pLive;
+    HBA_PORT *pPort = pChannel->pPort;
+
+    if (!pLive)
+        return;
+
+    WRITE_ONCE(pLive->seq, pLive->seq + 1);
+    smp_wmb();
+
+    pLive->busy = pPort->ci != 0;
+    pLive->det = pPort->ssts.det;
+    pLive->spd = pPort->ssts.spd;
+    pLive->sig = pPort->sig;
+    pLive->status = ahci_ata_status(pChannel);
+    pLive->error = ahci_ata_error(pChannel);
+
+    if (command) {
+        FIS_REG_D2H *pRfis = &(pChannel->pRcvdFis->rfis);
+        pLive->lba[0] = pRfis->lba0;
+        pLive->lba[1] = pRfis->lba1;
+        pLive->lba[2] = pRfis->lba2;
+        pLive->lba[3] = pRfis->lba3;
+        pLive->lba[4] = pRfis->lba4;
+        pLive->lba[5] = pRfis->lba5;
+        pLive->commands++;
+        pLive->bytes += pChannel->pCmdHeader->prdbc;
+        if (failed)
+            pLive->errors++;
+    }
+
+    smp_wmb();
+    WRITE_ONCE(pLive->seq, pLive->seq + 1);
+}
 
 void ahci_controller_enable(ahci_driver_data_t *pDrvData)
 {
@@ -26,6 +75,11 @@ void ahci_controller_enable(ahci_driver_data_t *pDrvData)
     if (debug)
         printk("%s: Number of ports: %d\n", KBUILD_MODNAME, pAhciMem->cap.np + 1);
 
+    // Without the status page everything works, but mmap() fails
+    pDrvData->pStatusPage = (ahci_status_page_t *)get_zeroed_page(GFP_KERNEL);
+    if (pDrvData->pStatusPage)
+        pDrvData->pStatusPage->pi = pAhciMem->pi;
+
     pi = pAhciMem->pi;
     for (i = 0; i < AHCI_NUMBER_OF_PORTS_MAX; ++i) {
         if (pi & 1) {
@@ -34,6 +88,7 @@ void ahci_controller_enable(ahci_driver_data_t *pDrvData)
 
             ahci_channel_t *pChannel = &(pDrvData->channel[i]);
             pChannel->pPort = &(pDrvData->pAhciMem->port[i]);
+            mutex_init(&(pChannel->lock));
 
             pChannel->pCmdHeader = dma_alloc_coherent(&(pDrvData->pPciDev->dev), sizeof(HBA_COMMAND_HEADER), &(pChannel->pCmdHeaderDma), GFP_KERNEL);
             memset(pChannel->pCmdHeader, 0, sizeof(HBA_COMMAND_HEADER));
@@ -53,11 +108,32 @@ void ahci_controller_enable(ahci_driver_data_t *pDrvData)
             pChannel->pPort->fb = (uint64_t)pChannel->pRcvdFisDma;
             pChannel->pPort->fbu = (uint64_t)pChannel->pRcvdFisDma >> 32;
 
+            // Physically contiguous, so a single PRDT entry is enough
+            pChannel->bounceSize = min_t(uint32_t, bounce_size * 1024, AHCI_DATA_BUFFER_SIZE_MAX);
+            if (pChannel->bounceSize != 0)
+                pChannel->pBounce = dma_alloc_coherent(&(pDrvData->pPciDev->dev), pChannel->bounceSize, &(pChannel->bounceDma), GFP_KERNEL);
+            if (!pChannel->pBounce)
+                pChannel->bounceSize = 0;
+
             // Ignition
             pChannel->pPort->cmd.fre = 1;
             pChannel->pPort->cmd.st = 1;
 
-            pChannel->timeout = AHCI_PORT_DEFAULT_TIMEOUT;
+            for (uint32_t j = 0; j < AHCI_PMP_PORTS_MAX; j++)
+                pChannel->timeout[j] = AHCI_PORT_DEFAULT_TIMEOUT;
+
+            pChannel->recoveryStage = AHCI_RECOVERY_NONE;
+            pChannel->recoveryBudget[0] = AHCI_RECOVERY_STOP_BUDGET;
+            pChannel->recoveryBudget[1] = AHCI_RECOVERY_SRST_BUDGET;
+            pChannel->recoveryBudget[2] = AHCI_RECOVERY_COMRESET_BUDGET;
+
+            pChannel->linkPolicy.port = i;
+            pChannel->linkStats.port = i;
+
+            pChannel->pLive = pDrvData->pStatusPage ? &(pDrvData->pStatusPage->port[i]) : NULL;
+            ahci_live_update(pChannel, false, false);
+
+            ahci_record_init(&(pChannel->recorder));
         }
         pi >>= 1;
     }
@@ -88,12 +164,20 @@ void ahci_controller_disable(ahci_driver_data_t *pDrvData)
                 break;
             }
 
+            pChannel->pPort->cmd.pma = 0;
+            pChannel->pmpPorts = 0;
+
             pChannel->pPort->clb = 0;
             pChannel->pPort->clbu = 0;
 
             pChannel->pPort->fb = 0;
             pChannel->pPort->fbu = 0;
 
+            if (pChannel->pBounce)
+                dma_free_coherent(&(pDrvData->pPciDev->dev), pChannel->bounceSize, pChannel->pBounce, pChannel->bounceDma);
+            pChannel->pBounce = NULL;
+            pChannel->bounceSize = 0;
+
             if (pChannel->pRcvdFis)
                 dma_free_coherent(&(pDrvData->pPciDev->dev), sizeof(HBA_RECEIVED_FIS), pChannel->pRcvdFis, pChannel->pRcvdFisDma);
 
@@ -103,28 +187,49 @@ void ahci_controller_disable(ahci_driver_data_t *pDrvData)
             if (pChannel->pCmdHeader)
                 dma_free_coherent(&(pDrvData->pPciDev->dev), sizeof(HBA_COMMAND_HEADER), pChannel->pCmdHeader, pChannel->pCmdHeaderDma);
 
+            pChannel->pLive = NULL;
+            ahci_record_release(&(pChannel->recorder));
         }
         pi >>= 1;
     }
 
+    // Mapped page stays alive until the last mapping is gone
+    if (pDrvData->pStatusPage)
+        free_page((unsigned long)pDrvData->pStatusPage);
+    pDrvData->pStatusPage = NULL;
+
     mdelay(500);
     pAhciMem->ghc.ae = 0;
 }
 
-static void ahci_map_user_pages(ahci_driver_data_t *pDrvData, uint8_t port, ahci_buffer_t *pBuffer)
+static int ahci_map_user_pages(ahci_driver_data_t *pDrvData, uint8_t port, ahci_buffer_t *pBuffer, ahci_pin_t *pPin)
 {
     uint32_t i, n;
     uint32_t offs, len;
+    dma_addr_t address;
     ahci_channel_t *pChannel = &(pDrvData->channel[port]);
 
     const uint64_t first_page = (uint64_t)pBuffer->pointer >> PAGE_SHIFT;
     const uint64_t last_page = ((uint64_t)pBuffer->pointer + pBuffer->length - 1) >> PAGE_SHIFT;
+    const uint32_t count = last_page - first_page + 1;
+    const uint32_t first = pPin ? first_page - (pPin->start >> PAGE_SHIFT) : 0; // First page in the cached buffer
+
+    if (pPin) {
+        // Cached buffer is pinned and mapped already
+        memcpy(pChannel->pUserPages, &(pPin->pPages[first]), count * sizeof(struct page *));
+    } else {
+        long pinned = pin_user_pages_fast((uint64_t)pBuffer->pointer & PAGE_MASK,
+                                          count,
+                                          FOLL_FORCE | (pBuffer->write ? 0 : FOLL_WRITE),
+                                          pChannel->pUserPages);
+        if (pinned != count) {
+            if (pinned > 0)
+                unpin_user_pages(pChannel->pUserPages, pinned);
+            return (pinned < 0) ? pinned : -EFAULT;
+        }
+    }
 
-    pChannel->userPagesCount = get_user_pages((uint64_t)pBuffer->pointer & PAGE_MASK,
-                                              last_page - first_page + 1,
-                                              FOLL_FORCE,
-                                              pChannel->pUserPages);
-
+    pChannel->userPagesCount = count;
     pChannel->pCmdHeader->prdtl = pChannel->userPagesCount;
 
     n = 0;
@@ -143,16 +248,17 @@ static void ahci_map_user_pages(ahci_driver_data_t *pDrvData, uint8_t port, ahci
             if (i == pChannel->userPagesCount - 1)
                 len = pBuffer->length - n;
 
-        dma_addr_t address = dma_map_page(&(pDrvData->pPciDev->dev),
-                                          pChannel->pUserPages[i],
-                                          offs,
-                                          len,
-                                          DMA_BIDIRECTIONAL);
+        if (pPin) {
+            address = pPin->dma[first + i] + offs;
+            dma_sync_single_for_device(&(pDrvData->pPciDev->dev), address, len, DMA_BIDIRECTIONAL);
+        } else
+            address = dma_map_page(&(pDrvData->pPciDev->dev),
+                                   pChannel->pUserPages[i],
+                                   offs,
+                                   len,
+                                   DMA_BIDIRECTIONAL);
 
-        HBA_PRDT_ENTRY *pPRDT = pChannel->pCmdTable->prdt;
-        pPRDT[i].dba = (uint64_t)address;
-        pPRDT[i].dbau = (uint64_t)address >> 32;
-        pPRDT[i].dbc = len - 1;
+        ahci_set_prdt_entry(pChannel, i, address, len);
 
         n += len;
 
@@ -160,9 +266,12 @@ static void ahci_map_user_pages(ahci_driver_data_t *pDrvData, uint8_t port, ahci
             printk(KERN_INFO "%s: [+] page %d mapped (0x%016llx, %d)\n", KBUILD_MODNAME, i,
                    (uint64_t)address, len);
     }
+
+    return 0;
 }
 
-static void ahci_unmap_user_pages(ahci_driver_data_t *pDrvData, uint8_t port, ahci_buffer_t *pBuffer)
+// Pages are still pinned after unmapping, so CRC is calculated here if requested
+static void ahci_unmap_user_pages(ahci_driver_data_t *pDrvData, uint8_t port, ahci_buffer_t *pBuffer, ahci_pin_t *pPin, uint32_t *pCrc)
 {
     uint32_t i, n, len;
     ahci_channel_t *pChannel = &(pDrvData->channel[port]);
@@ -183,91 +292,383 @@ static void ahci_unmap_user_pages(ahci_driver_data_t *pDrvData, uint8_t port, ah
             if (i == pChannel->userPagesCount - 1)
                 len = pBuffer->length - n;
 
-        dma_unmap_page(&(pDrvData->pPciDev->dev),
-                       address,
-                       len,
-                       DMA_BIDIRECTIONAL);
+        // Cached buffer stays mapped
+        if (pPin)
+            dma_sync_single_for_cpu(&(pDrvData->pPciDev->dev), address, len, DMA_BIDIRECTIONAL);
+        else
+            dma_unmap_page(&(pDrvData->pPciDev->dev),
+                           address,
+                           len,
+                           DMA_BIDIRECTIONAL);
+
+        if (pCrc) {
+            uint8_t *pData = kmap_local_page(pChannel->pUserPages[i]);
+            *pCrc = crc32c(*pCrc, pData + ((i == 0) ? ((uint64_t)pBuffer->pointer & (PAGE_SIZE - 1)) : 0), len);
+            kunmap_local(pData);
+        }
+
         n += len;
 
         if (pDrvData->debug)
             printk(KERN_INFO "%s: [-] page %d unmapped (0x%016llx, %d)\n", KBUILD_MODNAME, i,
                    (uint64_t)address, len);
     }
+}
 
-    pChannel->userPagesCount = 0;
+static bool ahci_sector_is_pattern(const uint8_t *pData, uint32_t value)
+{
+    // Sector starting with the value and equal to itself shifted by the value size is filled with it
+    return (memcmp(pData, &value, sizeof(value)) == 0)
+            && (memcmp(pData, pData + sizeof(value), AHCI_SECTOR_SIZE - sizeof(value)) == 0);
 }
 
-void ahci_run_ata_command(ahci_driver_data_t *pDrvData, ahci_command_packet_t *pCmdPacket)
+static void ahci_scan_sector(ahci_channel_t *pChannel, uint32_t i, const uint8_t *pSector, uint32_t value)
 {
-    ahci_channel_t *pChannel = &(pDrvData->channel[pCmdPacket->port]);
+    if (!memchr_inv(pSector, 0, AHCI_SECTOR_SIZE))
+        pChannel->zeroMap[i / 8] |= 1 << (i % 8);
+    if (ahci_sector_is_pattern(pSector, value))
+        pChannel->patternMap[i / 8] |= 1 << (i % 8);
+}
+
+// Fills sector bitmaps of the channel, user pages must be unmapped already
+static void ahci_scan_user_pages(ahci_channel_t *pChannel, ahci_buffer_t *pBuffer, uint32_t value)
+{
+    const uint32_t sectors = pBuffer->length / AHCI_SECTOR_SIZE;
+    uint32_t i, offs, page, part;
+    uint8_t *pData, *pSector;
+
+    memset(pChannel->zeroMap, 0, DIV_ROUND_UP(sectors, 8));
+    memset(pChannel->patternMap, 0, DIV_ROUND_UP(sectors, 8));
+
+    offs = (uint64_t)pBuffer->pointer & (PAGE_SIZE - 1);
+    for (i = 0; i < sectors; i++, offs += AHCI_SECTOR_SIZE) {
+        page = offs >> PAGE_SHIFT;
+        part = PAGE_SIZE - (offs & (PAGE_SIZE - 1));
+        pData = kmap_local_page(pChannel->pUserPages[page]);
+
+        if (part >= AHCI_SECTOR_SIZE)
+            pSector = pData + (offs & (PAGE_SIZE - 1));
+        else {
+            // Unaligned buffer, sector crosses page boundary
+            memcpy(pChannel->sector, pData + (offs & (PAGE_SIZE - 1)), part);
+            kunmap_local(pData);
+            pData = kmap_local_page(pChannel->pUserPages[page + 1]);
+            memcpy(pChannel->sector + part, pData, AHCI_SECTOR_SIZE - part);
+            pSector = pChannel->sector;
+        }
+
+        ahci_scan_sector(pChannel, i, pSector, value);
+
+        kunmap_local(pData);
+    }
+}
+
+bool ahci_bounce_required(ahci_buffer_t *pBuffer)
+{
+    if ((pBuffer->length == 0) || (bounce_size == 0))
+        return false;
+
+    // AHCI requires word aligned data address and even byte count
+    if (((uint64_t)pBuffer->pointer & 1) || (pBuffer->length & 1))
+        return true;
+
+    return pBuffer->length <= bounce_threshold;
+}
+
+static int ahci_bounce_map(ahci_channel_t *pChannel, ahci_buffer_t *pBuffer, bool copy)
+{
+    if (copy && pBuffer->write && copy_from_user(pChannel->pBounce, pBuffer->pointer, pBuffer->length))
+        return -EFAULT;
+
+    // Odd byte count is rounded up, the extra byte stays in the bounce buffer
+    ahci_set_prdt_entry(pChannel, 0, pChannel->bounceDma, ALIGN(pBuffer->length, 2));
+    pChannel->pCmdHeader->prdtl = 1;
+
+    return 0;
+}
+
+static int ahci_bounce_unmap(ahci_channel_t *pChannel, ahci_buffer_t *pBuffer, uint32_t *pCrc, bool scan, uint32_t value,
+                             bool copy)
+{
+    const uint32_t sectors = pBuffer->length / AHCI_SECTOR_SIZE;
+
+    if (pCrc)
+        *pCrc = crc32c(*pCrc, pChannel->pBounce, pBuffer->length);
+
+    if (scan) {
+        memset(pChannel->zeroMap, 0, DIV_ROUND_UP(sectors, 8));
+        memset(pChannel->patternMap, 0, DIV_ROUND_UP(sectors, 8));
+        for (uint32_t i = 0; i < sectors; i++)
+            ahci_scan_sector(pChannel, i, (uint8_t *)pChannel->pBounce + i * AHCI_SECTOR_SIZE, value);
+    }
+
+    if (copy && !pBuffer->write && copy_to_user(pBuffer->pointer, pChannel->pBounce, pBuffer->length))
+        return -EFAULT;
+
+    return 0;
+}
+
+// The device reports the first failed LBA in the D2H register FIS
+static uint64_t ahci_error_lba(ahci_channel_t *pChannel)
+{
+    FIS_REG_D2H *pRfis = &(pChannel->pRcvdFis->rfis);
+
+    return (uint64_t)pRfis->lba0 | ((uint64_t)pRfis->lba1 << 8) | ((uint64_t)pRfis->lba2 << 16)
+            | ((uint64_t)pRfis->lba3 << 24) | ((uint64_t)pRfis->lba4 << 32) | ((uint64_t)pRfis->lba5 << 40);
+}
+
+// Taken before the recovery and the link monitor, they clear the registers
+static void ahci_fis_snapshot(ahci_channel_t *pChannel)
+{
+    HBA_RECEIVED_FIS *pRcvdFis = pChannel->pRcvdFis;
+    ahci_fis_snapshot_t *pSnapshot = &(pChannel->snapshot);
+    HBA_REG_SERR serr = pChannel->pPort->serr;
+
+    memcpy(pSnapshot->rfis, &(pRcvdFis->rfis), sizeof(pSnapshot->rfis));
+    memcpy(pSnapshot->psfis, &(pRcvdFis->psfis), sizeof(pSnapshot->psfis));
+    memcpy(pSnapshot->sdbfis, pRcvdFis->sdbfis, sizeof(pSnapshot->sdbfis));
+    pSnapshot->is = pChannel->pPort->is;
+    pSnapshot->serr = serr.err | ((uint32_t)serr.diag << 16);
+    pSnapshot->tfd = ahci_ata_status(pChannel) | ((uint32_t)ahci_ata_error(pChannel) << 8);
+}
 
+FIS_REG_H2D *ahci_command_setup(ahci_channel_t *pChannel, uint8_t pmp)
+{
     HBA_COMMAND_HEADER *pCmdHeader = pChannel->pCmdHeader;
     memset(pCmdHeader, 0, sizeof(HBA_COMMAND_HEADER) - sizeof(uint32_t) * 6); // Clear all expect command table base address
     pCmdHeader->cfl = sizeof(FIS_REG_H2D) / sizeof(uint32_t);
-    pCmdHeader->w = pCmdPacket->buffer.write; // Data direction!
+    pCmdHeader->pmp = pmp;
 
     FIS_REG_H2D *pFis = &(pChannel->pCmdTable->cfis);
     memset(pFis, 0, sizeof(FIS_REG_H2D));
     pFis->fis_type = FIS_TYPE_REG_H2D;
+    pFis->pmport = pmp;
+
+    return pFis;
+}
+
+void ahci_command_setup_ata(ahci_channel_t *pChannel, uint8_t pmp, ahci_ata_registers_t *pAta, bool write)
+{
+    FIS_REG_H2D *pFis = ahci_command_setup(pChannel, pmp);
+    pChannel->pCmdHeader->w = write; // Data direction!
+
     pFis->c = 1;
-    pFis->featuresl = pCmdPacket->ata.features[0];
-    pFis->featuresh = pCmdPacket->ata.features[1];
-    pFis->countl = pCmdPacket->ata.count[0];
-    pFis->counth = pCmdPacket->ata.count[1];
-    pFis->lba0 = pCmdPacket->ata.lba[0];
-    pFis->lba1 = pCmdPacket->ata.lba[1];
-    pFis->lba2 = pCmdPacket->ata.lba[2];
-    pFis->lba3 = pCmdPacket->ata.lba[3];
-    pFis->lba4 = pCmdPacket->ata.lba[4];
-    pFis->lba5 = pCmdPacket->ata.lba[5];
-    pFis->device = pCmdPacket->ata.device;
-    pFis->command = pCmdPacket->ata.command;
-
-    if (pCmdPacket->buffer.length != 0)
-        ahci_map_user_pages(pDrvData, pCmdPacket->port, &(pCmdPacket->buffer));
+    pFis->featuresl = pAta->features[0];
+    pFis->featuresh = pAta->features[1];
+    pFis->countl = pAta->count[0];
+    pFis->counth = pAta->count[1];
+    pFis->lba0 = pAta->lba[0];
+    pFis->lba1 = pAta->lba[1];
+    pFis->lba2 = pAta->lba[2];
+    pFis->lba3 = pAta->lba[3];
+    pFis->lba4 = pAta->lba[4];
+    pFis->lba5 = pAta->lba[5];
+    pFis->device = pAta->device;
+    pFis->command = pAta->command;
+}
 
+void ahci_ata_setup_dma(ahci_ata_registers_t *pAta, uint64_t lba, uint32_t count, bool write)
+{
+    memset(pAta, 0, sizeof(ahci_ata_registers_t));
+
+    // Sector count of zero means 65536 sectors
+    pAta->count[0] = count;
+    pAta->count[1] = count >> 8;
+    for (int i = 0; i < 6; i++)
+        pAta->lba[i] = lba >> (i * 8);
+    pAta->device = ATA_DEVICE_LBA;
+    pAta->command = write ? ATA_COMMAND_WRITE_DMA_EXT : ATA_COMMAND_READ_DMA_EXT;
+}
+
+void ahci_set_prdt_entry(ahci_channel_t *pChannel, uint32_t i, dma_addr_t address, uint32_t len)
+{
+    HBA_PRDT_ENTRY *pPRDT = pChannel->pCmdTable->prdt;
+    pPRDT[i].dba = (uint64_t)address;
+    pPRDT[i].dbau = (uint64_t)address >> 32;
+    pPRDT[i].dbc = len - 1;
+}
+
+void ahci_command_issue(ahci_channel_t *pChannel)
+{
     // Reset all bits of the interrupt status register
     pChannel->pPort->is = 0xFFFFFFFF;
 
     // Remember initial value after reset
-    volatile uint32_t is = pChannel->pPort->is;
+    pChannel->issuedIs = pChannel->pPort->is;
 
     // Ignition
     pChannel->pPort->ci = 1;
 
+    if (pChannel->pLive) {
+        WRITE_ONCE(pChannel->pLive->seq, pChannel->pLive->seq + 1);
+        smp_wmb();
+        pChannel->pLive->busy = true;
+        smp_wmb();
+        WRITE_ONCE(pChannel->pLive->seq, pChannel->pLive->seq + 1);
+    }
+}
+
+bool ahci_command_wait(ahci_channel_t *pChannel, uint32_t timeout)
+{
+    bool result = true;
+
     // Wait for complete...
-    unsigned long future = jiffies + msecs_to_jiffies(pChannel->timeout);
+    unsigned long future = jiffies + msecs_to_jiffies(timeout);
     while (true) {
         // Command completed (normal deviation)
         if (pChannel->pPort->ci == 0)
             break;
         // Interrupt status changed (BAD sector occured)
-        if (pChannel->pPort->is != is)
+        if (pChannel->pPort->is != pChannel->issuedIs)
             break;
         // Timeout
         if (time_after(jiffies, future)) {
-            pCmdPacket->timeout = true;
+            result = false;
             printk(KERN_ERR "%s: Timeout detected!\n", KBUILD_MODNAME);
             break;
         }
         cpu_relax();
     }
 
-    if (pCmdPacket->buffer.length != 0)
-        ahci_unmap_user_pages(pDrvData, pCmdPacket->port, &(pCmdPacket->buffer));
+    return result;
 }
 
-void ahci_port_software_reset(ahci_driver_data_t *pDrvData, ahci_command_packet_t *pCmdPacket)
+bool ahci_command_failed(ahci_channel_t *pChannel)
+{
+    if (pChannel->pPort->ci != 0)
+        return true;
+
+    return (ahci_ata_status(pChannel) & (ATA_STATUS_BSY | ATA_STATUS_DRQ | ATA_STATUS_ERR)) != 0;
+}
+
+// ATA status register, an injected fault overrides the device one
+uint8_t ahci_ata_status(ahci_channel_t *pChannel)
+{
+    return pChannel->fault.active ? ahci_fault_status(pChannel) : pChannel->pPort->tfd.status;
+}
+
+uint8_t ahci_ata_error(ahci_channel_t *pChannel)
+{
+    return pChannel->fault.active ? ahci_fault_error(pChannel) : pChannel->pPort->tfd.error;
+}
+
+bool ahci_command_execute(ahci_channel_t *pChannel, uint32_t timeout)
+{
+    bool completed = false;
+
+    if (!pChannel->fault.active || !ahci_fault_blocked(pChannel, timeout)) {
+        ahci_command_issue(pChannel);
+        completed = ahci_command_wait(pChannel, timeout);
+    }
+    ahci_live_update(pChannel, true, !completed || ahci_command_failed(pChannel));
+
+    return completed;
+}
+
+// Issues the command set up in the slot, faults are injected on the way. Other ports may be started before
+// ahci_command_finish() is called for this one
+void ahci_command_start(ahci_channel_t *pChannel, ahci_command_packet_t *pCmdPacket)
+{
+    pChannel->issueTime = ktime_get();
+    pChannel->fault.active = READ_ONCE(pChannel->fault.enable);
+    if (!pChannel->fault.active || ahci_fault_issue(pChannel, pCmdPacket))
+        ahci_command_issue(pChannel);
+}
+
+// Completes the command started by ahci_command_start() and fills the result of the packet. The port is stopped
+// on timeout, so the command buffers can be released after the return. Returns true if the command succeeded
+bool ahci_command_finish(ahci_driver_data_t *pDrvData, ahci_command_packet_t *pCmdPacket)
 {
     ahci_channel_t *pChannel = &(pDrvData->channel[pCmdPacket->port]);
+    bool completed, failed;
+
+    pCmdPacket->recovery = AHCI_RECOVERY_NONE;
+    pCmdPacket->errorLba = AHCI_ERROR_LBA_NONE;
+    if (pChannel->fault.active)
+        completed = ahci_fault_wait(pChannel, pChannel->timeout[pCmdPacket->pmp]);
+    else
+        completed = ahci_command_wait(pChannel, pChannel->timeout[pCmdPacket->pmp]);
+    pCmdPacket->transferred = pChannel->pCmdHeader->prdbc;
+    if (pCmdPacket->flags & AHCI_COMMAND_FLAG_FIS_SNAPSHOT)
+        ahci_fis_snapshot(pChannel);
+    failed = !completed || ahci_command_failed(pChannel);
+    ahci_live_update(pChannel, true, failed);
+    // Interface errors are sampled before the recovery clears PxSERR, the speed change is deferred to the next command
+    ahci_link_monitor(pDrvData, pCmdPacket->port);
+    if (!completed) {
+        pCmdPacket->timeout = true;
+        pCmdPacket->recovery = ahci_port_recover(pDrvData, pCmdPacket->port, pCmdPacket->pmp);
+    } else if (failed) {
+        pCmdPacket->errorLba = ahci_error_lba(pChannel);
+    }
+    ahci_record_command(pChannel, pCmdPacket, pChannel->issueTime);
 
+    return !failed;
+}
+
+int ahci_run_ata_command(ahci_driver_data_t *pDrvData, ahci_command_packet_t *pCmdPacket, ahci_pin_t *pPin)
+{
+    ahci_channel_t *pChannel = &(pDrvData->channel[pCmdPacket->port]);
+    ahci_buffer_t *pBuffer = &(pCmdPacket->buffer);
+    const bool digest = pCmdPacket->flags & AHCI_COMMAND_FLAG_CRC32C;
+    const bool scan = pCmdPacket->flags & AHCI_COMMAND_FLAG_SECTOR_MAP;
+    const bool bounceOnly = pCmdPacket->flags & AHCI_COMMAND_FLAG_BOUNCE;
+    bool bounce = false;
+    int err = 0;
+
+    if (bounceOnly || (!pPin && ahci_bounce_required(pBuffer)))
+        bounce = ALIGN(pBuffer->length, 2) <= pChannel->bounceSize;
+
+    // Caller's data doesn't fit the bounce buffer
+    if (bounceOnly && !bounce)
+        return -EINVAL;
+
+    // Misaligned buffer can't be transferred in place
+    if (!bounce && (((uint64_t)pBuffer->pointer & 1) || (pBuffer->length & 1)))
+        return -EINVAL;
+
+    ahci_link_update(pDrvData, pCmdPacket->port);
+    ahci_command_setup_ata(pChannel, pCmdPacket->pmp, &(pCmdPacket->ata), pBuffer->write);
+
+    if (pBuffer->length != 0) {
+        if (bounce)
+            err = ahci_bounce_map(pChannel, pBuffer, !bounceOnly);
+        else
+            err = ahci_map_user_pages(pDrvData, pCmdPacket->port, pBuffer, pPin);
+        if (err)
+            return err;
+    }
+
+    // The port is stopped on timeout before unmapping, so no DMA is running into unmapped pages
+    ahci_command_start(pChannel, pCmdPacket);
+    ahci_command_finish(pDrvData, pCmdPacket);
+
+    pCmdPacket->crc32c = ~0;
+    if (bounce)
+        err = ahci_bounce_unmap(pChannel, pBuffer, digest ? &(pCmdPacket->crc32c) : NULL, scan, pCmdPacket->map.value,
+                                !bounceOnly);
+    else if (pBuffer->length != 0) {
+        ahci_unmap_user_pages(pDrvData, pCmdPacket->port, pBuffer, pPin, digest ? &(pCmdPacket->crc32c) : NULL);
+        if (scan)
+            ahci_scan_user_pages(pChannel, pBuffer, pCmdPacket->map.value);
+        // Device wrote to the pages on read
+        if (!pPin)
+            unpin_user_pages_dirty_lock(pChannel->pUserPages, pChannel->userPagesCount, !pBuffer->write);
+        pChannel->userPagesCount = 0;
+    }
+    pCmdPacket->crc32c = digest ? ~pCmdPacket->crc32c : 0;
+
+    return err;
+}
+
+static bool ahci_software_reset(ahci_channel_t *pChannel, uint8_t pmp, uint32_t timeout)
+{
+    bool result = true;
+
+    FIS_REG_H2D *pFis = ahci_command_setup(pChannel, pmp);
     HBA_COMMAND_HEADER *pCmdHeader = pChannel->pCmdHeader;
-    memset(pCmdHeader, 0, sizeof(HBA_COMMAND_HEADER) - sizeof(uint32_t) * 6); // Clear all expect command table base address
-    pCmdHeader->cfl = sizeof(FIS_REG_H2D) / sizeof(uint32_t);
 
-    FIS_REG_H2D *pFis = &(pChannel->pCmdTable->cfis);
-    memset(pFis, 0, sizeof(FIS_REG_H2D));
-    pFis->fis_type = FIS_TYPE_REG_H2D;
+    ahci_fault_clear(pChannel, false);
 
     for (int i = 0; i < 2; i++) {
         if (i == 0) {
@@ -282,59 +683,387 @@ void ahci_port_software_reset(ahci_driver_data_t *pDrvData, ahci_command_packet_
             pFis->control = 0x00; // SRST bit is clear
         }
 
-        // Reset all bits of the interrupt status register
-        pChannel->pPort->is = 0xFFFFFFFF;
+        if (!ahci_command_execute(pChannel, timeout))
+            result = false;
+    }
 
-        // Remember initial value after reset
-        volatile uint32_t is = pChannel->pPort->is;
+    return result;
+}
 
-        // Ignition
-        pChannel->pPort->ci = 1;
+// Capacity in sectors, IDENTIFY DEVICE is issued once after the device is attached. Caller must not hold channel lock
+int ahci_port_capacity(ahci_driver_data_t *pDrvData, uint8_t port, uint8_t pmp, uint64_t *pCapacity)
+{
+    ahci_channel_t *pChannel = &(pDrvData->channel[port]);
+    struct device *pDev = &(pDrvData->pPciDev->dev);
+    ahci_command_packet_t packet = { .port = port, .pmp = pmp, .buffer.length = AHCI_SECTOR_SIZE };
+    struct page *pPage;
+    uint16_t *pIdentify;
+    dma_addr_t address;
+    bool failed;
+
+    mutex_lock(&(pChannel->lock));
+    *pCapacity = pChannel->capacity[pmp];
+    mutex_unlock(&(pChannel->lock));
+    if (*pCapacity != 0)
+        return 0;
+
+    pPage = alloc_page(GFP_KERNEL);
+    if (!pPage)
+        return -ENOMEM;
+
+    address = dma_map_page(pDev, pPage, 0, AHCI_SECTOR_SIZE, DMA_FROM_DEVICE);
+    if (dma_mapping_error(pDev, address)) {
+        __free_page(pPage);
+        return -ENOMEM;
+    }
 
-        // Wait for complete...
-        unsigned long future = jiffies + msecs_to_jiffies(500);
-        while (true) {
-            // Command completed (normal deviation)
-            if (pChannel->pPort->ci == 0)
-                break;
-            // Interrupt status changed (BAD sector occured)
-            if (pChannel->pPort->is != is)
-                break;
-            // Timeout
-            if (time_after(jiffies, future)) {
-                pCmdPacket->timeout = true;
-                printk(KERN_ERR "%s: Timeout detected!\n", KBUILD_MODNAME);
-                break;
-            }
-            cpu_relax();
-        }
+    packet.ata.command = ATA_COMMAND_IDENTIFY_DEVICE;
+
+    mutex_lock(&(pChannel->lock));
+    ahci_link_update(pDrvData, port);
+    ahci_command_setup_ata(pChannel, pmp, &(packet.ata), false);
+    ahci_set_prdt_entry(pChannel, 0, address, AHCI_SECTOR_SIZE);
+    pChannel->pCmdHeader->prdtl = 1;
+    ahci_command_start(pChannel, &packet);
+    failed = !ahci_command_finish(pDrvData, &packet);
+    dma_unmap_page(pDev, address, AHCI_SECTOR_SIZE, DMA_FROM_DEVICE);
+    if (!failed) {
+        pIdentify = page_address(pPage);
+        if (pIdentify[83] & (1 << 10)) // 48-bit address feature set supported
+            *pCapacity = (uint64_t)pIdentify[100] | ((uint64_t)pIdentify[101] << 16)
+                    | ((uint64_t)pIdentify[102] << 32) | ((uint64_t)pIdentify[103] << 48);
+        else
+            *pCapacity = (uint64_t)pIdentify[60] | ((uint64_t)pIdentify[61] << 16);
+        pChannel->capacity[pmp] = *pCapacity;
     }
+    mutex_unlock(&(pChannel->lock));
+
+    __free_page(pPage);
+
+    return failed ? -EIO : 0;
 }
 
-void ahci_port_hardware_reset(ahci_driver_data_t *pDrvData, ahci_command_packet_t *pCmdPacket)
+void ahci_port_software_reset(ahci_driver_data_t *pDrvData, ahci_command_packet_t *pCmdPacket)
 {
     ahci_channel_t *pChannel = &(pDrvData->channel[pCmdPacket->port]);
 
+    if (!ahci_software_reset(pChannel, pCmdPacket->pmp, 500))
+        pCmdPacket->timeout = true;
+}
+
+static bool ahci_pmp_read(ahci_channel_t *pChannel, uint8_t devport, uint16_t reg, uint32_t *pValue)
+{
+    FIS_REG_H2D *pFis = ahci_command_setup(pChannel, AHCI_PMP_CONTROL_PORT);
+    pFis->c = 1;
+    pFis->command = ATA_COMMAND_READ_PMP;
+    pFis->featuresl = reg;
+    pFis->featuresh = reg >> 8;
+    pFis->device = devport;
+
+    if (!ahci_command_execute(pChannel, pChannel->timeout[AHCI_PMP_CONTROL_PORT]))
+        return false;
+
+    if (pChannel->pPort->tfd.status & ATA_STATUS_ERR)
+        return false;
+
+    FIS_REG_D2H *pRfis = &(pChannel->pRcvdFis->rfis);
+    *pValue = pRfis->countl | (pRfis->lba0 << 8) | (pRfis->lba1 << 16) | ((uint32_t)pRfis->lba2 << 24);
+
+    return true;
+}
+
+static bool ahci_pmp_write(ahci_channel_t *pChannel, uint8_t devport, uint16_t reg, uint32_t value)
+{
+    FIS_REG_H2D *pFis = ahci_command_setup(pChannel, AHCI_PMP_CONTROL_PORT);
+    pFis->c = 1;
+    pFis->command = ATA_COMMAND_WRITE_PMP;
+    pFis->featuresl = reg;
+    pFis->featuresh = reg >> 8;
+    pFis->device = devport;
+    pFis->countl = value;
+    pFis->lba0 = value >> 8;
+    pFis->lba1 = value >> 16;
+    pFis->lba2 = value >> 24;
+
+    if (!ahci_command_execute(pChannel, pChannel->timeout[AHCI_PMP_CONTROL_PORT]))
+        return false;
+
+    return (pChannel->pPort->tfd.status & ATA_STATUS_ERR) == 0;
+}
+
+static bool ahci_port_stop(ahci_channel_t *pChannel, uint32_t timeout)
+{
     // Disable Command List Running
     pChannel->pPort->cmd.st = 0;
 
-    unsigned long future = jiffies + msecs_to_jiffies(pChannel->timeout);
+    unsigned long future = jiffies + msecs_to_jiffies(timeout);
     while (true) {
         // Command List Running disabled
         if (pChannel->pPort->cmd.cr == 0)
-            break;
+            return true;
         // Timeout
         if (time_after(jiffies, future)) {
             printk(KERN_ERR "%s: Timeout detected!\n", KBUILD_MODNAME);
+            return false;
+        }
+        cpu_relax();
+    }
+}
+
+// The link of a device behind port multiplier is reset through the PSCR registers of its device port
+static bool ahci_pmp_link_reset(ahci_channel_t *pChannel, uint8_t pmp, uint32_t timeout)
+{
+    uint32_t sctl, ssts;
+    unsigned long future;
+
+    if (!ahci_pmp_read(pChannel, pmp, PMP_PSCR_SCONTROL, &sctl))
+        return false;
+
+    // Device Detection Initialization must be held for 1 ms at least
+    if (!ahci_pmp_write(pChannel, pmp, PMP_PSCR_SCONTROL, (sctl & ~0x0F) | 0x01))
+        return false;
+    pChannel->capacity[pmp] = 0;
+    usleep_range(1000, 2000);
+    if (!ahci_pmp_write(pChannel, pmp, PMP_PSCR_SCONTROL, sctl & ~0x0F))
+        return false;
+
+    future = jiffies + msecs_to_jiffies(timeout);
+    while (true) {
+        // Device presence detected and PHY communication established
+        if (ahci_pmp_read(pChannel, pmp, PMP_PSCR_SSTATUS, &ssts) && ((ssts & 0x0F) == 3))
+            break;
+        if (time_after(jiffies, future)) {
+            printk(KERN_ERR "%s: Timeout detected!\n", KBUILD_MODNAME);
+            return false;
+        }
+        msleep(1);
+    }
+
+    // Errors of the link down are cleared, the register is write-one-to-clear
+    return ahci_pmp_write(pChannel, pmp, PMP_PSCR_SERROR, 0xFFFFFFFF);
+}
+
+void ahci_port_hardware_reset(ahci_driver_data_t *pDrvData, ahci_command_packet_t *pCmdPacket)
+{
+    ahci_channel_t *pChannel = &(pDrvData->channel[pCmdPacket->port]);
+
+    // Device behind port multiplier, reset its link only
+    if ((pChannel->pmpPorts != 0) && (pCmdPacket->pmp < pChannel->pmpPorts)) {
+        if (!ahci_pmp_link_reset(pChannel, pCmdPacket->pmp, pChannel->timeout[pCmdPacket->pmp]))
+            pCmdPacket->timeout = true;
+        return;
+    }
+
+    if (!ahci_ports_comreset(pDrvData, 1U << pCmdPacket->port, pChannel->timeout[pCmdPacket->pmp], NULL))
+        pCmdPacket->timeout = true;
+}
+
+static bool ahci_port_ready(ahci_channel_t *pChannel)
+{
+    return (ahci_ata_status(pChannel) & (ATA_STATUS_BSY | ATA_STATUS_DRQ)) == 0;
+}
+
+static void ahci_port_clear_errors(ahci_channel_t *pChannel)
+{
+    HBA_REG_SERR serr = { .err = 0xFFFF, .diag = 0xFFFF };
+
+    // Both registers are write-one-to-clear
+    pChannel->pPort->serr = serr;
+    pChannel->pPort->is = 0xFFFFFFFF;
+}
+
+// Caller must hold channel locks of all the ports, returns mask of ports with link up and device ready
+uint32_t ahci_ports_comreset(ahci_driver_data_t *pDrvData, uint32_t ports, uint32_t timeout, uint32_t *pTime)
+{
+    HBA_MEMORY *pAhciMem = pDrvData->pAhciMem;
+    uint32_t i, pending, linked = 0, ready = 0;
+    unsigned long future;
+    ktime_t start;
+
+    ports &= pAhciMem->pi;
+
+    // All command lists are stopped together, COMRESET is allowed even if some of them don't stop
+    for (i = 0; i < AHCI_NUMBER_OF_PORTS_MAX; i++) {
+        if (ports & (1U << i))
+            pAhciMem->port[i].cmd.st = 0;
+    }
+    future = jiffies + msecs_to_jiffies(500);
+    do {
+        pending = 0;
+        for (i = 0; i < AHCI_NUMBER_OF_PORTS_MAX; i++) {
+            if ((ports & (1U << i)) && pAhciMem->port[i].cmd.cr)
+                pending |= 1U << i;
+        }
+        if (pending == 0)
             break;
+        usleep_range(100, 200);
+    } while (!time_after(jiffies, future));
+
+    // Device Detection Initialization must be held for 1 ms at least
+    for (i = 0; i < AHCI_NUMBER_OF_PORTS_MAX; i++) {
+        if (ports & (1U << i)) {
+            pAhciMem->port[i].sctl.det = 1;
+            ahci_fault_clear(&(pDrvData->channel[i]), true);
+            // Another device may show up after the link comes back
+            memset(pDrvData->channel[i].capacity, 0, sizeof(pDrvData->channel[i].capacity));
+        }
+    }
+    usleep_range(1000, 2000);
+    for (i = 0; i < AHCI_NUMBER_OF_PORTS_MAX; i++) {
+        if (ports & (1U << i))
+            pAhciMem->port[i].sctl.det = 0;
+    }
+    start = ktime_get();
+
+    pending = ports;
+    future = jiffies + msecs_to_jiffies(timeout);
+    while (true) {
+        for (i = 0; i < AHCI_NUMBER_OF_PORTS_MAX; i++) {
+            ahci_channel_t *pChannel = &(pDrvData->channel[i]);
+
+            if (!(pending & (1U << i)))
+                continue;
+
+            // Device presence detected and PHY communication established, errors of the link down are cleared
+            if (!(linked & (1U << i))) {
+                if (pChannel->pPort->ssts.det != 3)
+                    continue;
+                ahci_port_clear_errors(pChannel);
+                linked |= 1U << i;
+            }
+
+            // The device clears BSY by its first D2H FIS
+            if (!ahci_port_ready(pChannel))
+                continue;
+
+            pChannel->pPort->cmd.st = 1;
+            if (pTime)
+                pTime[i] = ktime_us_delta(ktime_get(), start);
+            ready |= 1U << i;
+            pending &= ~(1U << i);
         }
+
+        if ((pending == 0) || time_after(jiffies, future))
+            break;
+        msleep(1);
     }
 
-    // Device Detection Initialization
-    pChannel->pPort->sctl.det = 1;
-    mdelay(10);
-    pChannel->pPort->sctl.det = 0;
+    // Ports without device are started anyway, like after power on
+    for (i = 0; i < AHCI_NUMBER_OF_PORTS_MAX; i++) {
+        if (pending & (1U << i))
+            pAhciMem->port[i].cmd.st = 1;
+        if (ports & (1U << i))
+            ahci_live_update(&(pDrvData->channel[i]), false, false);
+    }
 
-    // Enable Command List Running
+    return ready;
+}
+
+// Caller must hold channel lock. The command list is stopped whatever the policy is, so the buffers of the timed out
+// command can be released after the return, the policy defines only how far the escalation goes
+uint8_t ahci_port_recover(ahci_driver_data_t *pDrvData, uint8_t port, uint8_t pmp)
+{
+    ahci_channel_t *pChannel = &(pDrvData->channel[port]);
+    const uint32_t *pBudget = pChannel->recoveryBudget;
+    const uint8_t stage = pChannel->recoveryStage;
+    const bool stopped = ahci_port_stop(pChannel, pBudget[0]);
+    unsigned long future;
+
+    // Stopping the port clears the command issue register, a device not busy needs nothing more
+    if (stopped) {
+        ahci_port_clear_errors(pChannel);
+        if ((stage == AHCI_RECOVERY_NONE) || ahci_port_ready(pChannel)) {
+            pChannel->pPort->cmd.st = 1;
+            return (stage == AHCI_RECOVERY_NONE) ? AHCI_RECOVERY_NONE : AHCI_RECOVERY_STOP;
+        }
+
+        if (stage >= AHCI_RECOVERY_SRST) {
+            // Busy device prevents the port from starting, command list override clears BSY and DRQ
+            if (pDrvData->pAhciMem->cap.sclo) {
+                pChannel->pPort->cmd.clo = 1;
+                future = jiffies + msecs_to_jiffies(pBudget[1]);
+                while (pChannel->pPort->cmd.clo && !time_after(jiffies, future))
+                    cpu_relax();
+                ahci_fault_clear(pChannel, false);
+            }
+
+            if (ahci_port_ready(pChannel)) {
+                pChannel->pPort->cmd.st = 1;
+                if (ahci_software_reset(pChannel, pmp, pBudget[1]) && ahci_port_ready(pChannel))
+                    return AHCI_RECOVERY_SRST;
+                ahci_port_stop(pChannel, pBudget[0]);
+            }
+        }
+    }
+
+    // Command list that doesn't stop may still move data, the link reset ends the transfer whatever the policy is
+    if (stopped && (stage < AHCI_RECOVERY_COMRESET)) {
+        pChannel->pPort->cmd.st = 1;
+        return AHCI_RECOVERY_FAILED;
+    }
+
+    // Device behind port multiplier, only its link can be reset
+    if (stopped && (pChannel->pmpPorts != 0) && (pmp < pChannel->pmpPorts)) {
+        ahci_port_clear_errors(pChannel);
+        pChannel->pPort->cmd.st = 1;
+        if (!ahci_pmp_link_reset(pChannel, pmp, pBudget[2]))
+            return AHCI_RECOVERY_FAILED;
+        return ahci_software_reset(pChannel, pmp, pBudget[1]) ? AHCI_RECOVERY_COMRESET : AHCI_RECOVERY_FAILED;
+    }
+
+    if (!ahci_ports_comreset(pDrvData, 1U << port, pBudget[2], NULL)) {
+        if (pDrvData->debug)
+            printk(KERN_INFO "%s: Port %d: link is not restored after COMRESET\n", KBUILD_MODNAME, port);
+        return AHCI_RECOVERY_FAILED;
+    }
+
+    return AHCI_RECOVERY_COMRESET;
+}
+
+int ahci_pmp_enumerate(ahci_driver_data_t *pDrvData, ahci_pmp_info_t *pInfo)
+{
+    ahci_channel_t *pChannel = &(pDrvData->channel[pInfo->port]);
+    uint32_t value;
+
+    pInfo->ports = 0;
+    pInfo->id = 0;
+    pInfo->revision = 0;
+
+    // PxCMD.PMA must not be set if the HBA doesn't support port multipliers
+    if (!pDrvData->pAhciMem->cap.spm)
+        return -EOPNOTSUPP;
+
+    // Port Multiplier Attached bit can be changed only while the port is stopped. FIS-based switching stays off:
+    // the driver issues one command per port through slot 0, so command-based switching costs nothing
+    ahci_port_stop(pChannel, pChannel->timeout[AHCI_PMP_CONTROL_PORT]);
+    pChannel->pPort->fbs.en = 0;
+    pChannel->pPort->cmd.pma = 1;
     pChannel->pPort->cmd.st = 1;
+    pChannel->pmpPorts = 0;
+    memset(pChannel->capacity, 0, sizeof(pChannel->capacity));
+
+    if (!ahci_software_reset(pChannel, AHCI_PMP_CONTROL_PORT, 500)
+            || !ahci_pmp_read(pChannel, AHCI_PMP_CONTROL_PORT, PMP_GSCR_PORT_INFO, &value)
+            || ((value & 0x0F) == 0)) {
+        // No port multiplier, direct attached device
+        ahci_port_stop(pChannel, pChannel->timeout[AHCI_PMP_CONTROL_PORT]);
+        pChannel->pPort->cmd.pma = 0;
+        pChannel->pPort->cmd.st = 1;
+        if (pDrvData->debug)
+            printk(KERN_INFO "%s: Port %d: no port multiplier found\n", KBUILD_MODNAME, pInfo->port);
+        return 0;
+    }
+
+    // Control port is not counted
+    pChannel->pmpPorts = min_t(uint8_t, value & 0x0F, AHCI_PMP_CONTROL_PORT);
+    ahci_pmp_read(pChannel, AHCI_PMP_CONTROL_PORT, PMP_GSCR_PRODUCT_ID, &(pInfo->id));
+    ahci_pmp_read(pChannel, AHCI_PMP_CONTROL_PORT, PMP_GSCR_REVISION, &(pInfo->revision));
+
+    pInfo->ports = pChannel->pmpPorts;
+
+    if (pDrvData->debug)
+        printk(KERN_INFO "%s: Port %d: port multiplier 0x%08x attached, %d device ports\n",
+               KBUILD_MODNAME, pInfo->port, pInfo->id, pChannel->pmpPorts);
+
+    return 0;
 }
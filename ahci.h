@@ -14,6 +14,58 @@
 
 #define AHCI_NUMBER_OF_PORTS_MAX	32
 #define AHCI_DATA_BUFFER_SIZE_MAX	1048576
+#define AHCI_PMP_PORTS_MAX          16
+#define AHCI_PMP_CONTROL_PORT       15
+
+// Signature reported by a port multiplier control port
+#define SATA_SIGNATURE_PMP          0x96690101
+
+// Logical sector size
+#define AHCI_SECTOR_SIZE            512
+
+// ATA commands
+#define ATA_COMMAND_READ_SECTORS    0x20
+#define ATA_COMMAND_READ_SECTORS_EXT 0x24
+#define ATA_COMMAND_READ_DMA_EXT    0x25
+#define ATA_COMMAND_WRITE_SECTORS   0x30
+#define ATA_COMMAND_WRITE_SECTORS_EXT 0x34
+#define ATA_COMMAND_WRITE_DMA_EXT   0x35
+#define ATA_COMMAND_READ_VERIFY     0x40
+#define ATA_COMMAND_READ_VERIFY_EXT 0x42
+#define ATA_COMMAND_READ_DMA        0xC8
+#define ATA_COMMAND_WRITE_DMA       0xCA
+#define ATA_COMMAND_IDENTIFY_DEVICE 0xEC
+#define ATA_COMMAND_READ_PMP        0xE4
+#define ATA_COMMAND_WRITE_PMP       0xE8
+
+// ATA status register bits
+#define ATA_STATUS_ERR              0x01
+#define ATA_STATUS_DRQ              0x08
+#define ATA_STATUS_DRDY             0x40
+#define ATA_STATUS_BSY              0x80
+
+// ATA error register bits
+#define ATA_ERROR_UNC               0x40
+#define ATA_ERROR_ICRC              0x80
+
+// SError bits of interface errors
+#define SATA_SERR_ERR_TRANSIENT     0x0100  // Transient data integrity error
+#define SATA_SERR_ERR_PERSISTENT    0x0200  // Persistent communication or data integrity error
+#define SATA_SERR_DIAG_DECODE       0x0008  // 10B to 8B decode error
+#define SATA_SERR_DIAG_DISPARITY    0x0010  // Disparity error
+#define SATA_SERR_DIAG_CRC          0x0020  // CRC error
+#define SATA_SERR_DIAG_HANDSHAKE    0x0040  // Handshake error
+
+// ATA device register bits
+#define ATA_DEVICE_LBA              0x40
+
+// Port multiplier registers
+#define PMP_GSCR_PRODUCT_ID         0
+#define PMP_GSCR_REVISION           1
+#define PMP_GSCR_PORT_INFO          2
+#define PMP_PSCR_SSTATUS            0
+#define PMP_PSCR_SERROR             1
+#define PMP_PSCR_SCONTROL           2
 
 #pragma once
 
@@ -70,6 +122,17 @@ typedef struct _HBA_REG_SERR {
     uint32_t diag : 16;     // Diagnostics
 } HBA_REG_SERR;
 
+typedef struct _HBA_REG_FBS {
+    uint32_t en : 1;		// Enable
+    uint32_t dec : 1;		// Device Error Clear
+    uint32_t sde : 1;		// Single Device Error
+    uint32_t rsvd0 : 5;     // Reserved
+    uint32_t dev : 4;		// Device To Issue
+    uint32_t ado : 4;		// Active Device Optimization
+    uint32_t dwe : 4;		// Device With Error
+    uint32_t rsvd1 : 12;	// Reserved
+} HBA_REG_FBS;
+
 typedef volatile struct _HBA_PORT
 {
     uint32_t clb;			// 0x00, Command List Base Address (1024-byte aligned, bits 9..0 are read only)
@@ -88,7 +151,7 @@ typedef volatile struct _HBA_PORT
     uint32_t sact;			// 0x34, Serial ATA Active (SCR3: SActive)
     uint32_t ci;			// 0x38, Command Issue
     uint32_t sntf;			// 0x3C, Serial ATA Notification (SCR4: SNotification)
-    uint32_t fbs;			// 0x40, FIS-based Switching Control
+    HBA_REG_FBS fbs;        // 0x40, FIS-based Switching Control
     uint32_t devslp;		// 0x44, Device Sleep
     uint32_t rsvd1[10];     // 0x48, Reserved
     uint32_t vendor[4];     // 0x70, Vendor Specific
@@ -0,0 +1,216 @@
+/****************************************************************************
+**
+** This file is part of the MiniAHCI project.
+** Copyright (C) 2024 Alexander E. <aekhv@vk.com>
+** License: GNU GPL v2, see file LICENSE.
+**
+****************************************************************************/
+
+#include "driver.h"
+#include <linux/sort.h>
+#include <linux/slab.h>
+
+typedef struct {
+    uint64_t lba;
+    uint32_t count;
+    uint32_t index; // Caller's entry
+} ahci_batch_item_t;
+
+typedef struct {
+    uint64_t lba;
+    uint32_t count; // Sectors of all merged items
+    uint32_t first; // First item
+    uint32_t items;
+} ahci_batch_group_t;
+
+static int ahci_batch_compare(const void *a, const void *b)
+{
+    const ahci_batch_item_t *x = a, *y = b;
+
+    if (x->lba != y->lba)
+        return (x->lba > y->lba) ? 1 : -1;
+
+    // Same LBA stays in submission order
+    return (x->index > y->index) - (x->index < y->index);
+}
+
+// Items must be sorted by LBA, adjacent ones are merged while they fit the bounce buffer
+static uint32_t ahci_batch_merge(ahci_channel_t *pChannel, ahci_batch_item_t *pItems, uint32_t count,
+                                 ahci_batch_group_t *pGroups, bool merge)
+{
+    const uint32_t limit = min_t(uint32_t, pChannel->bounceSize, AHCI_DATA_BUFFER_SIZE_MAX) / AHCI_SECTOR_SIZE;
+    ahci_batch_group_t *pGroup = NULL;
+    uint32_t groups = 0;
+
+    for (uint32_t i = 0; i < count; i++) {
+        if (merge && pGroup && (pGroup->lba + pGroup->count == pItems[i].lba)
+                && (pGroup->count + pItems[i].count <= limit)) {
+            pGroup->count += pItems[i].count;
+            pGroup->items++;
+            continue;
+        }
+        pGroup = &(pGroups[groups++]);
+        pGroup->lba = pItems[i].lba;
+        pGroup->count = pItems[i].count;
+        pGroup->first = i;
+        pGroup->items = 1;
+    }
+
+    return groups;
+}
+
+// Groups must be sorted by LBA, the sweep starts at the head position
+static void ahci_batch_schedule(ahci_batch_t *pBatch, uint64_t head, ahci_batch_group_t *pGroups, uint32_t groups,
+                                uint32_t *pOrder)
+{
+    uint32_t i, k = 0, n = 0;
+
+    if (pBatch->order == AHCI_BATCH_ORDER_NONE) {
+        for (i = 0; i < groups; i++)
+            pOrder[n++] = i;
+        return;
+    }
+
+    // First group at or above the head
+    while ((k < groups) && (pGroups[k].lba < head))
+        k++;
+
+    if (!pBatch->descending) {
+        for (i = k; i < groups; i++)
+            pOrder[n++] = i;
+        if (pBatch->order == AHCI_BATCH_ORDER_CSCAN) {
+            for (i = 0; i < k; i++)
+                pOrder[n++] = i;
+        } else {
+            for (i = k; i > 0; i--)
+                pOrder[n++] = i - 1;
+        }
+    } else {
+        for (i = k; i > 0; i--)
+            pOrder[n++] = i - 1;
+        if (pBatch->order == AHCI_BATCH_ORDER_CSCAN) {
+            for (i = groups; i > k; i--)
+                pOrder[n++] = i - 1;
+        } else {
+            for (i = k; i < groups; i++)
+                pOrder[n++] = i;
+        }
+    }
+}
+
+// Returns false if the port is not recovered after timeout
+static bool ahci_batch_issue(ahci_driver_data_t *pDrvData, ahci_batch_t *pBatch, ahci_batch_entry_t *pEntries,
+                             ahci_batch_group_t *pGroup, ahci_batch_item_t *pItems)
+{
+    ahci_channel_t *pChannel = &(pDrvData->channel[pBatch->port]);
+    ahci_command_packet_t packet;
+    ahci_batch_entry_t *pEntry;
+    bool failed;
+    int err;
+
+    memset(&packet, 0, sizeof(packet));
+    packet.port = pBatch->port;
+    packet.pmp = pBatch->pmp;
+    packet.buffer.length = pGroup->count * AHCI_SECTOR_SIZE;
+    packet.buffer.write = false;
+    // Single entry is read in place, merged ones go through the bounce buffer
+    if (pGroup->items == 1)
+        packet.buffer.pointer = pEntries[pItems[0].index].pointer;
+    else
+        packet.flags = AHCI_COMMAND_FLAG_BOUNCE;
+    ahci_ata_setup_dma(&(packet.ata), pGroup->lba, pGroup->count, false);
+
+    pBatch->distance += (pGroup->lba > pChannel->batchHead) ? pGroup->lba - pChannel->batchHead
+                                                            : pChannel->batchHead - pGroup->lba;
+
+    err = ahci_worker_run_ata_command(pDrvData, &packet, NULL);
+    if (err) {
+        for (uint32_t i = 0; i < pGroup->items; i++)
+            pEntries[pItems[i].index].result = err;
+        return true;
+    }
+    pBatch->commands++;
+    pChannel->batchHead = pGroup->lba + pGroup->count;
+
+    failed = packet.timeout || ahci_command_failed(pChannel);
+
+    for (uint32_t i = 0; i < pGroup->items; i++) {
+        const uint64_t end = pItems[i].lba + pItems[i].count;
+        const uint32_t offset = (pItems[i].lba - pGroup->lba) * AHCI_SECTOR_SIZE;
+
+        pEntry = &(pEntries[pItems[i].index]);
+        pEntry->status = ahci_ata_status(pChannel);
+        pEntry->error = ahci_ata_error(pChannel);
+
+        // Entries before the bad sector are transferred already
+        if (packet.timeout)
+            pEntry->result = -ETIMEDOUT;
+        else if (failed && ((packet.errorLba == AHCI_ERROR_LBA_NONE) || (end > packet.errorLba)
+                            || (offset + pItems[i].count * AHCI_SECTOR_SIZE > packet.transferred)))
+            pEntry->result = -EIO;
+        else if ((packet.flags & AHCI_COMMAND_FLAG_BOUNCE)
+                 && copy_to_user(pEntry->pointer, (uint8_t *)pChannel->pBounce + offset, pItems[i].count * AHCI_SECTOR_SIZE))
+            pEntry->result = -EFAULT;
+        else
+            pEntry->result = 0;
+    }
+
+    return !packet.timeout || ((packet.recovery != AHCI_RECOVERY_NONE) && (packet.recovery != AHCI_RECOVERY_FAILED));
+}
+
+int ahci_batch_read(ahci_driver_data_t *pDrvData, ahci_batch_t *pBatch, ahci_batch_entry_t *pEntries)
+{
+    ahci_channel_t *pChannel = &(pDrvData->channel[pBatch->port]);
+    const bool sorted = pBatch->order != AHCI_BATCH_ORDER_NONE;
+    ahci_batch_item_t *pItems;
+    ahci_batch_group_t *pGroups;
+    uint32_t *pOrder;
+    uint32_t groups, i;
+
+    pItems = kvmalloc_array(pBatch->count, sizeof(ahci_batch_item_t), GFP_KERNEL);
+    pGroups = kvmalloc_array(pBatch->count, sizeof(ahci_batch_group_t), GFP_KERNEL);
+    pOrder = kvmalloc_array(pBatch->count, sizeof(uint32_t), GFP_KERNEL);
+    if (!pItems || !pGroups || !pOrder) {
+        kvfree(pOrder);
+        kvfree(pGroups);
+        kvfree(pItems);
+        return -ENOMEM;
+    }
+
+    pBatch->commands = 0;
+    pBatch->distance = 0;
+
+    for (i = 0; i < pBatch->count; i++) {
+        pItems[i].lba = pEntries[i].lba;
+        pItems[i].count = pEntries[i].count;
+        pItems[i].index = i;
+        pEntries[i].result = -ECANCELED;
+        pEntries[i].status = 0;
+        pEntries[i].error = 0;
+    }
+
+    if (sorted)
+        sort(pItems, pBatch->count, sizeof(ahci_batch_item_t), ahci_batch_compare, NULL);
+
+    // Merging needs the bounce buffer
+    groups = ahci_batch_merge(pChannel, pItems, pBatch->count, pGroups, sorted && (pChannel->bounceSize != 0));
+    ahci_batch_schedule(pBatch, pChannel->batchHead, pGroups, groups, pOrder);
+
+    for (i = 0; i < groups; i++) {
+        if (fatal_signal_pending(current))
+            break;
+        ahci_batch_group_t *pGroup = &(pGroups[pOrder[i]]);
+        if (!ahci_batch_issue(pDrvData, pBatch, pEntries, pGroup, &(pItems[pGroup->first])))
+            break;
+    }
+
+    if (pDrvData->debug)
+        printk(KERN_INFO "%s: Port %d batch of %u reads: %u commands, head travel %llu sectors\n",
+               KBUILD_MODNAME, pBatch->port, pBatch->count, pBatch->commands, pBatch->distance);
+
+    kvfree(pOrder);
+    kvfree(pGroups);
+    kvfree(pItems);
+
+    return 0;
+}
@@ -0,0 +1,234 @@
+/****************************************************************************
+**
+** This file is part of the MiniAHCI project.
+** Copyright (C) 2024 Alexander E. <aekhv@vk.com>
+** License: GNU GPL v2, see file LICENSE.
+**
+****************************************************************************/
+
+#include "driver.h"
+#include <linux/blkdev.h>
+#include <linux/blk-mq.h>
+#include <linux/idr.h>
+
+// Minors per disk, partitions included
+#define AHCI_BLKDEV_MINORS          16
+
+static int _bmajor = 0;
+static DEFINE_IDA(_blkdev_ida);
+static DEFINE_MUTEX(blkdev_mutex);
+
+static blk_status_t ahci_blkdev_queue_rq(struct blk_mq_hw_ctx *pHctx, const struct blk_mq_queue_data *pData)
+{
+    struct request *pRequest = pData->rq;
+    ahci_blkdev_t *pBlkDev = pRequest->q->queuedata;
+    ahci_driver_data_t *pDrvData = pBlkDev->pDrvData;
+    ahci_channel_t *pChannel = &(pDrvData->channel[pBlkDev->port]);
+    struct device *pDev = &(pDrvData->pPciDev->dev);
+    struct req_iterator iter;
+    struct bio_vec bvec;
+    ahci_command_packet_t packet = { .port = pBlkDev->port, .pmp = pBlkDev->pmp };
+    uint32_t i, n = 0;
+    bool failed = false;
+    (void)(pHctx);
+
+    blk_mq_start_request(pRequest);
+
+    // Read only device
+    if (req_op(pRequest) != REQ_OP_READ) {
+        blk_mq_end_request(pRequest, BLK_STS_IOERR);
+        return BLK_STS_OK;
+    }
+
+    mutex_lock(&(pChannel->lock));
+
+    ahci_link_update(pDrvData, pBlkDev->port);
+    packet.buffer.length = blk_rq_bytes(pRequest);
+    ahci_ata_setup_dma(&(packet.ata), blk_rq_pos(pRequest), blk_rq_bytes(pRequest) / AHCI_SECTOR_SIZE, false);
+    ahci_command_setup_ata(pChannel, pBlkDev->pmp, &(packet.ata), false);
+
+    rq_for_each_segment(bvec, pRequest, iter) {
+        pBlkDev->dma[n] = dma_map_page(pDev, bvec.bv_page, bvec.bv_offset, bvec.bv_len, DMA_FROM_DEVICE);
+        if (dma_mapping_error(pDev, pBlkDev->dma[n])) {
+            failed = true;
+            break;
+        }
+        pBlkDev->length[n] = bvec.bv_len;
+        ahci_set_prdt_entry(pChannel, n, pBlkDev->dma[n], bvec.bv_len);
+        n++;
+    }
+    pChannel->pCmdHeader->prdtl = n;
+
+    // No retries here, bad sector must be reported as fast as possible. The port is stopped on timeout,
+    // so the pages are unmapped and the request is completed with no DMA running into them
+    if (!failed) {
+        ahci_command_start(pChannel, &packet);
+        failed = !ahci_command_finish(pDrvData, &packet);
+    }
+
+    for (i = 0; i < n; i++)
+        dma_unmap_page(pDev, pBlkDev->dma[i], pBlkDev->length[i], DMA_FROM_DEVICE);
+
+    mutex_unlock(&(pChannel->lock));
+
+    if (failed && pDrvData->debug)
+        printk(KERN_INFO "%s: Block device read error at LBA %llu\n", KBUILD_MODNAME, (uint64_t)blk_rq_pos(pRequest));
+
+    blk_mq_end_request(pRequest, failed ? BLK_STS_IOERR : BLK_STS_OK);
+
+    return BLK_STS_OK;
+}
+
+static const struct blk_mq_ops ahci_blkdev_mq_ops = {
+    .queue_rq = ahci_blkdev_queue_rq,
+};
+
+static const struct block_device_operations ahci_blkdev_fops = {
+    .owner = THIS_MODULE,
+};
+
+static int ahci_blkdev_create(ahci_driver_data_t *pDrvData, uint8_t port, uint8_t pmp)
+{
+    ahci_channel_t *pChannel = &(pDrvData->channel[port]);
+    ahci_blkdev_t *pBlkDev;
+    uint64_t capacity = 0;
+    int err;
+
+    struct queue_limits lim = {
+        .logical_block_size = AHCI_SECTOR_SIZE,
+        .max_hw_sectors = AHCI_DATA_BUFFER_SIZE_MAX / AHCI_SECTOR_SIZE,
+        .max_segments = AHCI_JOB_BUFFER_PAGES,
+        .max_segment_size = PAGE_SIZE,
+    };
+
+    // Port taken exclusively after the ioctl checked it
+    if (pChannel->pBlkDev || ahci_port_held(pChannel, NULL))
+        return -EBUSY;
+
+    err = ahci_port_capacity(pDrvData, port, pmp, &capacity);
+    if (err)
+        return err;
+
+    pBlkDev = kzalloc(sizeof(ahci_blkdev_t), GFP_KERNEL);
+    if (!pBlkDev)
+        return -ENOMEM;
+
+    pBlkDev->pDrvData = pDrvData;
+    pBlkDev->port = port;
+    pBlkDev->pmp = pmp;
+
+    pBlkDev->index = ida_alloc_range(&_blkdev_ida, 0, (1 << MINORBITS) / AHCI_BLKDEV_MINORS - 1, GFP_KERNEL);
+    if (pBlkDev->index < 0) {
+        err = pBlkDev->index;
+        goto ERR1;
+    }
+
+    // Single command slot is used per port, so single queue with single tag
+    pBlkDev->tagSet.ops = &ahci_blkdev_mq_ops;
+    pBlkDev->tagSet.nr_hw_queues = 1;
+    pBlkDev->tagSet.queue_depth = 1;
+    pBlkDev->tagSet.numa_node = dev_to_node(&(pDrvData->pPciDev->dev));
+    pBlkDev->tagSet.flags = BLK_MQ_F_BLOCKING;
+
+    err = blk_mq_alloc_tag_set(&(pBlkDev->tagSet));
+    if (err)
+        goto ERR2;
+
+    pBlkDev->pDisk = blk_mq_alloc_disk(&(pBlkDev->tagSet), &lim, pBlkDev);
+    if (IS_ERR(pBlkDev->pDisk)) {
+        err = PTR_ERR(pBlkDev->pDisk);
+        goto ERR3;
+    }
+
+    pBlkDev->pDisk->major = _bmajor;
+    pBlkDev->pDisk->first_minor = pBlkDev->index * AHCI_BLKDEV_MINORS;
+    pBlkDev->pDisk->minors = AHCI_BLKDEV_MINORS;
+    pBlkDev->pDisk->fops = &ahci_blkdev_fops;
+    pBlkDev->pDisk->private_data = pBlkDev;
+    snprintf(pBlkDev->pDisk->disk_name, sizeof(pBlkDev->pDisk->disk_name), "%s%d_%d",
+             KBUILD_MODNAME, pDrvData->pPciDev->bus->number, port);
+    set_capacity(pBlkDev->pDisk, capacity);
+    set_disk_ro(pBlkDev->pDisk, true);
+
+    err = add_disk(pBlkDev->pDisk);
+    if (err)
+        goto ERR4;
+
+    pChannel->pBlkDev = pBlkDev;
+
+    printk(KERN_INFO "%s: Block device created: /dev/%s, %llu sectors, read only\n",
+           KBUILD_MODNAME, pBlkDev->pDisk->disk_name, capacity);
+
+    return 0;
+
+ERR4:
+    put_disk(pBlkDev->pDisk);
+ERR3:
+    blk_mq_free_tag_set(&(pBlkDev->tagSet));
+ERR2:
+    ida_free(&_blkdev_ida, pBlkDev->index);
+ERR1:
+    kfree(pBlkDev);
+
+    return err;
+}
+
+int ahci_blkdev_attach(ahci_driver_data_t *pDrvData, uint8_t port, uint8_t pmp)
+{
+    int err;
+
+    mutex_lock(&blkdev_mutex);
+    err = ahci_blkdev_create(pDrvData, port, pmp);
+    mutex_unlock(&blkdev_mutex);
+
+    return err;
+}
+
+static void ahci_blkdev_destroy(ahci_driver_data_t *pDrvData, uint8_t port)
+{
+    ahci_channel_t *pChannel = &(pDrvData->channel[port]);
+    ahci_blkdev_t *pBlkDev = pChannel->pBlkDev;
+
+    if (!pBlkDev)
+        return;
+
+    printk(KERN_INFO "%s: Block device destroyed: /dev/%s\n", KBUILD_MODNAME, pBlkDev->pDisk->disk_name);
+
+    del_gendisk(pBlkDev->pDisk);
+    put_disk(pBlkDev->pDisk);
+    blk_mq_free_tag_set(&(pBlkDev->tagSet));
+    ida_free(&_blkdev_ida, pBlkDev->index);
+    kfree(pBlkDev);
+
+    pChannel->pBlkDev = NULL;
+}
+
+void ahci_blkdev_detach(ahci_driver_data_t *pDrvData, uint8_t port)
+{
+    mutex_lock(&blkdev_mutex);
+    ahci_blkdev_destroy(pDrvData, port);
+    mutex_unlock(&blkdev_mutex);
+}
+
+bool ahci_blkdev_attached(ahci_driver_data_t *pDrvData, uint8_t port)
+{
+    bool attached;
+
+    mutex_lock(&blkdev_mutex);
+    attached = pDrvData->channel[port].pBlkDev != NULL;
+    mutex_unlock(&blkdev_mutex);
+
+    return attached;
+}
+
+int ahci_blkdev_init(void)
+{
+    _bmajor = register_blkdev(0, KBUILD_MODNAME);
+    return (_bmajor < 0) ? _bmajor : 0;
+}
+
+void ahci_blkdev_exit(void)
+{
+    if (_bmajor > 0)
+        unregister_blkdev(_bmajor, KBUILD_MODNAME);
+}
@@ -0,0 +1,226 @@
+/****************************************************************************
+**
+** This file is part of the MiniAHCI project.
+** Copyright (C) 2024 Alexander E. <aekhv@vk.com>
+** License: GNU GPL v2, see file LICENSE.
+**
+****************************************************************************/
+
+#include "driver.h"
+#include <linux/mm.h>
+#include <linux/mmu_notifier.h>
+
+// Use "insmod miniahci.ko pin_cache=0" to turn pinned buffers cache off
+static uint pin_cache = 8;
+module_param(pin_cache, uint, 0);
+
+static bool ahci_cache_invalidate(struct mmu_interval_notifier *pNotifier, const struct mmu_notifier_range *pRange,
+                                  unsigned long seq)
+{
+    (void)(pRange);
+
+    // Pages are pinned long term, a running command keeps using them safely, the buffer is dropped by the next lookup.
+    // Nothing is waited for here: the command may hold the channel lock and fault on mmap_lock itself
+    mmu_interval_set_seq(pNotifier, seq);
+
+    return true;
+}
+
+static const struct mmu_interval_notifier_ops ahci_cache_ops = {
+    .invalidate = ahci_cache_invalidate,
+};
+
+// Must be called without cacheLock, notifier removal waits for running invalidation
+static void ahci_cache_free(ahci_pin_t *pPin)
+{
+    struct device *pDev = &(pPin->pFileData->pDrvData->pPciDev->dev);
+
+    mmu_interval_notifier_remove(&(pPin->notifier));
+
+    for (uint32_t i = 0; i < pPin->pagesCount; i++) {
+        if (pPin->dma[i])
+            dma_unmap_page(pDev, pPin->dma[i], PAGE_SIZE, DMA_BIDIRECTIONAL);
+    }
+
+    if (pPin->pagesCount != 0)
+        unpin_user_pages_dirty_lock(pPin->pPages, pPin->pagesCount, pPin->writable);
+
+    kfree(pPin);
+}
+
+static ahci_pin_t *ahci_cache_create(ahci_file_t *pFileData, unsigned long start, uint32_t count, bool writable)
+{
+    struct device *pDev = &(pFileData->pDrvData->pPciDev->dev);
+    ahci_pin_t *pPin;
+    long pinned;
+
+    pPin = kzalloc(sizeof(ahci_pin_t), GFP_KERNEL);
+    if (!pPin)
+        return NULL;
+
+    pPin->pFileData = pFileData;
+    pPin->start = start;
+    pPin->writable = writable;
+
+    // Notifier goes first, so the pages can't be changed unnoticed after pinning
+    if (mmu_interval_notifier_insert(&(pPin->notifier), current->mm, start, count * PAGE_SIZE, &ahci_cache_ops)) {
+        kfree(pPin);
+        return NULL;
+    }
+    pPin->seq = mmu_interval_read_begin(&(pPin->notifier));
+
+    pinned = pin_user_pages_fast(start, count, FOLL_FORCE | FOLL_LONGTERM | (writable ? FOLL_WRITE : 0), pPin->pPages);
+    if (pinned != count) {
+        if (pinned > 0)
+            unpin_user_pages(pPin->pPages, pinned);
+        ahci_cache_free(pPin);
+        return NULL;
+    }
+    pPin->pagesCount = count;
+
+    for (uint32_t i = 0; i < count; i++) {
+        pPin->dma[i] = dma_map_page(pDev, pPin->pPages[i], 0, PAGE_SIZE, DMA_BIDIRECTIONAL);
+        if (dma_mapping_error(pDev, pPin->dma[i])) {
+            pPin->dma[i] = 0;
+            ahci_cache_free(pPin);
+            return NULL;
+        }
+    }
+
+    return pPin;
+}
+
+// Caller must hold cacheLock
+static ahci_pin_t *ahci_cache_lookup(ahci_file_t *pFileData, unsigned long start, unsigned long end, bool writable)
+{
+    ahci_pin_t *pPin;
+
+    list_for_each_entry(pPin, &(pFileData->cache), list) {
+        if ((pPin->notifier.mm != current->mm) || (start < pPin->start)
+                || (end > pPin->start + pPin->pagesCount * PAGE_SIZE))
+            continue;
+        if (writable && !pPin->writable)
+            continue;
+        if (mmu_interval_read_retry(&(pPin->notifier), pPin->seq))
+            continue;
+        return pPin;
+    }
+
+    return NULL;
+}
+
+// Caller must hold cacheLock, moves evicted buffers not used by any command to the list
+static void ahci_cache_collect(ahci_file_t *pFileData, struct list_head *pList)
+{
+    ahci_pin_t *pPin, *pNext;
+
+    list_for_each_entry_safe(pPin, pNext, &(pFileData->evicted), list) {
+        if (pPin->users == 0)
+            list_move(&(pPin->list), pList);
+    }
+}
+
+// Caller must hold cacheLock, the buffers are released by ahci_cache_put() of their last user
+static void ahci_cache_evict(ahci_file_t *pFileData)
+{
+    ahci_pin_t *pPin, *pNext;
+
+    list_for_each_entry_safe(pPin, pNext, &(pFileData->cache), list) {
+        if (mmu_interval_check_retry(&(pPin->notifier), pPin->seq)) {
+            list_move(&(pPin->list), &(pFileData->evicted));
+            pFileData->cacheStats.entries--;
+            pFileData->cacheStats.invalidations++;
+        }
+    }
+
+    // Least recently used one
+    if (pFileData->cacheStats.entries >= pin_cache) {
+        pPin = list_last_entry(&(pFileData->cache), ahci_pin_t, list);
+        list_move(&(pPin->list), &(pFileData->evicted));
+        pFileData->cacheStats.entries--;
+    }
+}
+
+void ahci_cache_init(ahci_file_t *pFileData)
+{
+    mutex_init(&(pFileData->cacheLock));
+    INIT_LIST_HEAD(&(pFileData->cache));
+    INIT_LIST_HEAD(&(pFileData->evicted));
+}
+
+void ahci_cache_release(ahci_file_t *pFileData)
+{
+    ahci_pin_t *pPin, *pNext;
+    LIST_HEAD(list);
+
+    mutex_lock(&(pFileData->cacheLock));
+    list_splice_init(&(pFileData->cache), &list);
+    list_splice_init(&(pFileData->evicted), &list);
+    pFileData->cacheStats.entries = 0;
+    mutex_unlock(&(pFileData->cacheLock));
+
+    list_for_each_entry_safe(pPin, pNext, &list, list)
+        ahci_cache_free(pPin);
+}
+
+// Returns pinned and mapped buffer held until ahci_cache_put(), or NULL if the buffer must be pinned by the command itself
+ahci_pin_t *ahci_cache_get(ahci_file_t *pFileData, ahci_buffer_t *pBuffer)
+{
+    const unsigned long start = (unsigned long)pBuffer->pointer & PAGE_MASK;
+    const unsigned long end = PAGE_ALIGN((unsigned long)pBuffer->pointer + pBuffer->length);
+    const bool writable = !pBuffer->write; // Device writes to memory
+    ahci_pin_t *pPin;
+
+    // Copied buffers are not pinned at all
+    if ((pin_cache == 0) || (pBuffer->length == 0) || !current->mm || ahci_bounce_required(pBuffer))
+        return NULL;
+
+    mutex_lock(&(pFileData->cacheLock));
+    pPin = ahci_cache_lookup(pFileData, start, end, writable);
+    if (pPin) {
+        list_move(&(pPin->list), &(pFileData->cache));
+        pFileData->cacheStats.hits++;
+        pPin->users++;
+        mutex_unlock(&(pFileData->cacheLock));
+        return pPin;
+    }
+    pFileData->cacheStats.misses++;
+    mutex_unlock(&(pFileData->cacheLock));
+
+    // Pinning may fault and invalidate other cached buffers, so it's done unlocked
+    pPin = ahci_cache_create(pFileData, start, (end - start) >> PAGE_SHIFT, writable);
+    if (!pPin)
+        return NULL;
+
+    mutex_lock(&(pFileData->cacheLock));
+    if (mmu_interval_read_retry(&(pPin->notifier), pPin->seq)) {
+        // Changed while pinning, the command pins its buffer by itself
+        mutex_unlock(&(pFileData->cacheLock));
+        ahci_cache_free(pPin);
+        return NULL;
+    }
+    ahci_cache_evict(pFileData);
+    list_add(&(pPin->list), &(pFileData->cache));
+    pFileData->cacheStats.entries++;
+    pPin->users = 1;
+    mutex_unlock(&(pFileData->cacheLock));
+
+    return pPin;
+}
+
+void ahci_cache_put(ahci_file_t *pFileData, ahci_pin_t *pPin)
+{
+    ahci_pin_t *pNext;
+    LIST_HEAD(list);
+
+    if (!pPin)
+        return;
+
+    mutex_lock(&(pFileData->cacheLock));
+    pPin->users--;
+    ahci_cache_collect(pFileData, &list);
+    mutex_unlock(&(pFileData->cacheLock));
+
+    list_for_each_entry_safe(pPin, pNext, &list, list)
+        ahci_cache_free(pPin);
+}
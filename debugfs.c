@@ -0,0 +1,116 @@
+/****************************************************************************
+**
+** This file is part of the MiniAHCI project.
+** Copyright (C) 2024 Alexander E. <aekhv@vk.com>
+** License: GNU GPL v2, see file LICENSE.
+**
+****************************************************************************/
+
+#include "driver.h"
+#include <linux/debugfs.h>
+
+static struct dentry *_debugfs_root = NULL;
+
+// File position is the sequence number of the next record multiplied by the record size
+static ssize_t ahci_debugfs_record_read(struct file *pFile, char __user *pBuf, size_t count, loff_t *pPos)
+{
+    ahci_channel_t *pChannel = pFile->private_data;
+    ahci_recorder_t *pRecorder = &(pChannel->recorder);
+    const uint64_t head = ahci_record_head(pRecorder);
+    uint64_t seq = *pPos / sizeof(ahci_record_t);
+    ahci_record_t record;
+    size_t done = 0;
+
+    // Whole records only
+    if ((*pPos % sizeof(ahci_record_t)) || (count < sizeof(ahci_record_t)))
+        return -EINVAL;
+
+    // Reader fell behind, the oldest records are overwritten already
+    if ((head > pRecorder->size) && (seq < head - pRecorder->size))
+        seq = head - pRecorder->size;
+
+    while ((seq < head) && (done + sizeof(ahci_record_t) <= count)) {
+        if (ahci_record_fetch(pRecorder, seq, &record)) {
+            if (copy_to_user(pBuf + done, &record, sizeof(ahci_record_t)))
+                return done ? done : -EFAULT;
+            done += sizeof(ahci_record_t);
+        }
+        seq++;
+    }
+
+    *pPos = seq * sizeof(ahci_record_t);
+
+    return done;
+}
+
+static const struct file_operations ahci_debugfs_record_fops = {
+    .owner  = THIS_MODULE,
+    .open   = simple_open,
+    .read   = ahci_debugfs_record_read,
+    .llseek = default_llseek,
+};
+
+// Knobs are plain values read by the channel lock holder, so a change applies from the next command
+static void ahci_debugfs_fault_create(ahci_channel_t *pChannel)
+{
+    ahci_fault_t *pFault = &(pChannel->fault);
+    struct dentry *pDir = debugfs_create_dir("fault", pChannel->pDebugDir);
+
+    debugfs_create_bool("enable", 0600, pDir, &(pFault->enable));
+    debugfs_create_u64("bad_lba", 0600, pDir, &(pFault->badLba));
+    debugfs_create_u32("bad_count", 0600, pDir, &(pFault->badCount));
+    debugfs_create_u64("slow_lba", 0600, pDir, &(pFault->slowLba));
+    debugfs_create_u32("slow_count", 0600, pDir, &(pFault->slowCount));
+    debugfs_create_u32("slow_delay", 0600, pDir, &(pFault->slowDelay));
+    debugfs_create_u32("timeout_every", 0600, pDir, &(pFault->timeoutEvery));
+    debugfs_create_u32("hang_every", 0600, pDir, &(pFault->hangEvery));
+    debugfs_create_u32("link_drop_every", 0600, pDir, &(pFault->linkDropEvery));
+    debugfs_create_u64("commands", 0400, pDir, &(pFault->commands));
+    debugfs_create_u64("injected", 0400, pDir, &(pFault->injected));
+}
+
+void ahci_debugfs_init(void)
+{
+    _debugfs_root = debugfs_create_dir(KBUILD_MODNAME, NULL);
+}
+
+void ahci_debugfs_exit(void)
+{
+    debugfs_remove(_debugfs_root);
+    _debugfs_root = NULL;
+}
+
+// Directory per controller named after its bus number, subdirectory per implemented port
+void ahci_debugfs_attach(ahci_driver_data_t *pDrvData, uint32_t bus)
+{
+    uint32_t pi = pDrvData->pAhciMem->pi;
+    ahci_channel_t *pChannel;
+    char name[16];
+
+    snprintf(name, sizeof(name), "%u", bus);
+    pDrvData->pDebugDir = debugfs_create_dir(name, _debugfs_root);
+
+    for (uint32_t i = 0; i < AHCI_NUMBER_OF_PORTS_MAX; i++) {
+        if (!(pi & (1U << i)))
+            continue;
+
+        pChannel = &(pDrvData->channel[i]);
+        snprintf(name, sizeof(name), "port%u", i);
+        pChannel->pDebugDir = debugfs_create_dir(name, pDrvData->pDebugDir);
+
+        if (pChannel->recorder.pRecords)
+            debugfs_create_file("record", 0400, pChannel->pDebugDir, pChannel, &ahci_debugfs_record_fops);
+
+        ahci_debugfs_fault_create(pChannel);
+    }
+}
+
+// Waits for readers, so the channels can be released after that
+void ahci_debugfs_detach(ahci_driver_data_t *pDrvData)
+{
+    debugfs_remove(pDrvData->pDebugDir);
+    pDrvData->pDebugDir = NULL;
+
+    for (uint32_t i = 0; i < AHCI_NUMBER_OF_PORTS_MAX; i++)
+        pDrvData->channel[i].pDebugDir = NULL;
+}
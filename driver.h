@@ -14,13 +14,19 @@
 #include <linux/module.h>
 #include <linux/pci.h>
 #include <linux/cdev.h>
+#include <linux/mutex.h>
+#include <linux/spinlock.h>
+#include <linux/wait.h>
+#include <linux/completion.h>
+#include <linux/blk-mq.h>
+#include <linux/mmu_notifier.h>
 #include "ahci.h"
 #include "ioctl.h"
 
 MODULE_LICENSE("GPL v2");
 MODULE_AUTHOR("Alexander E. <aekhv@vk.com>");
 MODULE_DESCRIPTION("MiniAHCI kernel module");
-MODULE_VERSION("1.0");
+MODULE_VERSION("1.1");
 
 // Use "insmod miniahci.ko debug=1" to turn debug on
 static bool debug = 0;
@@ -31,12 +37,72 @@ module_param(debug, bool, 0);
 
 // Driver version
 #define AHCI_DRIVER_VERSION_MAJOR   1
-#define AHCI_DRIVER_VERSION_MINOR   0
+#define AHCI_DRIVER_VERSION_MINOR   1
 #define AHCI_DRIVER_VERSION_PATCH   0
 
 // Default timeout in milliseconds
 #define AHCI_PORT_DEFAULT_TIMEOUT   10000
 
+// Default timeout recovery stage budgets in milliseconds
+#define AHCI_RECOVERY_STOP_BUDGET       500
+#define AHCI_RECOVERY_SRST_BUDGET       500
+#define AHCI_RECOVERY_COMRESET_BUDGET   5000
+
+// Pages per job data buffer
+#define AHCI_JOB_BUFFER_PAGES       (AHCI_DATA_BUFFER_SIZE_MAX / PAGE_SIZE)
+
+// Internal command packet flag, never accepted from userspace: data is exchanged with the bounce buffer by the caller
+#define AHCI_COMMAND_FLAG_BOUNCE    0x80000000
+
+// Sector bitmap size in bytes
+#define AHCI_SECTOR_MAP_SIZE        (AHCI_DATA_BUFFER_SIZE_MAX / AHCI_SECTOR_SIZE / 8)
+
+// Character device minors: controller node minor is its PCI bus number, port nodes follow all of them
+#define AHCI_CONTROLLERS_MAX        256
+#define AHCI_MINORS_COUNT           (AHCI_CONTROLLERS_MAX * (1 + AHCI_NUMBER_OF_PORTS_MAX))
+#define AHCI_PORT_MINOR(bus, port)  (AHCI_CONTROLLERS_MAX + (bus) * AHCI_NUMBER_OF_PORTS_MAX + (port))
+
+typedef struct _ahci_driver_data ahci_driver_data_t;
+typedef struct _ahci_blkdev ahci_blkdev_t;
+typedef struct _ahci_file ahci_file_t;
+
+typedef struct {
+    spinlock_t lock;
+    uint32_t limit; // KB/s, 0 - unlimited
+    uint64_t time; // Time the bucket is empty at, nanoseconds
+    ahci_rate_stats_t stats;
+} ahci_rate_t;
+
+typedef struct {
+    bool enable; // Faults are injected into the commands of this port
+    uint64_t badLba; // Unreadable range, reads fail with UNC error after the sectors before it
+    uint32_t badCount; // 0 - none
+    uint64_t slowLba; // Slow range, commands touching it are delayed before the issue
+    uint32_t slowCount; // 0 - none
+    uint32_t slowDelay; // Microseconds
+    uint32_t timeoutEvery; // Every Nth command is lost, 0 - never
+    uint32_t hangEvery; // Device stays busy after every Nth command until CLO, software reset or COMRESET, 0 - never
+    uint32_t linkDropEvery; // Link drops at every Nth command until COMRESET, 0 - never
+    uint64_t commands; // Commands seen by the injector
+    uint64_t injected; // Faults injected
+
+    bool active; // Enable latched at the issue, the core looks at nothing else while it's clear
+    bool hang; // Device is busy
+    bool linkDown;
+    bool issued; // The command in the slot reached the device
+    bool unc; // The command fails with UNC error at errorLba
+    uint64_t errorLba;
+    bool tfd; // Injected error replaces the device registers until the next command
+    uint8_t status;
+    uint8_t error;
+} ahci_fault_t;
+
+typedef struct {
+    ahci_record_t *pRecords; // Ring of recorded commands, NULL - recorder is disabled
+    uint32_t size; // Number of records, power of two
+    uint64_t head; // Sequence number of the next record, written by the channel lock holder only
+} ahci_recorder_t;
+
 typedef struct {
     HBA_PORT *pPort;
     HBA_COMMAND_HEADER *pCmdHeader; // Virtual addresses
@@ -48,29 +114,239 @@ typedef struct {
 
     uint32_t userPagesCount;
     struct page *pUserPages[(AHCI_DATA_BUFFER_SIZE_MAX / PAGE_SIZE) + 1]; // User buffer mapped pages
+    uint8_t zeroMap[AHCI_SECTOR_MAP_SIZE]; // Sector bitmaps of the last command
+    uint8_t patternMap[AHCI_SECTOR_MAP_SIZE];
+    ahci_fis_snapshot_t snapshot; // Received FIS and port registers of the last command
+    uint8_t sector[AHCI_SECTOR_SIZE]; // Copy of a sector crossing page boundary
+
+    void *pBounce; // Contiguous buffer for small and misaligned transfers
+    dma_addr_t bounceDma;
+    uint32_t bounceSize;
+
+    uint32_t timeout[AHCI_PMP_PORTS_MAX]; // Per PMP port timeouts
+    uint8_t pmpPorts; // Number of port multiplier device ports, 0 - no port multiplier attached
+    uint64_t capacity[AHCI_PMP_PORTS_MAX]; // Sectors reported by IDENTIFY DEVICE, 0 - not known yet
+    uint8_t recoveryStage; // Last timeout recovery stage to try, AHCI_RECOVERY_NONE - disabled
+    uint32_t recoveryBudget[3]; // Stage budgets in milliseconds
+    uint64_t batchHead; // LBA following the last batched read, start of the next sweep
+
+    ahci_link_policy_t linkPolicy; // Adaptive link speed
+    ahci_link_stats_t linkStats;
+    uint32_t linkCommands; // Commands in the current window
+    uint32_t linkErrors; // Interface errors in the current window
+    uint32_t linkClean; // Commands without interface errors in a row
+    bool linkPending; // Speed limit change requested
+    uint8_t linkLimit; // Requested speed limit
+
+    struct mutex lock; // Serializes access to the command slot
+    uint32_t issuedIs; // Interrupt status at the moment of command issue
+    ktime_t issueTime; // Start of the command in the slot, recorded with it
 
-    uint32_t timeout;
+    ahci_blkdev_t *pBlkDev; // Optional read only block device
+
+    struct task_struct *pWorker; // Optional thread executing the commands of this port
+    spinlock_t workLock;
+    struct list_head workQueue; // Commands waiting for the worker
+    wait_queue_head_t workWait;
+
+    ahci_rate_t rate; // Bandwidth limit of the port
+    ahci_port_live_t *pLive; // Entry of the status page, may be NULL
+    ahci_recorder_t recorder; // Command stream of the port
+    ahci_fault_t fault; // Fault injection
+    struct dentry *pDebugDir;
+
+    ahci_driver_data_t *pDrvData;
+    struct cdev charDevice; // Port node, implemented ports only
+    struct device *pDevice;
+    spinlock_t openLock;
+    uint32_t openCount; // Files opened on the port node
+    ahci_file_t *pOwner; // File holding the port exclusively, NULL if none
 } ahci_channel_t;
 
-typedef struct {
+typedef struct _ahci_job ahci_job_t;
+
+struct _ahci_driver_data {
     struct pci_dev *pPciDev;
     struct cdev charDevice;
     struct device *pDevice;
     HBA_MEMORY __iomem *pAhciMem;
+    ahci_status_page_t *pStatusPage; // Live status mapped by userspace
+    struct dentry *pDebugDir;
     ahci_channel_t channel[AHCI_NUMBER_OF_PORTS_MAX];
     bool debug;
-} ahci_driver_data_t;
+    ahci_job_t *pJob; // Job running on this controller
+    ahci_job_t *pTargetJob; // Job writing to this controller from another one
+};
+
+struct _ahci_blkdev {
+    ahci_driver_data_t *pDrvData;
+    uint8_t port;
+    uint8_t pmp;
+    int index; // Disk index, defines first minor
+    struct blk_mq_tag_set tagSet;
+    struct gendisk *pDisk;
+    dma_addr_t dma[AHCI_JOB_BUFFER_PAGES]; // Mapped segments of the current request
+    uint32_t length[AHCI_JOB_BUFFER_PAGES];
+};
+
+struct _ahci_file {
+    ahci_driver_data_t *pDrvData;
+    ahci_channel_t *pNode; // Port node the file is opened on, NULL for the controller node
+    uint8_t port; // Port used by read() and write()
+    uint8_t pmp;
+    struct mutex cacheLock; // Protects the lists and the users counters, never held across a command
+    struct list_head cache; // Pinned user buffers, most recently used first
+    struct list_head evicted; // Buffers to be released by their last user
+    ahci_cache_stats_t cacheStats;
+    ahci_rate_t rate; // Bandwidth limit of this file
+};
+
+typedef struct {
+    struct mmu_interval_notifier notifier;
+    struct list_head list;
+    ahci_file_t *pFileData;
+    unsigned long start; // Page aligned user address
+    uint32_t pagesCount;
+    bool writable; // Pinned for device to host transfers
+    unsigned long seq; // Notifier sequence at the moment of pinning
+    uint32_t users; // Commands using the buffer, protected by cacheLock
+    struct page *pPages[AHCI_JOB_BUFFER_PAGES + 1];
+    dma_addr_t dma[AHCI_JOB_BUFFER_PAGES + 1];
+} ahci_pin_t;
+
+typedef struct {
+    struct list_head list;
+    ahci_command_packet_t *pCmdPacket;
+    ahci_pin_t *pPin;
+    struct mm_struct *pMm; // Address space of the submitting process
+    int result;
+    struct completion done;
+} ahci_work_t;
+
+struct _ahci_job {
+    struct task_struct *pThread;
+    ahci_driver_data_t *pDrvData; // Source controller
+    ahci_driver_data_t *pTargetDrvData; // Target controller, may be the same as source
+    struct file *pTargetFile; // Keeps target controller opened while the job exists
+    struct file *pImageFile; // Image file, no target drive in this case
+    uint64_t imageOffset; // Image file position of the first LBA
+    ahci_clone_job_t params;
+    spinlock_t statusLock;
+    ahci_job_status_t status;
+    uint32_t pagesCount;
+    struct page *pPages[2][AHCI_JOB_BUFFER_PAGES]; // Double buffering: read one while writing another
+    dma_addr_t sourceDma[2][AHCI_JOB_BUFFER_PAGES];
+    dma_addr_t targetDma[2][AHCI_JOB_BUFFER_PAGES];
+    void *pBuffer[2]; // Kernel virtual address of buffer pages, image job only
+    uint32_t crc; // Running CRC32C of the data read, AHCI_JOB_FLAG_CRC32C only
+};
+
+extern const struct file_operations fops;
 
 // Base part
 void ahci_controller_enable(ahci_driver_data_t *pDrvData);
 void ahci_controller_disable(ahci_driver_data_t *pDrvData);
-void ahci_run_ata_command(ahci_driver_data_t *pDrvData, ahci_command_packet_t *pCmdPacket);
+int ahci_run_ata_command(ahci_driver_data_t *pDrvData, ahci_command_packet_t *pCmdPacket, ahci_pin_t *pPin);
+bool ahci_bounce_required(ahci_buffer_t *pBuffer);
 void ahci_port_software_reset(ahci_driver_data_t *pDrvData, ahci_command_packet_t *pCmdPacket);
 void ahci_port_hardware_reset(ahci_driver_data_t *pDrvData, ahci_command_packet_t *pCmdPacket);
+int ahci_pmp_enumerate(ahci_driver_data_t *pDrvData, ahci_pmp_info_t *pInfo);
+int ahci_port_capacity(ahci_driver_data_t *pDrvData, uint8_t port, uint8_t pmp, uint64_t *pCapacity);
+uint8_t ahci_port_recover(ahci_driver_data_t *pDrvData, uint8_t port, uint8_t pmp);
+uint32_t ahci_ports_comreset(ahci_driver_data_t *pDrvData, uint32_t ports, uint32_t timeout, uint32_t *pTime);
+void ahci_live_update(ahci_channel_t *pChannel, bool command, bool failed);
+uint8_t ahci_ata_status(ahci_channel_t *pChannel);
+uint8_t ahci_ata_error(ahci_channel_t *pChannel);
+
+// Command slot part, caller must hold channel lock
+FIS_REG_H2D *ahci_command_setup(ahci_channel_t *pChannel, uint8_t pmp);
+void ahci_command_setup_ata(ahci_channel_t *pChannel, uint8_t pmp, ahci_ata_registers_t *pAta, bool write);
+void ahci_ata_setup_dma(ahci_ata_registers_t *pAta, uint64_t lba, uint32_t count, bool write);
+void ahci_set_prdt_entry(ahci_channel_t *pChannel, uint32_t i, dma_addr_t address, uint32_t len);
+void ahci_command_issue(ahci_channel_t *pChannel);
+bool ahci_command_wait(ahci_channel_t *pChannel, uint32_t timeout);
+bool ahci_command_execute(ahci_channel_t *pChannel, uint32_t timeout);
+bool ahci_command_failed(ahci_channel_t *pChannel);
+void ahci_command_start(ahci_channel_t *pChannel, ahci_command_packet_t *pCmdPacket);
+bool ahci_command_finish(ahci_driver_data_t *pDrvData, ahci_command_packet_t *pCmdPacket);
+
+// Job part
+int ahci_job_clone_start(ahci_driver_data_t *pDrvData, ahci_driver_data_t *pTargetDrvData,
+                         struct file *pTargetFile, ahci_clone_job_t *pParams);
+int ahci_job_image_start(ahci_driver_data_t *pDrvData, struct file *pImageFile, ahci_image_job_t *pParams);
+void ahci_job_get_status(ahci_driver_data_t *pDrvData, ahci_job_status_t *pStatus);
+void ahci_job_stop(ahci_driver_data_t *pDrvData);
+void ahci_job_detach_target(ahci_driver_data_t *pDrvData);
+bool ahci_job_port_busy(ahci_driver_data_t *pDrvData, uint8_t port);
 
 // IOCTL part
 int device_open(struct inode *pInode, struct file *pFile);
 int device_release(struct inode *pInode, struct file *pFile);
 long device_ioctl(struct file *pFile, unsigned int cmd, unsigned long arg);
+int device_mmap(struct file *pFile, struct vm_area_struct *pVma);
+bool ahci_port_held(ahci_channel_t *pChannel, ahci_file_t *pFileData);
+bool ahci_file_port_allowed(ahci_file_t *pFileData, uint8_t port);
+
+// Block device part
+int ahci_blkdev_attach(ahci_driver_data_t *pDrvData, uint8_t port, uint8_t pmp);
+void ahci_blkdev_detach(ahci_driver_data_t *pDrvData, uint8_t port);
+bool ahci_blkdev_attached(ahci_driver_data_t *pDrvData, uint8_t port);
+int ahci_blkdev_init(void);
+void ahci_blkdev_exit(void);
+
+// Pinned buffers cache part
+void ahci_cache_init(ahci_file_t *pFileData);
+void ahci_cache_release(ahci_file_t *pFileData);
+ahci_pin_t *ahci_cache_get(ahci_file_t *pFileData, ahci_buffer_t *pBuffer);
+void ahci_cache_put(ahci_file_t *pFileData, ahci_pin_t *pPin);
+
+// Link speed part, caller must hold channel lock
+void ahci_link_monitor(ahci_driver_data_t *pDrvData, uint8_t port);
+void ahci_link_update(ahci_driver_data_t *pDrvData, uint8_t port);
+void ahci_link_set_policy(ahci_driver_data_t *pDrvData, ahci_link_policy_t *pPolicy);
+
+// Error localization part, caller must hold channel lock
+int ahci_locate_read(ahci_driver_data_t *pDrvData, ahci_locate_t *pLocate, ahci_pin_t *pPin);
+
+// Batch part, caller must hold channel lock
+int ahci_batch_read(ahci_driver_data_t *pDrvData, ahci_batch_t *pBatch, ahci_batch_entry_t *pEntries);
+
+// Recorder part
+void ahci_record_init(ahci_recorder_t *pRecorder);
+void ahci_record_release(ahci_recorder_t *pRecorder);
+void ahci_record_command(ahci_channel_t *pChannel, ahci_command_packet_t *pCmdPacket, ktime_t issued);
+uint64_t ahci_record_head(ahci_recorder_t *pRecorder);
+bool ahci_record_fetch(ahci_recorder_t *pRecorder, uint64_t seq, ahci_record_t *pRecord);
+
+// Fault injection part, caller must hold channel lock
+bool ahci_fault_issue(ahci_channel_t *pChannel, ahci_command_packet_t *pCmdPacket);
+bool ahci_fault_wait(ahci_channel_t *pChannel, uint32_t timeout);
+uint8_t ahci_fault_status(ahci_channel_t *pChannel);
+uint8_t ahci_fault_error(ahci_channel_t *pChannel);
+bool ahci_fault_blocked(ahci_channel_t *pChannel, uint32_t timeout);
+void ahci_fault_clear(ahci_channel_t *pChannel, bool link);
+
+// Debugfs part
+void ahci_debugfs_init(void);
+void ahci_debugfs_exit(void);
+void ahci_debugfs_attach(ahci_driver_data_t *pDrvData, uint32_t bus);
+void ahci_debugfs_detach(ahci_driver_data_t *pDrvData);
+
+// Worker part
+void ahci_worker_start(ahci_driver_data_t *pDrvData);
+void ahci_worker_stop(ahci_driver_data_t *pDrvData);
+int ahci_worker_run_ata_command(ahci_driver_data_t *pDrvData, ahci_command_packet_t *pCmdPacket, ahci_pin_t *pPin);
+
+// Bandwidth limit part
+void ahci_rate_init(ahci_rate_t *pRate);
+int ahci_rate_wait(ahci_rate_t *pPortRate, ahci_rate_t *pFileRate, uint32_t bytes);
+void ahci_rate_refund(ahci_rate_t *pPortRate, ahci_rate_t *pFileRate, uint32_t bytes);
+void ahci_rate_account(ahci_rate_t *pRate, uint32_t bytes, uint64_t submitted);
+void ahci_rate_set_limit(ahci_rate_t *pRate, uint32_t limit);
+void ahci_rate_get(ahci_rate_t *pRate, uint32_t *pLimit, ahci_rate_stats_t *pStats);
+
+// Read/write part
+ssize_t device_read_iter(struct kiocb *pIocb, struct iov_iter *pIter);
+ssize_t device_write_iter(struct kiocb *pIocb, struct iov_iter *pIter);
 
 #endif // DRIVER_H
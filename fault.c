@@ -0,0 +1,189 @@
+/****************************************************************************
+**
+** This file is part of the MiniAHCI project.
+** Copyright (C) 2024 Alexander E. <aekhv@vk.com>
+** License: GNU GPL v2, see file LICENSE.
+**
+****************************************************************************/
+
+#include "driver.h"
+#include <linux/delay.h>
+
+// LBA range of a read, write or verify command, false for other commands
+static bool ahci_fault_range(ahci_ata_registers_t *pAta, uint64_t *pLba, uint32_t *pCount)
+{
+    switch (pAta->command) {
+    case ATA_COMMAND_READ_SECTORS_EXT:
+    case ATA_COMMAND_READ_DMA_EXT:
+    case ATA_COMMAND_WRITE_SECTORS_EXT:
+    case ATA_COMMAND_WRITE_DMA_EXT:
+    case ATA_COMMAND_READ_VERIFY_EXT:
+        *pLba = 0;
+        for (int i = 0; i < 6; i++)
+            *pLba |= (uint64_t)pAta->lba[i] << (i * 8);
+        // Sector count of zero means 65536 sectors
+        *pCount = pAta->count[0] | (pAta->count[1] << 8);
+        if (*pCount == 0)
+            *pCount = 65536;
+        return true;
+
+    case ATA_COMMAND_READ_SECTORS:
+    case ATA_COMMAND_READ_DMA:
+    case ATA_COMMAND_WRITE_SECTORS:
+    case ATA_COMMAND_WRITE_DMA:
+    case ATA_COMMAND_READ_VERIFY:
+        *pLba = pAta->lba[0] | (pAta->lba[1] << 8) | (pAta->lba[2] << 16) | ((uint32_t)(pAta->device & 0x0F) << 24);
+        // Sector count of zero means 256 sectors
+        *pCount = pAta->count[0] ? pAta->count[0] : 256;
+        return true;
+
+    default:
+        return false;
+    }
+}
+
+static bool ahci_fault_overlap(uint64_t lba, uint32_t count, uint64_t start, uint32_t length)
+{
+    return (length != 0) && (lba < start + length) && (start < lba + count);
+}
+
+static bool ahci_fault_every(uint32_t every, uint64_t n)
+{
+    return (every != 0) && (n % every == 0);
+}
+
+// Before the issue: delays, lost commands, hangs and link drops. Returns false if the command must not reach the device.
+// Called only while faults are enabled
+bool ahci_fault_issue(ahci_channel_t *pChannel, ahci_command_packet_t *pCmdPacket)
+{
+    ahci_fault_t *pFault = &(pChannel->fault);
+    FIS_REG_H2D *pFis = &(pChannel->pCmdTable->cfis);
+    uint64_t lba = 0;
+    uint32_t count = 0;
+    bool range;
+
+    pFault->tfd = false;
+    pFault->unc = false;
+    pFault->issued = true;
+    pFault->commands++;
+    range = ahci_fault_range(&(pCmdPacket->ata), &lba, &count);
+
+    if (range && ahci_fault_overlap(lba, count, pFault->slowLba, pFault->slowCount)) {
+        pFault->injected++;
+        usleep_range(pFault->slowDelay, pFault->slowDelay + pFault->slowDelay / 8 + 1);
+    }
+
+    if (ahci_fault_every(pFault->timeoutEvery, pFault->commands)) {
+        pFault->injected++;
+        pFault->issued = false;
+        return false;
+    }
+
+    if (ahci_fault_every(pFault->hangEvery, pFault->commands)) {
+        pFault->injected++;
+        pFault->hang = true;
+    }
+
+    if (ahci_fault_every(pFault->linkDropEvery, pFault->commands)) {
+        pFault->injected++;
+        pFault->linkDown = true;
+    }
+
+    if (pFault->hang || pFault->linkDown) {
+        pFault->issued = false;
+        return false;
+    }
+
+    if (!range || pCmdPacket->buffer.write || !ahci_fault_overlap(lba, count, pFault->badLba, pFault->badCount))
+        return true;
+
+    pFault->injected++;
+    pFault->unc = true;
+    pFault->errorLba = max_t(uint64_t, lba, pFault->badLba);
+
+    // Bad range starts at the first sector, nothing is read
+    if (pFault->errorLba == lba) {
+        pChannel->pCmdHeader->prdbc = 0;
+        pFault->issued = false;
+        return false;
+    }
+
+    // Sectors before the bad range are read by the device itself
+    pFis->countl = pFault->errorLba - lba;
+    pFis->counth = (pFault->errorLba - lba) >> 8;
+
+    return true;
+}
+
+// Instead of the plain wait: a command kept from the device times out, a read stopped before the bad range fails
+bool ahci_fault_wait(ahci_channel_t *pChannel, uint32_t timeout)
+{
+    ahci_fault_t *pFault = &(pChannel->fault);
+    FIS_REG_D2H *pRfis;
+
+    if (pFault->issued) {
+        if (!ahci_command_wait(pChannel, timeout))
+            return false;
+        if (!pFault->unc || ahci_command_failed(pChannel))
+            return true;
+    } else if (!pFault->unc) {
+        // Nothing reaches the device, so the command times out and the recovery runs for real
+        msleep(timeout);
+        return false;
+    }
+
+    pFault->tfd = true;
+    pFault->status = ATA_STATUS_DRDY | ATA_STATUS_ERR;
+    pFault->error = ATA_ERROR_UNC;
+
+    // Error LBA is reported the way the device does it
+    pRfis = &(pChannel->pRcvdFis->rfis);
+    pRfis->status = pFault->status;
+    pRfis->error = pFault->error;
+    pRfis->lba0 = pFault->errorLba;
+    pRfis->lba1 = pFault->errorLba >> 8;
+    pRfis->lba2 = pFault->errorLba >> 16;
+    pRfis->lba3 = pFault->errorLba >> 24;
+    pRfis->lba4 = pFault->errorLba >> 32;
+    pRfis->lba5 = pFault->errorLba >> 40;
+
+    return true;
+}
+
+// Busy device or dropped link never clears BSY, an injected error replaces the device registers
+uint8_t ahci_fault_status(ahci_channel_t *pChannel)
+{
+    ahci_fault_t *pFault = &(pChannel->fault);
+
+    if (pFault->hang || pFault->linkDown)
+        return ATA_STATUS_BSY;
+
+    return pFault->tfd ? pFault->status : pChannel->pPort->tfd.status;
+}
+
+uint8_t ahci_fault_error(ahci_channel_t *pChannel)
+{
+    return pChannel->fault.tfd ? pChannel->fault.error : pChannel->pPort->tfd.error;
+}
+
+// Internal commands: resets and port multiplier access. Busy device or dropped link never completes a command,
+// returns true after the timeout in this case
+bool ahci_fault_blocked(ahci_channel_t *pChannel, uint32_t timeout)
+{
+    // Injected error belongs to the previous command
+    pChannel->fault.tfd = false;
+
+    if (!pChannel->fault.hang && !pChannel->fault.linkDown)
+        return false;
+
+    msleep(timeout);
+    return true;
+}
+
+// Command list override and software reset clear a hang, COMRESET restores the link as well
+void ahci_fault_clear(ahci_channel_t *pChannel, bool link)
+{
+    pChannel->fault.hang = false;
+    if (link)
+        pChannel->fault.linkDown = false;
+}
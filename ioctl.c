@@ -7,25 +7,134 @@
 ****************************************************************************/
 
 #include "driver.h"
+#include <linux/file.h>
+#include <linux/ktime.h>
 
 int device_open(struct inode *pInode, struct file *pFile)
 {
-    ahci_driver_data_t *pDrvData = container_of(pInode->i_cdev, ahci_driver_data_t, charDevice);
-    pFile->private_data = pDrvData;
-
-    if ((pFile->f_flags & O_ACCMODE) != O_RDWR)
+    ahci_driver_data_t *pDrvData;
+    ahci_channel_t *pNode = NULL;
+    ahci_file_t *pFileData;
+    uint32_t pi;
+    int err = 0;
+
+    // Read only access is allowed for read() and pread() only
+    if ((pFile->f_flags & O_ACCMODE) == O_WRONLY)
         return -EACCES;
 
+    if (iminor(pInode) >= AHCI_CONTROLLERS_MAX) {
+        pNode = container_of(pInode->i_cdev, ahci_channel_t, charDevice);
+        pDrvData = pNode->pDrvData;
+    } else
+        pDrvData = container_of(pInode->i_cdev, ahci_driver_data_t, charDevice);
+
+    // Only a port can be held exclusively
+    if ((pFile->f_flags & O_EXCL) && !pNode)
+        return -EINVAL;
+
+    pFileData = kzalloc(sizeof(ahci_file_t), GFP_KERNEL);
+    if (!pFileData)
+        return -ENOMEM;
+
+    if (pNode) {
+        spin_lock(&(pNode->openLock));
+        if (pNode->pOwner || ((pFile->f_flags & O_EXCL) && (pNode->openCount != 0)))
+            err = -EBUSY;
+        else {
+            pNode->openCount++;
+            if (pFile->f_flags & O_EXCL)
+                pNode->pOwner = pFileData;
+        }
+        spin_unlock(&(pNode->openLock));
+
+        // Jobs and block devices check the owner again before they start, so either side sees the other
+        if (!err && (pFile->f_flags & O_EXCL) && (ahci_job_port_busy(pDrvData, pNode - pDrvData->channel)
+                                                   || ahci_blkdev_attached(pDrvData, pNode - pDrvData->channel))) {
+            spin_lock(&(pNode->openLock));
+            pNode->openCount--;
+            pNode->pOwner = NULL;
+            spin_unlock(&(pNode->openLock));
+            err = -EBUSY;
+        }
+
+        if (err) {
+            kfree(pFileData);
+            return err;
+        }
+    }
+
+    pi = pDrvData->pAhciMem->pi;
+    pFileData->pDrvData = pDrvData;
+    pFileData->pNode = pNode;
+    pFileData->port = pNode ? pNode - pDrvData->channel : (pi ? __ffs(pi) : 0); // First implemented port by default
+    pFileData->pmp = 0;
+    ahci_cache_init(pFileData);
+    ahci_rate_init(&(pFileData->rate));
+    pFile->private_data = pFileData;
+
     return 0;
 }
 
 int device_release(struct inode *pInode, struct file *pFile)
 {
+    ahci_file_t *pFileData = pFile->private_data;
+    ahci_channel_t *pNode = pFileData->pNode;
     (void)(pInode);
-    (void)(pFile);
+
+    if (pNode) {
+        spin_lock(&(pNode->openLock));
+        pNode->openCount--;
+        if (pNode->pOwner == pFileData)
+            pNode->pOwner = NULL;
+        spin_unlock(&(pNode->openLock));
+    }
+
+    ahci_cache_release(pFileData);
+    kfree(pFileData);
     return 0;
 }
 
+bool ahci_port_held(ahci_channel_t *pChannel, ahci_file_t *pFileData)
+{
+    bool held;
+
+    spin_lock(&(pChannel->openLock));
+    held = pChannel->pOwner && (pChannel->pOwner != pFileData);
+    spin_unlock(&(pChannel->openLock));
+
+    return held;
+}
+
+bool ahci_file_port_allowed(ahci_file_t *pFileData, uint8_t port)
+{
+    ahci_channel_t *pChannel = &(pFileData->pDrvData->channel[port]);
+
+    // Port node addresses its own port only
+    if (pFileData->pNode)
+        return pFileData->pNode == pChannel;
+
+    // Controller node can't reach a port held exclusively
+    return !ahci_port_held(pChannel, pFileData);
+}
+
+int device_mmap(struct file *pFile, struct vm_area_struct *pVma)
+{
+    ahci_file_t *pFileData = pFile->private_data;
+    ahci_driver_data_t *pDrvData = pFileData->pDrvData;
+
+    // Status page only, and it's read only
+    if ((pVma->vm_pgoff != 0) || (pVma->vm_end - pVma->vm_start != PAGE_SIZE) || (pVma->vm_flags & VM_WRITE))
+        return -EINVAL;
+
+    if (!pDrvData->pStatusPage)
+        return -ENOMEM;
+
+    vm_flags_clear(pVma, VM_MAYWRITE);
+
+    // Page reference is taken, so unmapping may happen after the controller removal
+    return vm_insert_page(pVma, pVma->vm_start, virt_to_page(pDrvData->pStatusPage));
+}
+
 static int ioctl_get_driver_version(minipci_driver_version_t *pVersion)
 {
     minipci_driver_version_t version;
@@ -89,26 +198,32 @@ static int ioctl_get_controller_info(ahci_driver_data_t *pDrvData, ahci_controll
     return 0;
 }
 
-static bool port_number_is_valid(ahci_driver_data_t *pDrvData, uint8_t port)
+static bool port_number_is_valid(ahci_file_t *pFileData, uint8_t port)
 {
     if (port >= AHCI_NUMBER_OF_PORTS_MAX)
         return false;
 
-    uint32_t pi = pDrvData->pAhciMem->pi & (1 << port);
+    uint32_t pi = pFileData->pDrvData->pAhciMem->pi & (1 << port);
     if (pi == 0)
         return false;
 
-    return true;
+    return ahci_file_port_allowed(pFileData, port);
 }
 
-static int ioctl_get_port_status(ahci_driver_data_t *pDrvData, ahci_port_status_t *pStatus)
+static bool pmp_number_is_valid(uint8_t pmp)
 {
+    return pmp < AHCI_PMP_PORTS_MAX;
+}
+
+static int ioctl_get_port_status(ahci_file_t *pFileData, ahci_port_status_t *pStatus)
+{
+    ahci_driver_data_t *pDrvData = pFileData->pDrvData;
     ahci_port_status_t status;
 
     if (copy_from_user(&status, pStatus, sizeof (status)))
         return -EFAULT;
 
-    if (!port_number_is_valid(pDrvData, status.port))
+    if (!port_number_is_valid(pFileData, status.port) || !pmp_number_is_valid(status.pmp))
         return -EINVAL;
 
     ahci_channel_t *pChannel = &(pDrvData->channel[status.port]);
@@ -117,8 +232,8 @@ static int ioctl_get_port_status(ahci_driver_data_t *pDrvData, ahci_port_status_
     status.link.sig = pPort->sig;
     status.link.det = pPort->ssts.det;
     status.link.spd = pPort->ssts.spd;
-    status.ata.status = pPort->tfd.status;
-    status.ata.error = pPort->tfd.error;
+    status.ata.status = ahci_ata_status(pChannel);
+    status.ata.error = ahci_ata_error(pChannel);
 
     HBA_RECEIVED_FIS *pRcvdFis = pChannel->pRcvdFis;
 //    status.ata.status = pRcvdFis->rfis.status;
@@ -136,20 +251,59 @@ static int ioctl_get_port_status(ahci_driver_data_t *pDrvData, ahci_port_status_
     return 0;
 }
 
-static int ioctl_run_ata_command(ahci_driver_data_t *pDrvData, ahci_command_packet_t *pCmdPacket)
+static int ioctl_run_ata_command(ahci_file_t *pFileData, ahci_command_packet_t *pCmdPacket)
 {
+    ahci_driver_data_t *pDrvData = pFileData->pDrvData;
     ahci_command_packet_t packet;
+    ahci_pin_t *pPin;
 
     if (copy_from_user(&packet, pCmdPacket, sizeof (packet)))
         return -EFAULT;
 
-    if (!port_number_is_valid(pDrvData, packet.port))
+    if (!port_number_is_valid(pFileData, packet.port) || !pmp_number_is_valid(packet.pmp))
         return -EINVAL;
 
     if (packet.buffer.length > AHCI_DATA_BUFFER_SIZE_MAX)
         return -EINVAL;
 
-    ahci_run_ata_command(pDrvData, &packet);
+    if (packet.flags & ~(AHCI_COMMAND_FLAG_CRC32C | AHCI_COMMAND_FLAG_SECTOR_MAP | AHCI_COMMAND_FLAG_FIS_SNAPSHOT))
+        return -EINVAL;
+
+    ahci_channel_t *pChannel = &(pDrvData->channel[packet.port]);
+    const uint32_t mapSize = DIV_ROUND_UP(packet.buffer.length / AHCI_SECTOR_SIZE, 8);
+    int err;
+
+    const uint64_t submitted = ktime_get_ns();
+    err = ahci_rate_wait(&(pChannel->rate), &(pFileData->rate), packet.buffer.length);
+    if (err)
+        return err;
+
+    pPin = ahci_cache_get(pFileData, &(packet.buffer));
+    if (mutex_lock_interruptible(&(pChannel->lock))) {
+        ahci_cache_put(pFileData, pPin);
+        ahci_rate_refund(&(pChannel->rate), &(pFileData->rate), packet.buffer.length);
+        return -ERESTARTSYS;
+    }
+    ahci_rate_account(&(pChannel->rate), packet.buffer.length, submitted);
+    ahci_rate_account(&(pFileData->rate), packet.buffer.length, submitted);
+    err = ahci_worker_run_ata_command(pDrvData, &packet, pPin);
+    // Copying to user memory may fault and invalidate cached buffer
+    ahci_cache_put(pFileData, pPin);
+    // Bitmaps belong to the channel, they are copied before the next command
+    if (!err && (packet.flags & AHCI_COMMAND_FLAG_SECTOR_MAP) && (packet.buffer.length != 0)) {
+        if (packet.map.zero && copy_to_user(packet.map.zero, pChannel->zeroMap, mapSize))
+            err = -EFAULT;
+        if (packet.map.pattern && copy_to_user(packet.map.pattern, pChannel->patternMap, mapSize))
+            err = -EFAULT;
+    }
+    // Snapshot is taken on timeout as well, it shows the state the recovery started from
+    if (!err && (packet.flags & AHCI_COMMAND_FLAG_FIS_SNAPSHOT) && packet.snapshot
+            && copy_to_user(packet.snapshot, &(pChannel->snapshot), sizeof(ahci_fis_snapshot_t)))
+        err = -EFAULT;
+    mutex_unlock(&(pChannel->lock));
+
+    if (err)
+        return err;
 
     if (copy_to_user(pCmdPacket, &packet, sizeof (packet)))
         return -EFAULT;
@@ -157,34 +311,36 @@ static int ioctl_run_ata_command(ahci_driver_data_t *pDrvData, ahci_command_pack
     return 0;
 }
 
-static int ioctl_set_port_timeout(ahci_driver_data_t *pDrvData, ahci_port_timeout_t *pTimeout)
+static int ioctl_set_port_timeout(ahci_file_t *pFileData, ahci_port_timeout_t *pTimeout)
 {
+    ahci_driver_data_t *pDrvData = pFileData->pDrvData;
     ahci_port_timeout_t timeout;
 
     if (copy_from_user(&timeout, pTimeout, sizeof (timeout)))
         return -EFAULT;
 
-    if (!port_number_is_valid(pDrvData, timeout.port))
+    if (!port_number_is_valid(pFileData, timeout.port) || !pmp_number_is_valid(timeout.pmp))
         return -EINVAL;
 
     ahci_channel_t *pChannel = &(pDrvData->channel[timeout.port]);
-    pChannel->timeout = timeout.value;
+    pChannel->timeout[timeout.pmp] = timeout.value;
 
     return 0;
 }
 
-static int ioctl_get_port_timeout(ahci_driver_data_t *pDrvData, ahci_port_timeout_t *pTimeout)
+static int ioctl_get_port_timeout(ahci_file_t *pFileData, ahci_port_timeout_t *pTimeout)
 {
+    ahci_driver_data_t *pDrvData = pFileData->pDrvData;
     ahci_port_timeout_t timeout;
 
     if (copy_from_user(&timeout, pTimeout, sizeof (timeout)))
         return -EFAULT;
 
-    if (!port_number_is_valid(pDrvData, timeout.port))
+    if (!port_number_is_valid(pFileData, timeout.port) || !pmp_number_is_valid(timeout.pmp))
         return -EINVAL;
 
     ahci_channel_t *pChannel = &(pDrvData->channel[timeout.port]);
-    timeout.value = pChannel->timeout;
+    timeout.value = pChannel->timeout[timeout.pmp];
 
     if (copy_to_user(pTimeout, &timeout, sizeof (timeout)))
         return -EFAULT;
@@ -192,17 +348,71 @@ static int ioctl_get_port_timeout(ahci_driver_data_t *pDrvData, ahci_port_timeou
     return 0;
 }
 
-static int ioctl_port_software_reset(ahci_driver_data_t *pDrvData, ahci_command_packet_t *pCmdPacket)
+static int ioctl_set_recovery_config(ahci_file_t *pFileData, ahci_recovery_config_t *pConfig)
 {
+    ahci_driver_data_t *pDrvData = pFileData->pDrvData;
+    ahci_recovery_config_t config;
+
+    if (copy_from_user(&config, pConfig, sizeof (config)))
+        return -EFAULT;
+
+    if (!port_number_is_valid(pFileData, config.port) || (config.stage > AHCI_RECOVERY_COMRESET))
+        return -EINVAL;
+
+    ahci_channel_t *pChannel = &(pDrvData->channel[config.port]);
+
+    if (mutex_lock_interruptible(&(pChannel->lock)))
+        return -ERESTARTSYS;
+    pChannel->recoveryStage = config.stage;
+    for (int i = 0; i < 3; i++)
+        pChannel->recoveryBudget[i] = config.budget[i];
+    mutex_unlock(&(pChannel->lock));
+
+    return 0;
+}
+
+static int ioctl_get_recovery_config(ahci_file_t *pFileData, ahci_recovery_config_t *pConfig)
+{
+    ahci_driver_data_t *pDrvData = pFileData->pDrvData;
+    ahci_recovery_config_t config;
+
+    if (copy_from_user(&config, pConfig, sizeof (config)))
+        return -EFAULT;
+
+    if (!port_number_is_valid(pFileData, config.port))
+        return -EINVAL;
+
+    ahci_channel_t *pChannel = &(pDrvData->channel[config.port]);
+
+    if (mutex_lock_interruptible(&(pChannel->lock)))
+        return -ERESTARTSYS;
+    config.stage = pChannel->recoveryStage;
+    for (int i = 0; i < 3; i++)
+        config.budget[i] = pChannel->recoveryBudget[i];
+    mutex_unlock(&(pChannel->lock));
+
+    if (copy_to_user(pConfig, &config, sizeof (config)))
+        return -EFAULT;
+
+    return 0;
+}
+
+static int ioctl_port_software_reset(ahci_file_t *pFileData, ahci_command_packet_t *pCmdPacket)
+{
+    ahci_driver_data_t *pDrvData = pFileData->pDrvData;
     ahci_command_packet_t packet;
 
     if (copy_from_user(&packet, pCmdPacket, sizeof (packet)))
         return -EFAULT;
 
-    if (!port_number_is_valid(pDrvData, packet.port))
+    if (!port_number_is_valid(pFileData, packet.port) || !pmp_number_is_valid(packet.pmp))
         return -EINVAL;
 
+    ahci_channel_t *pChannel = &(pDrvData->channel[packet.port]);
+    if (mutex_lock_interruptible(&(pChannel->lock)))
+        return -ERESTARTSYS;
     ahci_port_software_reset(pDrvData, &packet);
+    mutex_unlock(&(pChannel->lock));
 
     if (copy_to_user(pCmdPacket, &packet, sizeof (packet)))
         return -EFAULT;
@@ -210,28 +420,505 @@ static int ioctl_port_software_reset(ahci_driver_data_t *pDrvData, ahci_command_
     return 0;
 }
 
-static int ioctl_port_hardware_reset(ahci_driver_data_t *pDrvData, ahci_command_packet_t *pCmdPacket)
+static int ioctl_port_hardware_reset(ahci_file_t *pFileData, ahci_command_packet_t *pCmdPacket)
 {
+    ahci_driver_data_t *pDrvData = pFileData->pDrvData;
     ahci_command_packet_t packet;
 
     if (copy_from_user(&packet, pCmdPacket, sizeof (packet)))
         return -EFAULT;
 
-    if (!port_number_is_valid(pDrvData, packet.port))
+    if (!port_number_is_valid(pFileData, packet.port) || !pmp_number_is_valid(packet.pmp))
         return -EINVAL;
 
+    ahci_channel_t *pChannel = &(pDrvData->channel[packet.port]);
+    if (mutex_lock_interruptible(&(pChannel->lock)))
+        return -ERESTARTSYS;
     ahci_port_hardware_reset(pDrvData, &packet);
+    mutex_unlock(&(pChannel->lock));
+
+    return 0;
+}
+
+static int ioctl_bulk_hardware_reset(ahci_file_t *pFileData, ahci_bulk_reset_t *pReset)
+{
+    ahci_driver_data_t *pDrvData = pFileData->pDrvData;
+    ahci_bulk_reset_t reset;
+    uint32_t i, locked = 0;
+
+    if (copy_from_user(&reset, pReset, sizeof (reset)))
+        return -EFAULT;
+
+    reset.ports &= pDrvData->pAhciMem->pi;
+    if (reset.ports == 0)
+        return -EINVAL;
+
+    for (i = 0; i < AHCI_NUMBER_OF_PORTS_MAX; i++) {
+        if ((reset.ports & (1U << i)) && !ahci_file_port_allowed(pFileData, i))
+            return -EINVAL;
+    }
+
+    // Ascending order, the same as jobs use for channels of one controller
+    for (i = 0; i < AHCI_NUMBER_OF_PORTS_MAX; i++) {
+        if (!(reset.ports & (1U << i)))
+            continue;
+        if (mutex_lock_interruptible(&(pDrvData->channel[i].lock)))
+            break;
+        locked |= 1U << i;
+    }
+
+    if (locked == reset.ports) {
+        memset(reset.time, 0, sizeof (reset.time));
+        reset.ready = ahci_ports_comreset(pDrvData, reset.ports, reset.timeout, reset.time);
+    }
+
+    for (i = 0; i < AHCI_NUMBER_OF_PORTS_MAX; i++) {
+        if (locked & (1U << i))
+            mutex_unlock(&(pDrvData->channel[i].lock));
+    }
+
+    if (locked != reset.ports)
+        return -ERESTARTSYS;
+
+    if (copy_to_user(pReset, &reset, sizeof (reset)))
+        return -EFAULT;
+
+    return 0;
+}
+
+static int ioctl_read_locate(ahci_file_t *pFileData, ahci_locate_t *pLocate)
+{
+    ahci_driver_data_t *pDrvData = pFileData->pDrvData;
+    ahci_locate_t locate;
+    ahci_buffer_t buffer;
+    ahci_pin_t *pPin;
+
+    if (copy_from_user(&locate, pLocate, sizeof (locate)))
+        return -EFAULT;
+
+    if (!port_number_is_valid(pFileData, locate.port) || !pmp_number_is_valid(locate.pmp))
+        return -EINVAL;
+
+    if ((locate.count == 0) || (locate.count > AHCI_DATA_BUFFER_SIZE_MAX / AHCI_SECTOR_SIZE))
+        return -EINVAL;
+
+    // 48-bit address limit
+    if ((locate.lba + locate.count < locate.lba) || (locate.lba + locate.count > (1ULL << 48)))
+        return -ENXIO;
+
+    ahci_channel_t *pChannel = &(pDrvData->channel[locate.port]);
+    int err;
+
+    // The whole buffer is pinned once, split reads use parts of it
+    buffer.pointer = locate.pointer;
+    buffer.length = locate.count * AHCI_SECTOR_SIZE;
+    buffer.write = false;
+
+    const uint64_t submitted = ktime_get_ns();
+    err = ahci_rate_wait(&(pChannel->rate), &(pFileData->rate), buffer.length);
+    if (err)
+        return err;
+
+    pPin = ahci_cache_get(pFileData, &buffer);
+    if (mutex_lock_interruptible(&(pChannel->lock))) {
+        ahci_cache_put(pFileData, pPin);
+        ahci_rate_refund(&(pChannel->rate), &(pFileData->rate), buffer.length);
+        return -ERESTARTSYS;
+    }
+    ahci_rate_account(&(pChannel->rate), buffer.length, submitted);
+    ahci_rate_account(&(pFileData->rate), buffer.length, submitted);
+    err = ahci_locate_read(pDrvData, &locate, pPin);
+    ahci_cache_put(pFileData, pPin);
+    mutex_unlock(&(pChannel->lock));
+
+    if (err)
+        return err;
+
+    if (copy_to_user(pLocate, &locate, sizeof (locate)))
+        return -EFAULT;
+
+    return 0;
+}
+
+static int ioctl_read_batch(ahci_file_t *pFileData, ahci_batch_t *pBatch)
+{
+    ahci_driver_data_t *pDrvData = pFileData->pDrvData;
+    ahci_batch_entry_t *pEntries;
+    ahci_batch_t batch;
+    uint32_t bytes = 0; // 1 GB at most
+
+    if (copy_from_user(&batch, pBatch, sizeof (batch)))
+        return -EFAULT;
+
+    if (!port_number_is_valid(pFileData, batch.port) || !pmp_number_is_valid(batch.pmp))
+        return -EINVAL;
+
+    if ((batch.count == 0) || (batch.count > AHCI_BATCH_ENTRIES_MAX) || (batch.order > AHCI_BATCH_ORDER_SCAN))
+        return -EINVAL;
+
+    pEntries = kvmalloc_array(batch.count, sizeof(ahci_batch_entry_t), GFP_KERNEL);
+    if (!pEntries)
+        return -ENOMEM;
+
+    if (copy_from_user(pEntries, batch.entries, batch.count * sizeof(ahci_batch_entry_t))) {
+        kvfree(pEntries);
+        return -EFAULT;
+    }
+
+    for (uint32_t i = 0; i < batch.count; i++) {
+        if ((pEntries[i].count == 0) || (pEntries[i].count > AHCI_DATA_BUFFER_SIZE_MAX / AHCI_SECTOR_SIZE)
+                || (pEntries[i].lba + pEntries[i].count < pEntries[i].lba)
+                || (pEntries[i].lba + pEntries[i].count > (1ULL << 48))) {
+            kvfree(pEntries);
+            return -EINVAL;
+        }
+        bytes += pEntries[i].count * AHCI_SECTOR_SIZE;
+    }
+
+    ahci_channel_t *pChannel = &(pDrvData->channel[batch.port]);
+    int err;
+
+    const uint64_t submitted = ktime_get_ns();
+    err = ahci_rate_wait(&(pChannel->rate), &(pFileData->rate), bytes);
+    if (!err && mutex_lock_interruptible(&(pChannel->lock))) {
+        ahci_rate_refund(&(pChannel->rate), &(pFileData->rate), bytes);
+        err = -ERESTARTSYS;
+    }
+    if (err) {
+        kvfree(pEntries);
+        return err;
+    }
+    ahci_rate_account(&(pChannel->rate), bytes, submitted);
+    ahci_rate_account(&(pFileData->rate), bytes, submitted);
+    err = ahci_batch_read(pDrvData, &batch, pEntries);
+    mutex_unlock(&(pChannel->lock));
+
+    if (!err && (copy_to_user(batch.entries, pEntries, batch.count * sizeof(ahci_batch_entry_t))
+                 || copy_to_user(pBatch, &batch, sizeof (batch))))
+        err = -EFAULT;
+
+    kvfree(pEntries);
+
+    return err;
+}
+
+static int ioctl_set_link_policy(ahci_file_t *pFileData, ahci_link_policy_t *pPolicy)
+{
+    ahci_driver_data_t *pDrvData = pFileData->pDrvData;
+    ahci_link_policy_t policy;
+
+    if (copy_from_user(&policy, pPolicy, sizeof (policy)))
+        return -EFAULT;
+
+    if (!port_number_is_valid(pFileData, policy.port))
+        return -EINVAL;
+
+    if (policy.enable && ((policy.threshold == 0) || (policy.window == 0)))
+        return -EINVAL;
+
+    ahci_channel_t *pChannel = &(pDrvData->channel[policy.port]);
+    if (mutex_lock_interruptible(&(pChannel->lock)))
+        return -ERESTARTSYS;
+    ahci_link_set_policy(pDrvData, &policy);
+    mutex_unlock(&(pChannel->lock));
+
+    return 0;
+}
+
+static int ioctl_get_link_policy(ahci_file_t *pFileData, ahci_link_policy_t *pPolicy)
+{
+    ahci_driver_data_t *pDrvData = pFileData->pDrvData;
+    ahci_link_policy_t policy;
+
+    if (copy_from_user(&policy, pPolicy, sizeof (policy)))
+        return -EFAULT;
+
+    if (!port_number_is_valid(pFileData, policy.port))
+        return -EINVAL;
+
+    ahci_channel_t *pChannel = &(pDrvData->channel[policy.port]);
+    if (mutex_lock_interruptible(&(pChannel->lock)))
+        return -ERESTARTSYS;
+    policy = pChannel->linkPolicy;
+    mutex_unlock(&(pChannel->lock));
+
+    if (copy_to_user(pPolicy, &policy, sizeof (policy)))
+        return -EFAULT;
+
+    return 0;
+}
+
+static int ioctl_get_link_stats(ahci_file_t *pFileData, ahci_link_stats_t *pStats)
+{
+    ahci_driver_data_t *pDrvData = pFileData->pDrvData;
+    ahci_link_stats_t stats;
+
+    if (copy_from_user(&stats, pStats, sizeof (stats)))
+        return -EFAULT;
+
+    if (!port_number_is_valid(pFileData, stats.port))
+        return -EINVAL;
+
+    ahci_channel_t *pChannel = &(pDrvData->channel[stats.port]);
+    if (mutex_lock_interruptible(&(pChannel->lock)))
+        return -ERESTARTSYS;
+    stats = pChannel->linkStats;
+    stats.spd = pChannel->pPort->ssts.spd;
+    mutex_unlock(&(pChannel->lock));
+
+    if (copy_to_user(pStats, &stats, sizeof (stats)))
+        return -EFAULT;
+
+    return 0;
+}
+
+static int ioctl_pmp_enumerate(ahci_file_t *pFileData, ahci_pmp_info_t *pInfo)
+{
+    ahci_driver_data_t *pDrvData = pFileData->pDrvData;
+    ahci_pmp_info_t info;
+    int err;
+
+    if (copy_from_user(&info, pInfo, sizeof (info)))
+        return -EFAULT;
+
+    if (!port_number_is_valid(pFileData, info.port))
+        return -EINVAL;
+
+    ahci_channel_t *pChannel = &(pDrvData->channel[info.port]);
+    if (mutex_lock_interruptible(&(pChannel->lock)))
+        return -ERESTARTSYS;
+    err = ahci_pmp_enumerate(pDrvData, &info);
+    mutex_unlock(&(pChannel->lock));
+
+    if (err)
+        return err;
+
+    if (copy_to_user(pInfo, &info, sizeof (info)))
+        return -EFAULT;
+
+    return 0;
+}
+
+static int ioctl_clone_start(ahci_file_t *pFileData, ahci_clone_job_t *pJob)
+{
+    ahci_driver_data_t *pDrvData = pFileData->pDrvData;
+    ahci_clone_job_t job;
+    ahci_file_t *pTargetFileData = pFileData;
+    struct file *pTargetFile = NULL;
+    int err;
+
+    if (copy_from_user(&job, pJob, sizeof (job)))
+        return -EFAULT;
+
+    if (!port_number_is_valid(pFileData, job.port) || !pmp_number_is_valid(job.pmp) || !pmp_number_is_valid(job.targetPmp))
+        return -EINVAL;
+
+    if ((job.count == 0) || (job.chunk == 0) || (job.chunk > AHCI_DATA_BUFFER_SIZE_MAX / AHCI_SECTOR_SIZE))
+        return -EINVAL;
+
+    if (job.flags & ~AHCI_JOB_FLAG_CRC32C)
+        return -EINVAL;
+
+    // 48-bit address limit
+    if ((job.lba + job.count < job.lba) || (job.lba + job.count > (1ULL << 48)))
+        return -EINVAL;
+
+    if (job.targetFd >= 0) {
+        pTargetFile = fget(job.targetFd);
+        if (!pTargetFile)
+            return -EBADF;
+        if (pTargetFile->f_op != &fops) {
+            fput(pTargetFile);
+            return -EINVAL;
+        }
+        // The target drive is overwritten, a read only descriptor is not enough for that
+        if (!(pTargetFile->f_mode & FMODE_WRITE)) {
+            fput(pTargetFile);
+            return -EBADF;
+        }
+        pTargetFileData = pTargetFile->private_data;
+    }
+
+    // Target port must be accessible through the target file as well
+    if (!port_number_is_valid(pTargetFileData, job.targetPort)
+            || ((pTargetFileData->pDrvData == pDrvData) && (job.targetPort == job.port) && (job.targetPmp == job.pmp)))
+        err = -EINVAL;
+    else
+        err = ahci_job_clone_start(pDrvData, pTargetFileData->pDrvData, pTargetFile, &job);
+
+    if (pTargetFile)
+        fput(pTargetFile);
+
+    return err;
+}
+
+static int ioctl_image_start(ahci_file_t *pFileData, ahci_image_job_t *pJob)
+{
+    ahci_driver_data_t *pDrvData = pFileData->pDrvData;
+    ahci_image_job_t job;
+    struct file *pImageFile;
+    int err;
+
+    if (copy_from_user(&job, pJob, sizeof (job)))
+        return -EFAULT;
+
+    if (!port_number_is_valid(pFileData, job.port) || !pmp_number_is_valid(job.pmp))
+        return -EINVAL;
+
+    if ((job.count == 0) || (job.chunk == 0) || (job.chunk > AHCI_DATA_BUFFER_SIZE_MAX / AHCI_SECTOR_SIZE))
+        return -EINVAL;
+
+    if (job.flags & ~(AHCI_JOB_FLAG_CRC32C | AHCI_JOB_FLAG_SPARSE))
+        return -EINVAL;
+
+    // 48-bit address limit
+    if ((job.lba + job.count < job.lba) || (job.lba + job.count > (1ULL << 48)))
+        return -EINVAL;
+
+    pImageFile = fget(job.fd);
+    if (!pImageFile)
+        return -EBADF;
+
+    if (!(pImageFile->f_mode & FMODE_WRITE) || (pImageFile->f_op == &fops))
+        err = -EBADF;
+    else
+        err = ahci_job_image_start(pDrvData, pImageFile, &job);
+
+    fput(pImageFile);
+
+    return err;
+}
+
+static int ioctl_job_status(ahci_driver_data_t *pDrvData, ahci_job_status_t *pStatus)
+{
+    ahci_job_status_t status;
+
+    if (!pStatus)
+        return -EINVAL;
+
+    ahci_job_get_status(pDrvData, &status);
+
+    if (copy_to_user(pStatus, &status, sizeof(status)))
+        return -EFAULT;
+
+    return 0;
+}
+
+static int ioctl_select_port(ahci_file_t *pFileData, ahci_port_select_t *pSelect)
+{
+    ahci_port_select_t select;
+
+    if (copy_from_user(&select, pSelect, sizeof (select)))
+        return -EFAULT;
+
+    if (!port_number_is_valid(pFileData, select.port) || !pmp_number_is_valid(select.pmp))
+        return -EINVAL;
+
+    pFileData->port = select.port;
+    pFileData->pmp = select.pmp;
+
+    return 0;
+}
+
+static int ioctl_block_device(ahci_file_t *pFileData, ahci_port_select_t *pSelect, bool attach)
+{
+    ahci_driver_data_t *pDrvData = pFileData->pDrvData;
+    ahci_port_select_t select;
+
+    if (copy_from_user(&select, pSelect, sizeof (select)))
+        return -EFAULT;
+
+    if (!port_number_is_valid(pFileData, select.port) || !pmp_number_is_valid(select.pmp))
+        return -EINVAL;
+
+    if (!attach) {
+        ahci_blkdev_detach(pDrvData, select.port);
+        return 0;
+    }
+
+    return ahci_blkdev_attach(pDrvData, select.port, select.pmp);
+}
+
+static int ioctl_get_cache_stats(ahci_file_t *pFileData, ahci_cache_stats_t *pStats)
+{
+    ahci_cache_stats_t stats;
+
+    if (!pStats)
+        return -EINVAL;
+
+    mutex_lock(&(pFileData->cacheLock));
+    stats = pFileData->cacheStats;
+    mutex_unlock(&(pFileData->cacheLock));
+
+    if (copy_to_user(pStats, &stats, sizeof(stats)))
+        return -EFAULT;
+
+    return 0;
+}
+
+static int ioctl_set_rate_limit(ahci_file_t *pFileData, ahci_rate_limit_t *pLimit)
+{
+    ahci_rate_limit_t limit;
+
+    if (copy_from_user(&limit, pLimit, sizeof (limit)))
+        return -EFAULT;
+
+    if (limit.file) {
+        ahci_rate_set_limit(&(pFileData->rate), limit.limit);
+        return 0;
+    }
+
+    if (!port_number_is_valid(pFileData, limit.port))
+        return -EINVAL;
+
+    ahci_rate_set_limit(&(pFileData->pDrvData->channel[limit.port].rate), limit.limit);
+
+    return 0;
+}
+
+static int ioctl_get_rate_info(ahci_file_t *pFileData, ahci_rate_info_t *pInfo)
+{
+    ahci_rate_info_t info;
+
+    if (copy_from_user(&info, pInfo, sizeof (info)))
+        return -EFAULT;
+
+    if (!port_number_is_valid(pFileData, info.port))
+        return -EINVAL;
+
+    ahci_rate_get(&(pFileData->pDrvData->channel[info.port].rate), &(info.portLimit), &(info.portStats));
+    ahci_rate_get(&(pFileData->rate), &(info.fileLimit), &(info.fileStats));
+
+    if (copy_to_user(pInfo, &info, sizeof (info)))
+        return -EFAULT;
 
     return 0;
 }
 
 long device_ioctl(struct file *pFile, unsigned int cmd, unsigned long arg)
 {
-    ahci_driver_data_t *pDrvData = pFile->private_data;
+    ahci_file_t *pFileData = pFile->private_data;
+    ahci_driver_data_t *pDrvData = pFileData->pDrvData;
 
     if (_IOC_TYPE(cmd) != MINIPCI_IOCTL_BASE)
         return -EINVAL;
 
+    // Controller management requires read/write access
+    if ((pFile->f_flags & O_ACCMODE) != O_RDWR)
+        return -EACCES;
+
+    // Controller wide settings, jobs and block devices are managed through the controller node
+    if (pFileData->pNode) {
+        switch (cmd) {
+        case AHCI_IOCTL_CLONE_START:
+        case AHCI_IOCTL_IMAGE_START:
+        case AHCI_IOCTL_JOB_STOP:
+        case AHCI_IOCTL_BLOCK_DEVICE_ATTACH:
+        case AHCI_IOCTL_BLOCK_DEVICE_DETACH:
+            return -EACCES;
+        }
+    }
+
     switch (cmd) {
     case MINIPCI_IOCTL_GET_DRIVER_VERSION:
         return ioctl_get_driver_version((minipci_driver_version_t *)arg);
@@ -243,22 +930,80 @@ long device_ioctl(struct file *pFile, unsigned int cmd, unsigned long arg)
         return ioctl_get_controller_info(pDrvData, (ahci_controller_info_t *)arg);
 
     case AHCI_IOCTL_GET_PORT_STATUS:
-        return ioctl_get_port_status(pDrvData, (ahci_port_status_t *)arg);
+        return ioctl_get_port_status(pFileData, (ahci_port_status_t *)arg);
 
     case AHCI_IOCTL_RUN_ATA_COMMAND:
-        return ioctl_run_ata_command(pDrvData, (ahci_command_packet_t *)arg);
+        return ioctl_run_ata_command(pFileData, (ahci_command_packet_t *)arg);
 
     case AHCI_IOCTL_SET_PORT_TIMOUT:
-        return ioctl_set_port_timeout(pDrvData, (ahci_port_timeout_t *)arg);
+        return ioctl_set_port_timeout(pFileData, (ahci_port_timeout_t *)arg);
 
     case AHCI_IOCTL_GET_PORT_TIMOUT:
-        return ioctl_get_port_timeout(pDrvData, (ahci_port_timeout_t *)arg);
+        return ioctl_get_port_timeout(pFileData, (ahci_port_timeout_t *)arg);
 
     case AHCI_IOCTL_PORT_SOFTWARE_RESET:
-        return ioctl_port_software_reset(pDrvData, (ahci_command_packet_t *)arg);
+        return ioctl_port_software_reset(pFileData, (ahci_command_packet_t *)arg);
 
     case AHCI_IOCTL_PORT_HARDWARE_RESET:
-        return ioctl_port_hardware_reset(pDrvData, (ahci_command_packet_t *)arg);
+        return ioctl_port_hardware_reset(pFileData, (ahci_command_packet_t *)arg);
+
+    case AHCI_IOCTL_PMP_ENUMERATE:
+        return ioctl_pmp_enumerate(pFileData, (ahci_pmp_info_t *)arg);
+
+    case AHCI_IOCTL_CLONE_START:
+        return ioctl_clone_start(pFileData, (ahci_clone_job_t *)arg);
+
+    case AHCI_IOCTL_IMAGE_START:
+        return ioctl_image_start(pFileData, (ahci_image_job_t *)arg);
+
+    case AHCI_IOCTL_JOB_STATUS:
+        return ioctl_job_status(pDrvData, (ahci_job_status_t *)arg);
+
+    case AHCI_IOCTL_JOB_STOP:
+        ahci_job_stop(pDrvData);
+        return 0;
+
+    case AHCI_IOCTL_SELECT_PORT:
+        return ioctl_select_port(pFileData, (ahci_port_select_t *)arg);
+
+    case AHCI_IOCTL_BLOCK_DEVICE_ATTACH:
+        return ioctl_block_device(pFileData, (ahci_port_select_t *)arg, true);
+
+    case AHCI_IOCTL_BLOCK_DEVICE_DETACH:
+        return ioctl_block_device(pFileData, (ahci_port_select_t *)arg, false);
+
+    case AHCI_IOCTL_GET_CACHE_STATS:
+        return ioctl_get_cache_stats(pFileData, (ahci_cache_stats_t *)arg);
+
+    case AHCI_IOCTL_SET_RATE_LIMIT:
+        return ioctl_set_rate_limit(pFileData, (ahci_rate_limit_t *)arg);
+
+    case AHCI_IOCTL_GET_RATE_INFO:
+        return ioctl_get_rate_info(pFileData, (ahci_rate_info_t *)arg);
+
+    case AHCI_IOCTL_SET_RECOVERY_CONFIG:
+        return ioctl_set_recovery_config(pFileData, (ahci_recovery_config_t *)arg);
+
+    case AHCI_IOCTL_GET_RECOVERY_CONFIG:
+        return ioctl_get_recovery_config(pFileData, (ahci_recovery_config_t *)arg);
+
+    case AHCI_IOCTL_BULK_HARDWARE_RESET:
+        return ioctl_bulk_hardware_reset(pFileData, (ahci_bulk_reset_t *)arg);
+
+    case AHCI_IOCTL_SET_LINK_POLICY:
+        return ioctl_set_link_policy(pFileData, (ahci_link_policy_t *)arg);
+
+    case AHCI_IOCTL_GET_LINK_POLICY:
+        return ioctl_get_link_policy(pFileData, (ahci_link_policy_t *)arg);
+
+    case AHCI_IOCTL_GET_LINK_STATS:
+        return ioctl_get_link_stats(pFileData, (ahci_link_stats_t *)arg);
+
+    case AHCI_IOCTL_READ_LOCATE:
+        return ioctl_read_locate(pFileData, (ahci_locate_t *)arg);
+
+    case AHCI_IOCTL_READ_BATCH:
+        return ioctl_read_batch(pFileData, (ahci_batch_t *)arg);
 
     default:
         return -EINVAL;
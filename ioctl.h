@@ -31,10 +31,32 @@ typedef struct {
 
 typedef struct {
     uint8_t port;
+    uint8_t pmp;        // Port multiplier port
     ahci_port_link_status_t link;
     ahci_port_ata_status_t ata;
 } ahci_port_status_t;
 
+// Live port status, an entry of the status page mapped with mmap()
+typedef struct {
+    uint32_t seq;       // Odd while the entry is updated, a snapshot is consistent if it's even and unchanged after copying
+    bool busy;          // Command in flight
+    uint8_t det;        // Device detection and PHY state
+    uint8_t spd;        // Current interface speed
+    uint8_t status;     // ATA status register after the last command
+    uint8_t error;      // ATA error register after the last command
+    uint8_t lba[6];     // LBA from the D2H FIS of the last command
+    uint32_t sig;       // Attached device signature
+    uint64_t commands;  // Commands completed or timed out
+    uint64_t errors;    // Commands failed or timed out
+    uint64_t bytes;     // Bytes transferred
+} ahci_port_live_t;
+
+// Read only page shared by all open files of a controller, mmap() offset 0, one page length
+typedef struct {
+    uint32_t pi;        // Ports implemented
+    ahci_port_live_t port[32];
+} ahci_status_page_t;
+
 typedef struct {
     uint8_t features[2];
     uint8_t count[2];
@@ -49,18 +71,240 @@ typedef struct {
     bool write;         // Data direction: 0 - device to host (read), 1 - host to device (write)
 } ahci_buffer_t;
 
+// Command packet flags
+#define AHCI_COMMAND_FLAG_CRC32C    0x00000001  // Return CRC32C of the buffer after the command
+#define AHCI_COMMAND_FLAG_SECTOR_MAP 0x00000002 // Return zero and pattern sector bitmaps of the buffer
+#define AHCI_COMMAND_FLAG_FIS_SNAPSHOT 0x00000004 // Return received FIS and port registers at completion
+
+typedef struct {
+    uint8_t *zero;      // All zero sectors bitmap, bit N (LSB first) is sector N of the buffer, may be NULL
+    uint8_t *pattern;   // Pattern sectors bitmap, may be NULL
+    uint32_t value;     // Pattern: 32-bit value repeated over the whole sector
+} ahci_sector_map_t;
+
+// Received FIS area and port registers taken right after completion or timeout, before any recovery
+typedef struct {
+    uint8_t rfis[20];   // D2H register FIS
+    uint8_t psfis[20];  // PIO setup FIS: E_Status in byte 15, transfer count in bytes 16...17
+    uint8_t sdbfis[8];  // Set device bits FIS
+    uint32_t is;        // PxIS
+    uint32_t serr;      // PxSERR: ERR in bits 15...0, DIAG in bits 31...16
+    uint32_t tfd;       // PxTFD: ATA status in bits 7...0, ATA error in bits 15...8
+} ahci_fis_snapshot_t;
+
+// No error LBA reported by the device
+#define AHCI_ERROR_LBA_NONE         0xFFFFFFFFFFFFFFFFULL
+
+// Timeout recovery stages
+#define AHCI_RECOVERY_NONE          0       // Recovery is disabled or not needed
+#define AHCI_RECOVERY_STOP          1       // Port restart: PxCMD.ST cleared and set again
+#define AHCI_RECOVERY_SRST          2       // Software reset, preceded by command list override if the device stays busy
+#define AHCI_RECOVERY_COMRESET      3       // COMRESET and link up
+#define AHCI_RECOVERY_FAILED        0xFF    // All enabled stages failed
+
 typedef struct {
     uint8_t port;
+    uint8_t pmp;        // Port multiplier port: 0...14 - device port, 15 - control port
     bool timeout;
     ahci_ata_registers_t ata;
     ahci_buffer_t buffer;
+    uint32_t flags;     // AHCI_COMMAND_FLAG_*
+    uint32_t crc32c;    // CRC32C of the buffer, AHCI_COMMAND_FLAG_CRC32C only
+    ahci_sector_map_t map; // AHCI_COMMAND_FLAG_SECTOR_MAP only
+    uint8_t recovery;   // Stage restored the port after timeout, AHCI_RECOVERY_*
+    uint32_t transferred; // Bytes transferred by the HBA (PRDBC), data before the error LBA is valid on failed read
+    uint64_t errorLba;  // 48-bit LBA from the D2H FIS of a failed command, AHCI_ERROR_LBA_NONE otherwise
+    ahci_fis_snapshot_t *snapshot; // AHCI_COMMAND_FLAG_FIS_SNAPSHOT only
 } ahci_command_packet_t;
 
+// Recorded command, read from debugfs file miniahci/<bus>/port<N>/record
+typedef struct {
+    uint64_t seq;       // Number of the command on the port since the module load
+    uint64_t time;      // Issue time in nanoseconds, monotonic clock
+    uint32_t duration;  // Service time in microseconds, timeout recovery included
+    uint32_t length;    // Buffer length in bytes
+    uint32_t transferred; // Bytes transferred by the HBA
+    uint32_t flags;     // AHCI_COMMAND_FLAG_*
+    ahci_ata_registers_t ata;
+    uint8_t pmp;
+    bool write;
+    bool timeout;
+    uint8_t recovery;   // AHCI_RECOVERY_*
+    uint8_t status;     // ATA status register after the command
+    uint8_t error;      // ATA error register after the command
+} ahci_record_t;
+
 typedef struct {
     uint8_t port;
+    uint8_t pmp;        // Port multiplier port
     uint32_t value;     // Timeout in milliseconds
 } ahci_port_timeout_t;
 
+typedef struct {
+    uint8_t port;
+    uint8_t stage;      // Last stage to try after timeout, AHCI_RECOVERY_NONE - recovery disabled
+    uint32_t budget[3]; // Time budget of each stage in milliseconds: stop, software reset, COMRESET
+} ahci_recovery_config_t;
+
+typedef struct {
+    uint32_t ports;     // Bit mask of ports to reset, not implemented ports are ignored
+    uint32_t timeout;   // Link up timeout in milliseconds
+    uint32_t ready;     // Bit mask of ports with link up and device ready after the reset
+    uint32_t time[32];  // Link up time of ready ports in microseconds
+} ahci_bulk_reset_t;
+
+typedef struct {
+    uint8_t port;
+    bool enable;        // Adaptive link speed enabled
+    uint32_t threshold; // Interface errors per window lowering the speed
+    uint32_t window;    // Window length in commands
+    uint32_t upshift;   // Commands without interface errors raising the speed back, 0 - never
+} ahci_link_policy_t;
+
+typedef struct {
+    uint8_t port;
+    uint8_t spd;        // Current interface speed: 1 - 1.5 Gb/s, 2 - 3 Gb/s, 3 - 6 Gb/s
+    uint8_t limit;      // Speed allowed by the driver, 0 - no limit
+    uint64_t errors;    // Interface errors: SError CRC, decode, disparity, handshake and ATA ICRC
+    uint64_t downshifts;
+    uint64_t upshifts;
+} ahci_link_stats_t;
+
+// Bad extents returned by a localized read
+#define AHCI_LOCATE_EXTENTS_MAX     64
+
+typedef struct {
+    uint64_t lba;
+    uint32_t count;     // Number of sectors
+} ahci_extent_t;
+
+typedef struct {
+    uint8_t port;
+    uint8_t pmp;        // Port multiplier port
+    uint8_t *pointer;   // Buffer of count sectors, good sectors are read into it
+    uint64_t lba;       // First LBA
+    uint32_t count;     // Number of sectors, up to AHCI_DATA_BUFFER_SIZE_MAX / 512
+    uint32_t granularity; // Failed range of this size or smaller is not split anymore, 0 - one sector
+    uint32_t budget;    // Time budget of the whole read in milliseconds, 0 - port timeout
+    uint64_t next;      // First LBA not processed, sectors before it are either read or listed as bad
+    uint32_t good;      // Sectors read successfully
+    uint32_t commands;  // Read commands issued
+    bool timeout;       // A command timed out and the port was not recovered
+    uint8_t status;     // ATA status register of the last failed command
+    uint8_t error;      // ATA error register of the last failed command
+    uint32_t extentsCount;
+    ahci_extent_t extents[AHCI_LOCATE_EXTENTS_MAX]; // Bad extents in LBA order
+} ahci_locate_t;
+
+// Batched read order
+#define AHCI_BATCH_ORDER_NONE       0       // Submission order, no merging
+#define AHCI_BATCH_ORDER_CSCAN      1       // Sweep from the head position in one direction, then wrap around
+#define AHCI_BATCH_ORDER_SCAN       2       // Elevator: sweep from the head position, then back
+
+// Entries per batch
+#define AHCI_BATCH_ENTRIES_MAX      1024
+
+typedef struct {
+    uint8_t *pointer;   // Buffer of count sectors
+    uint64_t lba;
+    uint32_t count;     // Number of sectors, up to AHCI_DATA_BUFFER_SIZE_MAX / 512
+    int32_t result;     // Zero, -EIO - device error, -ETIMEDOUT, -ECANCELED - not read, or other negative error code
+    uint8_t status;     // ATA status register after the command read this entry
+    uint8_t error;      // ATA error register
+} ahci_batch_entry_t;
+
+typedef struct {
+    uint8_t port;
+    uint8_t pmp;        // Port multiplier port
+    uint8_t order;      // AHCI_BATCH_ORDER_*
+    bool descending;    // Sweep towards lower LBAs first
+    uint32_t count;     // Number of entries
+    ahci_batch_entry_t *entries;
+    uint32_t commands;  // Read commands issued after merging
+    uint64_t distance;  // Head travel in sectors: gaps between the end of a command and the start of the next one
+} ahci_batch_t;
+
+typedef struct {
+    uint8_t port;
+    uint8_t ports;      // Number of device ports, 0 - no port multiplier attached
+    uint32_t id;        // GSCR[0]: product and vendor ID
+    uint32_t revision;  // GSCR[1]: revision information
+} ahci_pmp_info_t;
+
+// Job flags
+#define AHCI_JOB_FLAG_CRC32C        0x00000001  // Calculate CRC32C of the data read
+#define AHCI_JOB_FLAG_SPARSE        0x00000002  // Image job only: all zero sectors are not written, image file stays sparse
+
+typedef struct {
+    uint8_t port;       // Source port
+    uint8_t pmp;        // Source port multiplier port
+    int32_t targetFd;   // Target controller file descriptor, -1 - same controller
+    uint8_t targetPort; // Target port
+    uint8_t targetPmp;  // Target port multiplier port
+    uint64_t lba;       // First LBA
+    uint64_t count;     // Number of sectors
+    uint32_t chunk;     // Sectors per command
+    uint32_t flags;     // AHCI_JOB_FLAG_*
+} ahci_clone_job_t;
+
+typedef struct {
+    uint8_t port;       // Source port
+    uint8_t pmp;        // Source port multiplier port
+    int32_t fd;         // Image file descriptor, must be opened for writing
+    uint64_t offset;    // Image file position of the first LBA
+    uint64_t lba;       // First LBA
+    uint64_t count;     // Number of sectors
+    uint32_t chunk;     // Sectors per command
+    uint32_t flags;     // AHCI_JOB_FLAG_*
+} ahci_image_job_t;
+
+typedef struct {
+    bool running;
+    int32_t result;         // Zero or negative error code
+    uint64_t lba;           // Next LBA to be processed
+    uint64_t done;          // Sectors processed
+    uint64_t readErrors;    // Chunks failed on read, not written to target
+    uint64_t writeErrors;   // Chunks failed on write (to target drive or image file)
+    uint64_t errorLba;      // First LBA of the last failed chunk
+    uint8_t status;         // ATA status register of the last failed chunk
+    uint8_t error;          // ATA error register of the last failed chunk
+    uint32_t crc32c;        // CRC32C of the chunks read successfully in LBA order, AHCI_JOB_FLAG_CRC32C only
+    uint64_t zeroSectors;   // All zero sectors not written to the image file, AHCI_JOB_FLAG_SPARSE only
+} ahci_job_status_t;
+
+typedef struct {
+    uint8_t port;
+    uint8_t pmp;        // Port multiplier port
+} ahci_port_select_t;
+
+typedef struct {
+    uint64_t hits;          // Commands used already pinned buffer
+    uint64_t misses;        // Commands pinned their buffer
+    uint64_t invalidations; // Cached buffers dropped after address space change
+    uint32_t entries;       // Buffers cached now
+} ahci_cache_stats_t;
+
+typedef struct {
+    uint8_t port;
+    bool file;          // Set the limit of this open file (all ports) instead of the port limit
+    uint32_t limit;     // Bandwidth limit in KB/s, 0 - unlimited
+} ahci_rate_limit_t;
+
+typedef struct {
+    uint64_t commands;
+    uint64_t bytes;
+    uint64_t delay;     // Total queue delay in microseconds: throttling and waiting for the port
+    uint64_t maxDelay;  // Longest queue delay in microseconds
+} ahci_rate_stats_t;
+
+typedef struct {
+    uint8_t port;
+    uint32_t portLimit; // KB/s, 0 - unlimited
+    uint32_t fileLimit;
+    ahci_rate_stats_t portStats; // All commands of the port, jobs included
+    ahci_rate_stats_t fileStats; // Commands of this open file, all ports
+} ahci_rate_info_t;
+
 enum _NVME_IOCTL {
     _AHCI_IOCTL_GET_CONTROLLER_INFO = 0x40,
     _AHCI_IOCTL_GET_PORT_STATUS,
@@ -68,7 +312,26 @@ enum _NVME_IOCTL {
     _AHCI_IOCTL_SET_PORT_TIMOUT,
     _AHCI_IOCTL_GET_PORT_TIMOUT,
     _AHCI_IOCTL_PORT_SOFTWARE_RESET,
-    _AHCI_IOCTL_PORT_HARDWARE_RESET
+    _AHCI_IOCTL_PORT_HARDWARE_RESET,
+    _AHCI_IOCTL_PMP_ENUMERATE,
+    _AHCI_IOCTL_CLONE_START,
+    _AHCI_IOCTL_JOB_STATUS,
+    _AHCI_IOCTL_JOB_STOP,
+    _AHCI_IOCTL_IMAGE_START,
+    _AHCI_IOCTL_SELECT_PORT,
+    _AHCI_IOCTL_BLOCK_DEVICE_ATTACH,
+    _AHCI_IOCTL_BLOCK_DEVICE_DETACH,
+    _AHCI_IOCTL_GET_CACHE_STATS,
+    _AHCI_IOCTL_SET_RATE_LIMIT,
+    _AHCI_IOCTL_GET_RATE_INFO,
+    _AHCI_IOCTL_SET_RECOVERY_CONFIG,
+    _AHCI_IOCTL_GET_RECOVERY_CONFIG,
+    _AHCI_IOCTL_BULK_HARDWARE_RESET,
+    _AHCI_IOCTL_SET_LINK_POLICY,
+    _AHCI_IOCTL_GET_LINK_POLICY,
+    _AHCI_IOCTL_GET_LINK_STATS,
+    _AHCI_IOCTL_READ_LOCATE,
+    _AHCI_IOCTL_READ_BATCH
 };
 
 #define AHCI_IOCTL_GET_CONTROLLER_INFO      _IOR(MINIPCI_IOCTL_BASE, _AHCI_IOCTL_GET_CONTROLLER_INFO, ahci_controller_info_t)
@@ -78,5 +341,24 @@ enum _NVME_IOCTL {
 #define AHCI_IOCTL_GET_PORT_TIMOUT          _IOWR(MINIPCI_IOCTL_BASE, _AHCI_IOCTL_GET_PORT_TIMOUT, ahci_port_timeout_t)
 #define AHCI_IOCTL_PORT_SOFTWARE_RESET      _IOWR(MINIPCI_IOCTL_BASE, _AHCI_IOCTL_PORT_SOFTWARE_RESET, ahci_command_packet_t)
 #define AHCI_IOCTL_PORT_HARDWARE_RESET      _IOW(MINIPCI_IOCTL_BASE, _AHCI_IOCTL_PORT_HARDWARE_RESET, ahci_command_packet_t)
+#define AHCI_IOCTL_PMP_ENUMERATE            _IOWR(MINIPCI_IOCTL_BASE, _AHCI_IOCTL_PMP_ENUMERATE, ahci_pmp_info_t)
+#define AHCI_IOCTL_CLONE_START              _IOW(MINIPCI_IOCTL_BASE, _AHCI_IOCTL_CLONE_START, ahci_clone_job_t)
+#define AHCI_IOCTL_JOB_STATUS               _IOR(MINIPCI_IOCTL_BASE, _AHCI_IOCTL_JOB_STATUS, ahci_job_status_t)
+#define AHCI_IOCTL_JOB_STOP                 _IO(MINIPCI_IOCTL_BASE, _AHCI_IOCTL_JOB_STOP)
+#define AHCI_IOCTL_IMAGE_START              _IOW(MINIPCI_IOCTL_BASE, _AHCI_IOCTL_IMAGE_START, ahci_image_job_t)
+#define AHCI_IOCTL_SELECT_PORT              _IOW(MINIPCI_IOCTL_BASE, _AHCI_IOCTL_SELECT_PORT, ahci_port_select_t)
+#define AHCI_IOCTL_BLOCK_DEVICE_ATTACH      _IOW(MINIPCI_IOCTL_BASE, _AHCI_IOCTL_BLOCK_DEVICE_ATTACH, ahci_port_select_t)
+#define AHCI_IOCTL_BLOCK_DEVICE_DETACH      _IOW(MINIPCI_IOCTL_BASE, _AHCI_IOCTL_BLOCK_DEVICE_DETACH, ahci_port_select_t)
+#define AHCI_IOCTL_GET_CACHE_STATS          _IOR(MINIPCI_IOCTL_BASE, _AHCI_IOCTL_GET_CACHE_STATS, ahci_cache_stats_t)
+#define AHCI_IOCTL_SET_RATE_LIMIT           _IOW(MINIPCI_IOCTL_BASE, _AHCI_IOCTL_SET_RATE_LIMIT, ahci_rate_limit_t)
+#define AHCI_IOCTL_GET_RATE_INFO            _IOWR(MINIPCI_IOCTL_BASE, _AHCI_IOCTL_GET_RATE_INFO, ahci_rate_info_t)
+#define AHCI_IOCTL_SET_RECOVERY_CONFIG      _IOW(MINIPCI_IOCTL_BASE, _AHCI_IOCTL_SET_RECOVERY_CONFIG, ahci_recovery_config_t)
+#define AHCI_IOCTL_GET_RECOVERY_CONFIG      _IOWR(MINIPCI_IOCTL_BASE, _AHCI_IOCTL_GET_RECOVERY_CONFIG, ahci_recovery_config_t)
+#define AHCI_IOCTL_BULK_HARDWARE_RESET      _IOWR(MINIPCI_IOCTL_BASE, _AHCI_IOCTL_BULK_HARDWARE_RESET, ahci_bulk_reset_t)
+#define AHCI_IOCTL_SET_LINK_POLICY          _IOW(MINIPCI_IOCTL_BASE, _AHCI_IOCTL_SET_LINK_POLICY, ahci_link_policy_t)
+#define AHCI_IOCTL_GET_LINK_POLICY          _IOWR(MINIPCI_IOCTL_BASE, _AHCI_IOCTL_GET_LINK_POLICY, ahci_link_policy_t)
+#define AHCI_IOCTL_GET_LINK_STATS           _IOWR(MINIPCI_IOCTL_BASE, _AHCI_IOCTL_GET_LINK_STATS, ahci_link_stats_t)
+#define AHCI_IOCTL_READ_LOCATE              _IOWR(MINIPCI_IOCTL_BASE, _AHCI_IOCTL_READ_LOCATE, ahci_locate_t)
+#define AHCI_IOCTL_READ_BATCH               _IOWR(MINIPCI_IOCTL_BASE, _AHCI_IOCTL_READ_BATCH, ahci_batch_t)
 
 #endif // IOCTL_H
@@ -0,0 +1,680 @@
+/****************************************************************************
+**
+** This file is part of the MiniAHCI project.
+** Copyright (C) 2024 Alexander E. <aekhv@vk.com>
+** License: GNU GPL v2, see file LICENSE.
+**
+****************************************************************************/
+
+#include "driver.h"
+#include <linux/kthread.h>
+#include <linux/file.h>
+#include <linux/falloc.h>
+#include <linux/highmem.h>
+#include <linux/crc32c.h>
+#include <linux/ktime.h>
+
+// Serializes jobs creation and destruction across all controllers
+static DEFINE_MUTEX(job_mutex);
+
+static void ahci_job_lock(ahci_channel_t *pSource, ahci_channel_t *pTarget)
+{
+    // Always lock in the same order, jobs may run in opposite directions
+    if (pSource == pTarget) {
+        mutex_lock(&(pSource->lock));
+    } else if (pSource < pTarget) {
+        mutex_lock(&(pSource->lock));
+        mutex_lock(&(pTarget->lock));
+    } else {
+        mutex_lock(&(pTarget->lock));
+        mutex_lock(&(pSource->lock));
+    }
+}
+
+static void ahci_job_unlock(ahci_channel_t *pSource, ahci_channel_t *pTarget)
+{
+    mutex_unlock(&(pSource->lock));
+    if (pSource != pTarget)
+        mutex_unlock(&(pTarget->lock));
+}
+
+static void ahci_job_sync(struct device *pDev, dma_addr_t *pDma, uint32_t length,
+                          enum dma_data_direction dir, bool forDevice)
+{
+    uint32_t i, len;
+
+    for (i = 0; length != 0; i++) {
+        len = min_t(uint32_t, length, PAGE_SIZE);
+        if (forDevice)
+            dma_sync_single_for_device(pDev, pDma[i], len, dir);
+        else
+            dma_sync_single_for_cpu(pDev, pDma[i], len, dir);
+        length -= len;
+    }
+}
+
+// Port, PMP port and direction of the packet are set once per job
+static void ahci_job_issue(ahci_channel_t *pChannel, ahci_command_packet_t *pCmdPacket, dma_addr_t *pDma,
+                           uint64_t lba, uint32_t count)
+{
+    const bool write = pCmdPacket->buffer.write;
+    uint32_t i, len, length = count * AHCI_SECTOR_SIZE;
+
+    pCmdPacket->timeout = false;
+    pCmdPacket->buffer.length = length;
+    ahci_ata_setup_dma(&(pCmdPacket->ata), lba, count, write);
+    ahci_command_setup_ata(pChannel, pCmdPacket->pmp, &(pCmdPacket->ata), write);
+
+    for (i = 0; length != 0; i++) {
+        len = min_t(uint32_t, length, PAGE_SIZE);
+        ahci_set_prdt_entry(pChannel, i, pDma[i], len);
+        length -= len;
+    }
+    pChannel->pCmdHeader->prdtl = i;
+
+    ahci_command_start(pChannel, pCmdPacket);
+}
+
+// Zero, -EIO for a failed chunk, or -ETIMEDOUT if the port was not recovered after a timeout. The port is stopped
+// in any case, so the chunk pages can be reused, but the job can't go on with the drive
+static int ahci_job_complete(ahci_job_t *pJob, ahci_command_packet_t *pCmdPacket, uint64_t lba)
+{
+    const bool write = pCmdPacket->buffer.write;
+    ahci_driver_data_t *pDrvData = write ? pJob->pTargetDrvData : pJob->pDrvData;
+    ahci_channel_t *pChannel = &(pDrvData->channel[pCmdPacket->port]);
+
+    if (ahci_command_finish(pDrvData, pCmdPacket))
+        return 0;
+
+    spin_lock(&(pJob->statusLock));
+    if (write)
+        pJob->status.writeErrors++;
+    else
+        pJob->status.readErrors++;
+    pJob->status.errorLba = lba;
+    pJob->status.status = ahci_ata_status(pChannel);
+    pJob->status.error = ahci_ata_error(pChannel);
+    spin_unlock(&(pJob->statusLock));
+
+    if (pJob->pDrvData->debug)
+        printk(KERN_INFO "%s: Job %s error at LBA %llu\n", KBUILD_MODNAME, write ? "write" : "read", lba);
+
+    if (pCmdPacket->timeout
+            && ((pCmdPacket->recovery == AHCI_RECOVERY_NONE) || (pCmdPacket->recovery == AHCI_RECOVERY_FAILED))) {
+        printk(KERN_ERR "%s: Job %s timeout at LBA %llu, port %d is not recovered\n", KBUILD_MODNAME,
+               write ? "write" : "read", lba, pCmdPacket->port);
+        return -ETIMEDOUT;
+    }
+
+    return -EIO;
+}
+
+static void ahci_job_digest(ahci_job_t *pJob, int buffer, uint32_t count)
+{
+    uint32_t i, len, length = count * AHCI_SECTOR_SIZE;
+    uint8_t *pData;
+
+    for (i = 0; length != 0; i++) {
+        len = min_t(uint32_t, length, PAGE_SIZE);
+        pData = kmap_local_page(pJob->pPages[buffer][i]);
+        pJob->crc = crc32c(pJob->crc, pData, len);
+        kunmap_local(pData);
+        length -= len;
+    }
+
+    spin_lock(&(pJob->statusLock));
+    pJob->status.crc32c = ~pJob->crc;
+    spin_unlock(&(pJob->statusLock));
+}
+
+static int ahci_job_clone_thread(void *pData)
+{
+    ahci_job_t *pJob = pData;
+    ahci_clone_job_t *pParams = &(pJob->params);
+    ahci_channel_t *pSource = &(pJob->pDrvData->channel[pParams->port]);
+    ahci_channel_t *pTarget = &(pJob->pTargetDrvData->channel[pParams->targetPort]);
+    struct device *pSourceDev = &(pJob->pDrvData->pPciDev->dev);
+    struct device *pTargetDev = &(pJob->pTargetDrvData->pPciDev->dev);
+    const bool overlap = (pSource != pTarget); // Different ports work simultaneously
+    const bool digest = pParams->flags & AHCI_JOB_FLAG_CRC32C;
+    const uint64_t end = pParams->lba + pParams->count;
+    uint64_t lba = pParams->lba;
+    uint64_t pendingLba = 0; // Chunk waiting to be written
+    uint32_t pendingCount = 0;
+    uint32_t count;
+    uint64_t submitted;
+    ahci_command_packet_t readPacket = { .port = pParams->port, .pmp = pParams->pmp };
+    ahci_command_packet_t writePacket = { .port = pParams->targetPort, .pmp = pParams->targetPmp, .buffer.write = true };
+    int buffer = 0;
+    int result = 0;
+    int readErr = 0, writeErr = 0;
+
+    while ((lba < end) || (pendingCount != 0)) {
+        if (kthread_should_stop()) {
+            result = -EINTR;
+            break;
+        }
+
+        count = min_t(uint64_t, end - lba, pParams->chunk);
+
+        if (count != 0)
+            ahci_job_sync(pSourceDev, pJob->sourceDma[buffer], count * AHCI_SECTOR_SIZE, DMA_FROM_DEVICE, true);
+        if (pendingCount != 0)
+            ahci_job_sync(pTargetDev, pJob->targetDma[buffer ^ 1], pendingCount * AHCI_SECTOR_SIZE, DMA_TO_DEVICE, true);
+
+        // Port bandwidth limits apply to jobs too, file limits don't
+        submitted = ktime_get_ns();
+        ahci_rate_wait(&(pSource->rate), NULL, count * AHCI_SECTOR_SIZE);
+        ahci_rate_wait(&(pTarget->rate), NULL, pendingCount * AHCI_SECTOR_SIZE);
+
+        ahci_job_lock(pSource, pTarget);
+
+        ahci_link_update(pJob->pDrvData, pParams->port);
+        ahci_link_update(pJob->pTargetDrvData, pParams->targetPort);
+
+        if (count != 0)
+            ahci_rate_account(&(pSource->rate), count * AHCI_SECTOR_SIZE, submitted);
+        if (pendingCount != 0)
+            ahci_rate_account(&(pTarget->rate), pendingCount * AHCI_SECTOR_SIZE, submitted);
+
+        readErr = 0;
+        writeErr = 0;
+
+        // The same port, previous chunk must be written before the next one is read
+        if ((pendingCount != 0) && !overlap) {
+            ahci_job_issue(pTarget, &writePacket, pJob->targetDma[buffer ^ 1], pendingLba, pendingCount);
+            writeErr = ahci_job_complete(pJob, &writePacket, pendingLba);
+        }
+
+        if ((count != 0) && (writeErr != -ETIMEDOUT))
+            ahci_job_issue(pSource, &readPacket, pJob->sourceDma[buffer], lba, count);
+
+        if ((pendingCount != 0) && overlap)
+            ahci_job_issue(pTarget, &writePacket, pJob->targetDma[buffer ^ 1], pendingLba, pendingCount);
+
+        // Digest of the previous chunk is calculated while the drives are busy
+        if ((pendingCount != 0) && digest)
+            ahci_job_digest(pJob, buffer ^ 1, pendingCount);
+
+        // Both commands are finished before anything else, the pages are not released while one of them runs
+        if ((count != 0) && (writeErr != -ETIMEDOUT))
+            readErr = ahci_job_complete(pJob, &readPacket, lba);
+
+        if ((pendingCount != 0) && overlap)
+            writeErr = ahci_job_complete(pJob, &writePacket, pendingLba);
+
+        ahci_job_unlock(pSource, pTarget);
+
+        // A drive that doesn't respond after the recovery stops the job
+        if ((readErr == -ETIMEDOUT) || (writeErr == -ETIMEDOUT)) {
+            result = -ETIMEDOUT;
+            break;
+        }
+
+        spin_lock(&(pJob->statusLock));
+        if ((pendingCount != 0) && (writeErr == 0))
+            pJob->status.done += pendingCount;
+        pJob->status.lba = lba + count;
+        spin_unlock(&(pJob->statusLock));
+
+        pendingCount = 0;
+
+        if ((count != 0) && (readErr == 0)) {
+            ahci_job_sync(pSourceDev, pJob->sourceDma[buffer], count * AHCI_SECTOR_SIZE, DMA_FROM_DEVICE, false);
+            pendingLba = lba;
+            pendingCount = count;
+            buffer ^= 1;
+        }
+
+        lba += count;
+        cond_resched();
+    }
+
+    spin_lock(&(pJob->statusLock));
+    pJob->status.running = false;
+    pJob->status.result = result;
+    spin_unlock(&(pJob->statusLock));
+
+    if (pJob->pDrvData->debug)
+        printk(KERN_INFO "%s: Job finished, %llu sectors done\n", KBUILD_MODNAME, pJob->status.done);
+
+    return result;
+}
+
+static int ahci_job_image_put(ahci_job_t *pJob, uint8_t *pData, loff_t pos, size_t length)
+{
+    ssize_t n;
+
+    while (length != 0) {
+        n = kernel_write(pJob->pImageFile, pData, length, &pos);
+        if (n < 0)
+            return n;
+        if (n == 0)
+            return -EIO;
+        pData += n;
+        length -= n;
+    }
+
+    return 0;
+}
+
+static int ahci_job_image_hole(ahci_job_t *pJob, uint8_t *pData, loff_t pos, size_t length)
+{
+    // Beyond the end of file the hole appears by itself
+    if (pos >= i_size_read(file_inode(pJob->pImageFile)))
+        return 0;
+
+    // Old image content must be dropped, the data is written if the file system can't do that
+    if (vfs_fallocate(pJob->pImageFile, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, pos, length) == 0)
+        return 0;
+
+    return ahci_job_image_put(pJob, pData, pos, length);
+}
+
+static bool ahci_job_sector_is_zero(ahci_job_t *pJob, uint8_t *pData)
+{
+    return (pJob->params.flags & AHCI_JOB_FLAG_SPARSE) && !memchr_inv(pData, 0, AHCI_SECTOR_SIZE);
+}
+
+static int ahci_job_image_write(ahci_job_t *pJob, int buffer, uint64_t lba, uint32_t count)
+{
+    loff_t pos = pJob->imageOffset + (lba - pJob->params.lba) * AHCI_SECTOR_SIZE;
+    uint8_t *pData = pJob->pBuffer[buffer];
+    uint32_t i, n, zeroSectors = 0;
+    bool zero;
+    int err;
+
+    // Runs of all zero and data sectors
+    for (i = 0; i < count; i = n) {
+        zero = ahci_job_sector_is_zero(pJob, pData + i * AHCI_SECTOR_SIZE);
+        for (n = i + 1; n < count; n++)
+            if (ahci_job_sector_is_zero(pJob, pData + n * AHCI_SECTOR_SIZE) != zero)
+                break;
+
+        if (zero) {
+            err = ahci_job_image_hole(pJob, pData + i * AHCI_SECTOR_SIZE, pos, (n - i) * AHCI_SECTOR_SIZE);
+            zeroSectors += n - i;
+        } else
+            err = ahci_job_image_put(pJob, pData + i * AHCI_SECTOR_SIZE, pos, (n - i) * AHCI_SECTOR_SIZE);
+        if (err)
+            return err;
+
+        pos += (n - i) * AHCI_SECTOR_SIZE;
+    }
+
+    if (zeroSectors != 0) {
+        spin_lock(&(pJob->statusLock));
+        pJob->status.zeroSectors += zeroSectors;
+        spin_unlock(&(pJob->statusLock));
+    }
+
+    return 0;
+}
+
+// Trailing zero or unreadable sectors are not written, the file is extended to the full image size. Content past
+// the range is kept, the file is never shrunk
+static int ahci_job_image_finish(ahci_job_t *pJob)
+{
+    loff_t end = pJob->imageOffset + pJob->params.count * AHCI_SECTOR_SIZE;
+
+    if (i_size_read(file_inode(pJob->pImageFile)) >= end)
+        return 0;
+
+    return vfs_truncate(&(pJob->pImageFile->f_path), end);
+}
+
+static int ahci_job_image_thread(void *pData)
+{
+    ahci_job_t *pJob = pData;
+    ahci_clone_job_t *pParams = &(pJob->params);
+    ahci_channel_t *pSource = &(pJob->pDrvData->channel[pParams->port]);
+    struct device *pSourceDev = &(pJob->pDrvData->pPciDev->dev);
+    const bool digest = pParams->flags & AHCI_JOB_FLAG_CRC32C;
+    const uint64_t end = pParams->lba + pParams->count;
+    uint64_t lba = pParams->lba;
+    uint32_t count;
+    uint64_t submitted;
+    ahci_command_packet_t readPacket = { .port = pParams->port, .pmp = pParams->pmp };
+    int result = 0;
+    int err = 0;
+    int readErr = 0;
+
+    while (lba < end) {
+        if (kthread_should_stop()) {
+            result = -EINTR;
+            break;
+        }
+
+        count = min_t(uint64_t, end - lba, pParams->chunk);
+
+        ahci_job_sync(pSourceDev, pJob->sourceDma[0], count * AHCI_SECTOR_SIZE, DMA_FROM_DEVICE, true);
+        submitted = ktime_get_ns();
+        ahci_rate_wait(&(pSource->rate), NULL, count * AHCI_SECTOR_SIZE);
+        mutex_lock(&(pSource->lock));
+        ahci_rate_account(&(pSource->rate), count * AHCI_SECTOR_SIZE, submitted);
+        ahci_link_update(pJob->pDrvData, pParams->port);
+        ahci_job_issue(pSource, &readPacket, pJob->sourceDma[0], lba, count);
+        readErr = ahci_job_complete(pJob, &readPacket, lba);
+        mutex_unlock(&(pSource->lock));
+
+        // File system may sleep for long or come back to this driver, the port is not held meanwhile
+        err = 0;
+        if (readErr == 0) {
+            ahci_job_sync(pSourceDev, pJob->sourceDma[0], count * AHCI_SECTOR_SIZE, DMA_FROM_DEVICE, false);
+            if (digest)
+                ahci_job_digest(pJob, 0, count);
+            err = ahci_job_image_write(pJob, 0, lba, count);
+        }
+
+        spin_lock(&(pJob->statusLock));
+        if (readErr == 0) {
+            if (err == 0)
+                pJob->status.done += count;
+            else
+                pJob->status.writeErrors++;
+        }
+        pJob->status.lba = lba + count;
+        spin_unlock(&(pJob->statusLock));
+
+        // File system error is not recoverable
+        if (err != 0) {
+            printk(KERN_ERR "%s: Image write error %d at LBA %llu\n", KBUILD_MODNAME, err, lba);
+            result = err;
+            break;
+        }
+
+        // A drive that doesn't respond after the recovery stops the job
+        if (readErr == -ETIMEDOUT) {
+            result = -ETIMEDOUT;
+            break;
+        }
+
+        lba += count;
+        cond_resched();
+    }
+
+    if (result == 0)
+        result = ahci_job_image_finish(pJob);
+
+    spin_lock(&(pJob->statusLock));
+    pJob->status.running = false;
+    pJob->status.result = result;
+    spin_unlock(&(pJob->statusLock));
+
+    if (pJob->pDrvData->debug)
+        printk(KERN_INFO "%s: Job finished, %llu sectors done\n", KBUILD_MODNAME, pJob->status.done);
+
+    return result;
+}
+
+static void ahci_job_release(ahci_job_t *pJob)
+{
+    struct device *pSourceDev = &(pJob->pDrvData->pPciDev->dev);
+    struct device *pTargetDev = &(pJob->pTargetDrvData->pPciDev->dev);
+
+    if (pJob->pThread) {
+        kthread_stop(pJob->pThread);
+        put_task_struct(pJob->pThread);
+    }
+
+    for (int b = 0; b < 2; b++) {
+        if (pJob->pBuffer[b])
+            vunmap(pJob->pBuffer[b]);
+        for (uint32_t i = 0; i < pJob->pagesCount; i++) {
+            if (!pJob->pPages[b][i])
+                continue;
+            if (pJob->sourceDma[b][i])
+                dma_unmap_page(pSourceDev, pJob->sourceDma[b][i], PAGE_SIZE, DMA_FROM_DEVICE);
+            if (pJob->targetDma[b][i])
+                dma_unmap_page(pTargetDev, pJob->targetDma[b][i], PAGE_SIZE, DMA_TO_DEVICE);
+            __free_page(pJob->pPages[b][i]);
+        }
+    }
+
+    if (pJob->pTargetFile)
+        fput(pJob->pTargetFile);
+
+    if (pJob->pImageFile)
+        fput(pJob->pImageFile);
+
+    pJob->pDrvData->pJob = NULL;
+    if (pJob->pTargetDrvData->pTargetJob == pJob)
+        pJob->pTargetDrvData->pTargetJob = NULL;
+
+    kfree(pJob);
+}
+
+static int ahci_job_map_buffers(ahci_job_t *pJob)
+{
+    struct device *pSourceDev = &(pJob->pDrvData->pPciDev->dev);
+    struct device *pTargetDev = &(pJob->pTargetDrvData->pPciDev->dev);
+
+    for (int b = 0; b < 2; b++) {
+        for (uint32_t i = 0; i < pJob->pagesCount; i++) {
+            pJob->pPages[b][i] = alloc_page(GFP_KERNEL);
+            if (!pJob->pPages[b][i])
+                return -ENOMEM;
+
+            // Both controllers work with the same pages, no copy between them
+            pJob->sourceDma[b][i] = dma_map_page(pSourceDev, pJob->pPages[b][i], 0, PAGE_SIZE, DMA_FROM_DEVICE);
+            if (dma_mapping_error(pSourceDev, pJob->sourceDma[b][i])) {
+                pJob->sourceDma[b][i] = 0;
+                return -ENOMEM;
+            }
+
+            // Image job writes to the file, not to the drive
+            if (pJob->pImageFile)
+                continue;
+
+            pJob->targetDma[b][i] = dma_map_page(pTargetDev, pJob->pPages[b][i], 0, PAGE_SIZE, DMA_TO_DEVICE);
+            if (dma_mapping_error(pTargetDev, pJob->targetDma[b][i])) {
+                pJob->targetDma[b][i] = 0;
+                return -ENOMEM;
+            }
+        }
+
+        if (pJob->pImageFile) {
+            pJob->pBuffer[b] = vmap(pJob->pPages[b], pJob->pagesCount, VM_MAP, PAGE_KERNEL);
+            if (!pJob->pBuffer[b])
+                return -ENOMEM;
+        }
+    }
+
+    return 0;
+}
+
+// Caller must hold job_mutex
+static ahci_job_t *ahci_job_create(ahci_driver_data_t *pDrvData, ahci_driver_data_t *pTargetDrvData, int *pErr)
+{
+    ahci_job_t *pJob;
+
+    // Finished job is replaced, running one must be stopped explicitly
+    if (pDrvData->pJob) {
+        if (READ_ONCE(pDrvData->pJob->status.running)) {
+            *pErr = -EBUSY;
+            return NULL;
+        }
+        ahci_job_release(pDrvData->pJob);
+    }
+
+    if ((pTargetDrvData != pDrvData) && pTargetDrvData->pTargetJob) {
+        *pErr = -EBUSY;
+        return NULL;
+    }
+
+    pJob = kzalloc(sizeof(ahci_job_t), GFP_KERNEL);
+    if (!pJob) {
+        *pErr = -ENOMEM;
+        return NULL;
+    }
+
+    pJob->pDrvData = pDrvData;
+    pJob->pTargetDrvData = pTargetDrvData;
+    spin_lock_init(&(pJob->statusLock));
+
+    pDrvData->pJob = pJob;
+    if (pTargetDrvData != pDrvData)
+        pTargetDrvData->pTargetJob = pJob;
+
+    return pJob;
+}
+
+// Caller must hold job_mutex, the job is released on error
+static int ahci_job_run(ahci_job_t *pJob, int (*threadfn)(void *))
+{
+    ahci_file_t *pTargetFileData = pJob->pTargetFile ? pJob->pTargetFile->private_data : NULL;
+    int err;
+
+    // Port taken exclusively after the ioctl checked it, only the target file may hold its own port
+    if (ahci_port_held(&(pJob->pDrvData->channel[pJob->params.port]), NULL)
+            || ahci_port_held(&(pJob->pTargetDrvData->channel[pJob->params.targetPort]), pTargetFileData)) {
+        ahci_job_release(pJob);
+        return -EBUSY;
+    }
+
+    pJob->pagesCount = DIV_ROUND_UP(pJob->params.chunk * AHCI_SECTOR_SIZE, PAGE_SIZE);
+    pJob->status.running = true;
+    pJob->status.lba = pJob->params.lba;
+    pJob->crc = ~0;
+
+    err = ahci_job_map_buffers(pJob);
+    if (err) {
+        ahci_job_release(pJob);
+        return err;
+    }
+
+    pJob->pThread = kthread_run(threadfn, pJob, "%s-job%d", KBUILD_MODNAME, pJob->pDrvData->pPciDev->bus->number);
+    if (IS_ERR(pJob->pThread)) {
+        err = PTR_ERR(pJob->pThread);
+        pJob->pThread = NULL;
+        ahci_job_release(pJob);
+        return err;
+    }
+    get_task_struct(pJob->pThread);
+
+    return 0;
+}
+
+int ahci_job_clone_start(ahci_driver_data_t *pDrvData, ahci_driver_data_t *pTargetDrvData,
+                         struct file *pTargetFile, ahci_clone_job_t *pParams)
+{
+    ahci_job_t *pJob;
+    int err;
+
+    mutex_lock(&job_mutex);
+
+    pJob = ahci_job_create(pDrvData, pTargetDrvData, &err);
+    if (!pJob) {
+        mutex_unlock(&job_mutex);
+        return err;
+    }
+
+    pJob->params = *pParams;
+
+    // Target file is released together with the job
+    if (pTargetFile)
+        pJob->pTargetFile = get_file(pTargetFile);
+
+    err = ahci_job_run(pJob, ahci_job_clone_thread);
+
+    mutex_unlock(&job_mutex);
+
+    if (!err && pDrvData->debug)
+        printk(KERN_INFO "%s: Clone job started: port %d -> port %d, LBA %llu, %llu sectors\n",
+               KBUILD_MODNAME, pParams->port, pParams->targetPort, pParams->lba, pParams->count);
+
+    return err;
+}
+
+int ahci_job_image_start(ahci_driver_data_t *pDrvData, struct file *pImageFile, ahci_image_job_t *pParams)
+{
+    ahci_job_t *pJob;
+    int err;
+
+    mutex_lock(&job_mutex);
+
+    pJob = ahci_job_create(pDrvData, pDrvData, &err);
+    if (!pJob) {
+        mutex_unlock(&job_mutex);
+        return err;
+    }
+
+    // Image job uses source part of the clone parameters only
+    pJob->params.port = pParams->port;
+    pJob->params.pmp = pParams->pmp;
+    pJob->params.targetFd = -1;
+    pJob->params.targetPort = pParams->port;
+    pJob->params.targetPmp = pParams->pmp;
+    pJob->params.lba = pParams->lba;
+    pJob->params.count = pParams->count;
+    pJob->params.chunk = pParams->chunk;
+    pJob->params.flags = pParams->flags;
+    pJob->imageOffset = pParams->offset;
+    pJob->pImageFile = get_file(pImageFile);
+
+    err = ahci_job_run(pJob, ahci_job_image_thread);
+
+    mutex_unlock(&job_mutex);
+
+    if (!err && pDrvData->debug)
+        printk(KERN_INFO "%s: Image job started: port %d, LBA %llu, %llu sectors\n",
+               KBUILD_MODNAME, pParams->port, pParams->lba, pParams->count);
+
+    return err;
+}
+
+void ahci_job_get_status(ahci_driver_data_t *pDrvData, ahci_job_status_t *pStatus)
+{
+    mutex_lock(&job_mutex);
+
+    if (pDrvData->pJob) {
+        spin_lock(&(pDrvData->pJob->statusLock));
+        *pStatus = pDrvData->pJob->status;
+        spin_unlock(&(pDrvData->pJob->statusLock));
+    } else
+        memset(pStatus, 0, sizeof(ahci_job_status_t));
+
+    mutex_unlock(&job_mutex);
+}
+
+void ahci_job_stop(ahci_driver_data_t *pDrvData)
+{
+    mutex_lock(&job_mutex);
+
+    if (pDrvData->pJob)
+        ahci_job_release(pDrvData->pJob);
+
+    mutex_unlock(&job_mutex);
+}
+
+void ahci_job_detach_target(ahci_driver_data_t *pDrvData)
+{
+    mutex_lock(&job_mutex);
+
+    // Job of another controller can't write here anymore
+    if (pDrvData->pTargetJob)
+        ahci_job_release(pDrvData->pTargetJob);
+
+    mutex_unlock(&job_mutex);
+}
+
+bool ahci_job_port_busy(ahci_driver_data_t *pDrvData, uint8_t port)
+{
+    ahci_job_t *pJob;
+    bool busy = false;
+
+    mutex_lock(&job_mutex);
+
+    // Running job reads from its source port and writes to its target port, finished one is kept for the status only
+    pJob = pDrvData->pJob;
+    if (pJob && READ_ONCE(pJob->status.running))
+        busy = (pJob->params.port == port) || ((pJob->pTargetDrvData == pDrvData) && (pJob->params.targetPort == port));
+
+    pJob = pDrvData->pTargetJob;
+    if (pJob && READ_ONCE(pJob->status.running) && (pJob->params.targetPort == port))
+        busy = true;
+
+    mutex_unlock(&job_mutex);
+
+    return busy;
+}
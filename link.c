@@ -0,0 +1,129 @@
+/****************************************************************************
+**
+** This file is part of the MiniAHCI project.
+** Copyright (C) 2024 Alexander E. <aekhv@vk.com>
+** License: GNU GPL v2, see file LICENSE.
+**
+****************************************************************************/
+
+#include "driver.h"
+
+// Link up timeout after speed change in milliseconds
+#define AHCI_LINK_RESET_TIMEOUT     2000
+
+static const char *ahci_link_speed_name(uint8_t spd)
+{
+    switch (spd) {
+    case 1: return "1.5 Gb/s";
+    case 2: return "3 Gb/s";
+    case 3: return "6 Gb/s";
+    default: return "none";
+    }
+}
+
+static bool ahci_link_error(ahci_channel_t *pChannel)
+{
+    HBA_REG_SERR serr = pChannel->pPort->serr;
+    bool result;
+
+    result = (serr.err & (SATA_SERR_ERR_TRANSIENT | SATA_SERR_ERR_PERSISTENT))
+            || (serr.diag & (SATA_SERR_DIAG_DECODE | SATA_SERR_DIAG_DISPARITY | SATA_SERR_DIAG_CRC | SATA_SERR_DIAG_HANDSHAKE))
+            || ((pChannel->pPort->tfd.status & ATA_STATUS_ERR) && (pChannel->pPort->tfd.error & ATA_ERROR_ICRC));
+
+    // Write-one-to-clear, the next command starts with clean bits
+    pChannel->pPort->serr = serr;
+
+    return result;
+}
+
+// Applied before the next command, status of the last one must stay for the caller
+static void ahci_link_request(ahci_channel_t *pChannel, uint8_t limit)
+{
+    pChannel->linkPending = true;
+    pChannel->linkLimit = limit;
+    pChannel->linkCommands = 0;
+    pChannel->linkErrors = 0;
+    pChannel->linkClean = 0;
+}
+
+void ahci_link_update(ahci_driver_data_t *pDrvData, uint8_t port)
+{
+    ahci_channel_t *pChannel = &(pDrvData->channel[port]);
+    const uint8_t limit = pChannel->linkLimit;
+    bool up;
+
+    if (!pChannel->linkPending)
+        return;
+    pChannel->linkPending = false;
+
+    up = (limit == 0) || ((pChannel->linkStats.limit != 0) && (limit > pChannel->linkStats.limit));
+
+    // Speed Allowed takes effect on the next link initialization only
+    pChannel->pPort->sctl.spd = limit;
+    ahci_ports_comreset(pDrvData, 1U << port, AHCI_LINK_RESET_TIMEOUT, NULL);
+
+    pChannel->linkStats.limit = limit;
+    pChannel->linkStats.spd = pChannel->pPort->ssts.spd;
+    if (up)
+        pChannel->linkStats.upshifts++;
+    else
+        pChannel->linkStats.downshifts++;
+
+    printk(KERN_INFO "%s: Port %d: link speed limit %s, current speed %s\n", KBUILD_MODNAME, port,
+           ahci_link_speed_name(limit), ahci_link_speed_name(pChannel->linkStats.spd));
+}
+
+void ahci_link_monitor(ahci_driver_data_t *pDrvData, uint8_t port)
+{
+    ahci_channel_t *pChannel = &(pDrvData->channel[port]);
+    ahci_link_policy_t *pPolicy = &(pChannel->linkPolicy);
+    const uint8_t maxSpeed = pDrvData->pAhciMem->cap.iss;
+    uint8_t spd;
+
+    if (!pPolicy->enable || pChannel->linkPending)
+        return;
+
+    if (ahci_link_error(pChannel)) {
+        pChannel->linkStats.errors++;
+        pChannel->linkErrors++;
+        pChannel->linkClean = 0;
+    } else {
+        pChannel->linkClean++;
+    }
+
+    // Clean period, one step up, no limit above the HBA speed
+    if ((pPolicy->upshift != 0) && (pChannel->linkStats.limit != 0) && (pChannel->linkClean >= pPolicy->upshift)) {
+        ahci_link_request(pChannel, (pChannel->linkStats.limit + 1 >= maxSpeed) ? 0 : pChannel->linkStats.limit + 1);
+        return;
+    }
+
+    if (++pChannel->linkCommands < pPolicy->window)
+        return;
+
+    // Too many errors in the window, one step down from the current speed
+    spd = pChannel->pPort->ssts.spd;
+    if ((pChannel->linkErrors >= pPolicy->threshold) && (spd > 1)) {
+        ahci_link_request(pChannel, spd - 1);
+        return;
+    }
+
+    pChannel->linkCommands = 0;
+    pChannel->linkErrors = 0;
+}
+
+void ahci_link_set_policy(ahci_driver_data_t *pDrvData, ahci_link_policy_t *pPolicy)
+{
+    ahci_channel_t *pChannel = &(pDrvData->channel[pPolicy->port]);
+
+    pChannel->linkPolicy = *pPolicy;
+    pChannel->linkPending = false;
+    pChannel->linkCommands = 0;
+    pChannel->linkErrors = 0;
+    pChannel->linkClean = 0;
+
+    // Speed limit is dropped with the policy
+    if (!pPolicy->enable && (pChannel->linkStats.limit != 0)) {
+        ahci_link_request(pChannel, 0);
+        ahci_link_update(pDrvData, pPolicy->port);
+    }
+}
@@ -0,0 +1,136 @@
+/****************************************************************************
+**
+** This file is part of the MiniAHCI project.
+** Copyright (C) 2024 Alexander E. <aekhv@vk.com>
+** License: GNU GPL v2, see file LICENSE.
+**
+****************************************************************************/
+
+#include "driver.h"
+
+// Pending ranges: every split adds one, so the largest buffer never goes deeper than its sector count bits
+#define AHCI_LOCATE_STACK_SIZE      32
+
+// Ranges are processed in LBA order, so a new bad extent either continues the last one or follows it
+static bool ahci_locate_add_bad(ahci_locate_t *pLocate, uint64_t lba, uint32_t count)
+{
+    if (pLocate->extentsCount != 0) {
+        ahci_extent_t *pLast = &(pLocate->extents[pLocate->extentsCount - 1]);
+        if (pLast->lba + pLast->count == lba) {
+            pLast->count += count;
+            return true;
+        }
+    }
+
+    if (pLocate->extentsCount == AHCI_LOCATE_EXTENTS_MAX)
+        return false;
+
+    pLocate->extents[pLocate->extentsCount].lba = lba;
+    pLocate->extents[pLocate->extentsCount].count = count;
+    pLocate->extentsCount++;
+
+    return true;
+}
+
+int ahci_locate_read(ahci_driver_data_t *pDrvData, ahci_locate_t *pLocate, ahci_pin_t *pPin)
+{
+    ahci_channel_t *pChannel = &(pDrvData->channel[pLocate->port]);
+    const uint32_t granularity = max_t(uint32_t, pLocate->granularity, 1);
+    const uint32_t budget = pLocate->budget ? pLocate->budget : pChannel->timeout[pLocate->pmp];
+    const unsigned long deadline = jiffies + msecs_to_jiffies(budget);
+    ahci_extent_t stack[AHCI_LOCATE_STACK_SIZE];
+    ahci_command_packet_t packet;
+    ahci_extent_t range;
+    uint32_t depth = 0;
+    uint32_t good, bad;
+    int err;
+
+    pLocate->next = pLocate->lba;
+    pLocate->good = 0;
+    pLocate->commands = 0;
+    pLocate->timeout = false;
+    pLocate->status = 0;
+    pLocate->error = 0;
+    pLocate->extentsCount = 0;
+
+    stack[depth].lba = pLocate->lba;
+    stack[depth].count = pLocate->count;
+    depth++;
+
+    while (depth != 0) {
+        // The first read is always issued, the rest of the range is left unread when the budget is over
+        if ((pLocate->commands != 0) && (time_after(jiffies, deadline) || fatal_signal_pending(current)))
+            break;
+
+        range = stack[--depth];
+
+        memset(&packet, 0, sizeof(packet));
+        packet.port = pLocate->port;
+        packet.pmp = pLocate->pmp;
+        packet.buffer.pointer = pLocate->pointer + (range.lba - pLocate->lba) * AHCI_SECTOR_SIZE;
+        packet.buffer.length = range.count * AHCI_SECTOR_SIZE;
+        packet.buffer.write = false;
+        ahci_ata_setup_dma(&(packet.ata), range.lba, range.count, false);
+
+        err = ahci_worker_run_ata_command(pDrvData, &packet, pPin);
+        if (err)
+            return err;
+        pLocate->commands++;
+
+        if (!packet.timeout && !ahci_command_failed(pChannel)) {
+            pLocate->good += range.count;
+            pLocate->next = range.lba + range.count;
+            continue;
+        }
+
+        pLocate->status = ahci_ata_status(pChannel);
+        pLocate->error = ahci_ata_error(pChannel);
+
+        // Port is not recovered, any next command would time out as well
+        if (packet.timeout && ((packet.recovery == AHCI_RECOVERY_NONE) || (packet.recovery == AHCI_RECOVERY_FAILED))) {
+            pLocate->timeout = true;
+            break;
+        }
+
+        // Data before the reported sector is transferred already, so it's jumped over straight
+        if (!packet.timeout && (packet.errorLba >= range.lba) && (packet.errorLba < range.lba + range.count)
+                && ((packet.errorLba - range.lba) * AHCI_SECTOR_SIZE <= packet.transferred)) {
+            good = packet.errorLba - range.lba;
+            bad = min_t(uint32_t, granularity, range.count - good);
+            pLocate->good += good;
+            pLocate->next = packet.errorLba;
+            if (!ahci_locate_add_bad(pLocate, packet.errorLba, bad))
+                break;
+            pLocate->next = packet.errorLba + bad;
+            if (good + bad < range.count) {
+                stack[depth].lba = packet.errorLba + bad;
+                stack[depth].count = range.count - good - bad;
+                depth++;
+            }
+            continue;
+        }
+
+        // Nothing is known about the failed range, it is reported as a whole or split in halves
+        if (range.count <= granularity) {
+            if (!ahci_locate_add_bad(pLocate, range.lba, range.count))
+                break;
+            pLocate->next = range.lba + range.count;
+            continue;
+        }
+
+        // Right half goes first, the left one is read next
+        stack[depth].lba = range.lba + range.count / 2;
+        stack[depth].count = range.count - range.count / 2;
+        depth++;
+        stack[depth].lba = range.lba;
+        stack[depth].count = range.count / 2;
+        depth++;
+    }
+
+    if (pDrvData->debug)
+        printk(KERN_INFO "%s: Port %d localized read of %u sectors at LBA %llu: %u good, %u bad extents, %u commands\n",
+               KBUILD_MODNAME, pLocate->port, pLocate->count, pLocate->lba, pLocate->good,
+               pLocate->extentsCount, pLocate->commands);
+
+    return 0;
+}
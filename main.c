@@ -18,11 +18,47 @@ MODULE_DEVICE_TABLE(pci, id_table);
 static uint32_t _imajor = 0;
 static struct class *_device_class = NULL;
 
+static void device_create_port_nodes(ahci_driver_data_t *pDrvData, uint32_t _iminor)
+{
+    uint32_t pi = pDrvData->pAhciMem->pi;
+    ahci_channel_t *pChannel;
+
+    for (uint32_t i = 0; i < AHCI_NUMBER_OF_PORTS_MAX; i++) {
+        if (!(pi & (1U << i)))
+            continue;
+
+        pChannel = &(pDrvData->channel[i]);
+        cdev_init(&pChannel->charDevice, &fops);
+        pChannel->charDevice.owner = THIS_MODULE;
+        cdev_add(&pChannel->charDevice, MKDEV(_imajor, AHCI_PORT_MINOR(_iminor, i)), 1);
+
+        pChannel->pDevice = device_create(_device_class, NULL, MKDEV(_imajor, AHCI_PORT_MINOR(_iminor, i)), NULL,
+                                          "%s%d.%d", KBUILD_MODNAME, _iminor, i);
+    }
+}
+
+static void device_destroy_port_nodes(ahci_driver_data_t *pDrvData, uint32_t _iminor)
+{
+    uint32_t pi = pDrvData->pAhciMem->pi;
+
+    for (uint32_t i = 0; i < AHCI_NUMBER_OF_PORTS_MAX; i++) {
+        if (!(pi & (1U << i)))
+            continue;
+
+        device_destroy(_device_class, MKDEV(_imajor, AHCI_PORT_MINOR(_iminor, i)));
+        cdev_del(&pDrvData->channel[i].charDevice);
+    }
+}
+
 const struct file_operations fops = {
     .owner          = THIS_MODULE,
     .open           = device_open,
     .release        = device_release,
     .unlocked_ioctl = device_ioctl,
+    .mmap           = device_mmap,
+    .llseek         = no_seek_end_llseek,
+    .read_iter      = device_read_iter,
+    .write_iter     = device_write_iter,
 };
 
 static int device_probe(struct pci_dev *pPciDev, const struct pci_device_id *pId)
@@ -72,6 +108,15 @@ static int device_probe(struct pci_dev *pPciDev, const struct pci_device_id *pId
     pDrvData->pAhciMem = pci_iomap(pPciDev, AHCI_PCI_BAR, len);
 
     ahci_controller_enable(pDrvData);
+    // Channels are ready before the first node goes live, an open may come right after cdev_add()
+    for (uint32_t i = 0; i < AHCI_NUMBER_OF_PORTS_MAX; i++) {
+        ahci_channel_t *pChannel = &(pDrvData->channel[i]);
+
+        pChannel->pDrvData = pDrvData;
+        spin_lock_init(&(pChannel->openLock));
+        ahci_rate_init(&(pChannel->rate));
+    }
+    ahci_worker_start(pDrvData);
 
     uint32_t _iminor = pPciDev->bus->number;
 
@@ -82,6 +127,9 @@ static int device_probe(struct pci_dev *pPciDev, const struct pci_device_id *pId
     pDrvData->pDevice = device_create(_device_class, NULL, MKDEV(_imajor, _iminor), NULL, "%s%d", KBUILD_MODNAME, _iminor);
     printk(KERN_INFO "%s: Character device created: /dev/%s%d\n", KBUILD_MODNAME, KBUILD_MODNAME, _iminor);
 
+    device_create_port_nodes(pDrvData, _iminor);
+    ahci_debugfs_attach(pDrvData, _iminor);
+
     // SUCCESS!!!
     return 0;
 
@@ -112,10 +160,20 @@ static void device_remove(struct pci_dev *pPciDev)
 
     uint32_t _iminor = pPciDev->bus->number;
 
+    ahci_debugfs_detach(pDrvData);
+    device_destroy_port_nodes(pDrvData, _iminor);
+
     device_destroy(_device_class, MKDEV(_imajor, _iminor));
     cdev_del(&pDrvData->charDevice);
     printk(KERN_INFO "%s: Character device destroyed: /dev/%s%d\n", KBUILD_MODNAME, KBUILD_MODNAME, _iminor);
 
+    ahci_job_stop(pDrvData);
+    ahci_job_detach_target(pDrvData);
+
+    for (uint32_t i = 0; i < AHCI_NUMBER_OF_PORTS_MAX; i++)
+        ahci_blkdev_detach(pDrvData, i);
+
+    ahci_worker_stop(pDrvData);
     ahci_controller_disable(pDrvData);
 
     if (pDrvData->pAhciMem)
@@ -155,8 +213,8 @@ static int __init kernel_object_init(void)
     printk(KERN_INFO "%s: Kernel object loaded\n", KBUILD_MODNAME);
 
     err = alloc_chrdev_region(&dev,
-                              0,    // unsigned int firstminor
-                              16,   // unsigned int count
+                              0,                 // unsigned int firstminor
+                              AHCI_MINORS_COUNT, // unsigned int count
                               KBUILD_MODNAME);
     if (err < 0) {
         printk(KERN_ERR "%s: Error at alloc_chrdev_region()\n", KBUILD_MODNAME);
@@ -174,6 +232,14 @@ static int __init kernel_object_init(void)
 
     _device_class->dev_uevent = uevent;
 
+    err = ahci_blkdev_init();
+    if (err < 0) {
+        printk(KERN_ERR "%s: Error at register_blkdev()\n", KBUILD_MODNAME);
+        return err;
+    }
+
+    ahci_debugfs_init();
+
     return pci_register_driver(&_driver);
 }
 
@@ -181,12 +247,16 @@ static void __exit kernel_object_exit(void)
 {
     pci_unregister_driver(&_driver);
 
+    ahci_blkdev_exit();
+
+    ahci_debugfs_exit();
+
     if (_device_class)
         class_destroy(_device_class);
 
     if (_imajor)
-        unregister_chrdev_region(MKDEV(_imajor, 0), // dev_t first
-                                 16);               // unsigned int count
+        unregister_chrdev_region(MKDEV(_imajor, 0),  // dev_t first
+                                 AHCI_MINORS_COUNT); // unsigned int count
 
     printk(KERN_INFO "%s: Kernel object unloaded\n", KBUILD_MODNAME);
 }
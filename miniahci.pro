@@ -9,7 +9,19 @@ DEFINES += \
 SOURCES += \
     ahci.c \
     main.c \
-    ioctl.c
+    ioctl.c \
+    job.c \
+    rw.c \
+    blkdev.c \
+    cache.c \
+    worker.c \
+    rate.c \
+    link.c \
+    locate.c \
+    batch.c \
+    record.c \
+    debugfs.c \
+    fault.c
 
 HEADERS += \
     ahci.h \
@@ -0,0 +1,117 @@
+/****************************************************************************
+**
+** This file is part of the MiniAHCI project.
+** Copyright (C) 2024 Alexander E. <aekhv@vk.com>
+** License: GNU GPL v2, see file LICENSE.
+**
+****************************************************************************/
+
+#include "driver.h"
+#include <linux/ktime.h>
+#include <linux/math64.h>
+#include <linux/sched.h>
+
+// Idle time credited to a limited class, lets short bursts go without delay
+#define AHCI_RATE_BURST_MS          100
+
+void ahci_rate_init(ahci_rate_t *pRate)
+{
+    spin_lock_init(&(pRate->lock));
+}
+
+// Reserves the transfer and returns the time it may start after, token bucket in virtual time form
+static uint64_t ahci_rate_reserve(ahci_rate_t *pRate, uint32_t bytes, uint64_t now)
+{
+    uint64_t start, delay = 0;
+
+    spin_lock(&(pRate->lock));
+    if (pRate->limit != 0) {
+        start = max_t(uint64_t, pRate->time, now - AHCI_RATE_BURST_MS * NSEC_PER_MSEC);
+        delay = (start > now) ? start - now : 0;
+        pRate->time = start + div64_u64((uint64_t)bytes * NSEC_PER_SEC, (uint64_t)pRate->limit * 1024);
+    }
+    spin_unlock(&(pRate->lock));
+
+    return delay;
+}
+
+// Gives the reservation back, the limit set since then may differ, the virtual time is never moved below zero
+static void ahci_rate_release(ahci_rate_t *pRate, uint32_t bytes)
+{
+    uint64_t cost;
+
+    spin_lock(&(pRate->lock));
+    if (pRate->limit != 0) {
+        cost = div64_u64((uint64_t)bytes * NSEC_PER_SEC, (uint64_t)pRate->limit * 1024);
+        pRate->time = (pRate->time > cost) ? pRate->time - cost : 0;
+    }
+    spin_unlock(&(pRate->lock));
+}
+
+// Transfer reserved by ahci_rate_wait() is not going to happen, the next ones don't wait for it
+void ahci_rate_refund(ahci_rate_t *pPortRate, ahci_rate_t *pFileRate, uint32_t bytes)
+{
+    if (bytes == 0)
+        return;
+
+    ahci_rate_release(pPortRate, bytes);
+    if (pFileRate)
+        ahci_rate_release(pFileRate, bytes);
+}
+
+// File class is optional, the longest of both delays is taken
+int ahci_rate_wait(ahci_rate_t *pPortRate, ahci_rate_t *pFileRate, uint32_t bytes)
+{
+    const uint64_t now = ktime_get_ns();
+    uint64_t delay;
+
+    if (bytes == 0)
+        return 0;
+
+    delay = ahci_rate_reserve(pPortRate, bytes, now);
+    if (pFileRate)
+        delay = max_t(uint64_t, delay, ahci_rate_reserve(pFileRate, bytes, now));
+
+    // Delay shorter than a jiffy is carried over, next transfers wait for it
+    if (nsecs_to_jiffies(delay) != 0) {
+        schedule_timeout_interruptible(nsecs_to_jiffies(delay));
+        if (signal_pending(current)) {
+            ahci_rate_refund(pPortRate, pFileRate, bytes);
+            return -ERESTARTSYS;
+        }
+    }
+
+    return 0;
+}
+
+// Queue delay is the time from submission to the command start: throttling and waiting for the port
+void ahci_rate_account(ahci_rate_t *pRate, uint32_t bytes, uint64_t submitted)
+{
+    const uint64_t delay = div_u64(ktime_get_ns() - submitted, NSEC_PER_USEC);
+
+    if (!pRate)
+        return;
+
+    spin_lock(&(pRate->lock));
+    pRate->stats.commands++;
+    pRate->stats.bytes += bytes;
+    pRate->stats.delay += delay;
+    pRate->stats.maxDelay = max_t(uint64_t, pRate->stats.maxDelay, delay);
+    spin_unlock(&(pRate->lock));
+}
+
+void ahci_rate_set_limit(ahci_rate_t *pRate, uint32_t limit)
+{
+    spin_lock(&(pRate->lock));
+    pRate->limit = limit;
+    pRate->time = 0;
+    spin_unlock(&(pRate->lock));
+}
+
+void ahci_rate_get(ahci_rate_t *pRate, uint32_t *pLimit, ahci_rate_stats_t *pStats)
+{
+    spin_lock(&(pRate->lock));
+    *pLimit = pRate->limit;
+    *pStats = pRate->stats;
+    spin_unlock(&(pRate->lock));
+}
@@ -0,0 +1,96 @@
+/****************************************************************************
+**
+** This file is part of the MiniAHCI project.
+** Copyright (C) 2024 Alexander E. <aekhv@vk.com>
+** License: GNU GPL v2, see file LICENSE.
+**
+****************************************************************************/
+
+#include "driver.h"
+#include <linux/vmalloc.h>
+#include <linux/log2.h>
+
+// Use "insmod miniahci.ko record_size=65536" to keep more commands per port, 0 - recorder disabled
+static uint record_size = 4096;
+module_param(record_size, uint, 0);
+
+// Sequence number of a slot being written
+#define AHCI_RECORD_SEQ_NONE        0xFFFFFFFFFFFFFFFFULL
+
+void ahci_record_init(ahci_recorder_t *pRecorder)
+{
+    pRecorder->head = 0;
+    pRecorder->size = record_size ? rounddown_pow_of_two(record_size) : 0;
+    pRecorder->pRecords = pRecorder->size ? vzalloc(array_size(pRecorder->size, sizeof(ahci_record_t))) : NULL;
+
+    if (!pRecorder->pRecords)
+        pRecorder->size = 0;
+}
+
+void ahci_record_release(ahci_recorder_t *pRecorder)
+{
+    vfree(pRecorder->pRecords);
+    pRecorder->pRecords = NULL;
+    pRecorder->size = 0;
+}
+
+// Single writer: the channel lock holder, readers never block it
+void ahci_record_command(ahci_channel_t *pChannel, ahci_command_packet_t *pCmdPacket, ktime_t issued)
+{
+    ahci_recorder_t *pRecorder = &(pChannel->recorder);
+    const uint64_t seq = pRecorder->head;
+    ahci_record_t *pRecord;
+
+    if (!pRecorder->pRecords)
+        return;
+
+    pRecord = &(pRecorder->pRecords[seq & (pRecorder->size - 1)]);
+
+    // Readers drop the slot while its sequence number doesn't match
+    WRITE_ONCE(pRecord->seq, AHCI_RECORD_SEQ_NONE);
+    smp_wmb();
+
+    pRecord->time = issued;
+    pRecord->duration = ktime_us_delta(ktime_get(), issued);
+    pRecord->length = pCmdPacket->buffer.length;
+    pRecord->transferred = pCmdPacket->transferred;
+    pRecord->flags = pCmdPacket->flags & ~AHCI_COMMAND_FLAG_BOUNCE;
+    pRecord->ata = pCmdPacket->ata;
+    pRecord->pmp = pCmdPacket->pmp;
+    pRecord->write = pCmdPacket->buffer.write;
+    pRecord->timeout = pCmdPacket->timeout;
+    pRecord->recovery = pCmdPacket->recovery;
+    pRecord->status = ahci_ata_status(pChannel);
+    pRecord->error = ahci_ata_error(pChannel);
+
+    smp_wmb();
+    WRITE_ONCE(pRecord->seq, seq);
+    smp_wmb();
+    WRITE_ONCE(pRecorder->head, seq + 1);
+}
+
+uint64_t ahci_record_head(ahci_recorder_t *pRecorder)
+{
+    return READ_ONCE(pRecorder->head);
+}
+
+// Returns false if the record is not written yet or is overwritten already
+bool ahci_record_fetch(ahci_recorder_t *pRecorder, uint64_t seq, ahci_record_t *pRecord)
+{
+    ahci_record_t *pSlot;
+
+    if (!pRecorder->pRecords || (seq >= ahci_record_head(pRecorder)))
+        return false;
+
+    smp_rmb();
+    pSlot = &(pRecorder->pRecords[seq & (pRecorder->size - 1)]);
+    if (READ_ONCE(pSlot->seq) != seq)
+        return false;
+
+    smp_rmb();
+    memcpy(pRecord, pSlot, sizeof(ahci_record_t));
+    smp_rmb();
+
+    // Writer has taken the slot during copying
+    return (READ_ONCE(pSlot->seq) == seq) && (pRecord->seq == seq);
+}
@@ -0,0 +1,131 @@
+/****************************************************************************
+**
+** This file is part of the MiniAHCI project.
+** Copyright (C) 2024 Alexander E. <aekhv@vk.com>
+** License: GNU GPL v2, see file LICENSE.
+**
+****************************************************************************/
+
+#include "driver.h"
+#include <linux/uio.h>
+#include <linux/ktime.h>
+
+static ssize_t device_rw_iter(struct kiocb *pIocb, struct iov_iter *pIter, bool write)
+{
+    ahci_file_t *pFileData = pIocb->ki_filp->private_data;
+    ahci_driver_data_t *pDrvData = pFileData->pDrvData;
+    ahci_channel_t *pChannel = &(pDrvData->channel[pFileData->port]);
+    ahci_command_packet_t packet;
+    ahci_pin_t *pPin;
+    loff_t pos = pIocb->ki_pos;
+    uint64_t submitted;
+    ssize_t done = 0;
+    uint64_t capacity;
+    ssize_t err = 0;
+    size_t len;
+    bool failed;
+
+    // Port may have been taken exclusively through its node after it was selected
+    if (!ahci_file_port_allowed(pFileData, pFileData->port))
+        return -EBUSY;
+
+    // Only user memory can be mapped for DMA
+    if (!user_backed_iter(pIter))
+        return -EINVAL;
+
+    // Sector aligned requests only, no read-modify-write
+    if ((pos & (AHCI_SECTOR_SIZE - 1)) || (iov_iter_count(pIter) & (AHCI_SECTOR_SIZE - 1)))
+        return -EINVAL;
+
+    // Reads stop at the end of the device like reads of a file do, writes past it fail on the device
+    if (!write) {
+        err = ahci_port_capacity(pDrvData, pFileData->port, pFileData->pmp, &capacity);
+        if (err)
+            return err;
+        if (pos >= capacity * AHCI_SECTOR_SIZE)
+            return 0;
+        iov_iter_truncate(pIter, capacity * AHCI_SECTOR_SIZE - pos);
+    }
+
+    while (iov_iter_count(pIter) != 0) {
+        len = min_t(size_t, iter_iov_len(pIter), AHCI_DATA_BUFFER_SIZE_MAX);
+
+        if (len & (AHCI_SECTOR_SIZE - 1)) {
+            err = -EINVAL;
+            break;
+        }
+
+        // 48-bit address limit
+        if (((pos + len) / AHCI_SECTOR_SIZE) > (1ULL << 48)) {
+            err = -ENXIO;
+            break;
+        }
+
+        if (fatal_signal_pending(current)) {
+            err = -EINTR;
+            break;
+        }
+
+        memset(&packet, 0, sizeof(packet));
+        packet.port = pFileData->port;
+        packet.pmp = pFileData->pmp;
+        packet.buffer.pointer = (uint8_t *)iter_iov_addr(pIter);
+        packet.buffer.length = len;
+        packet.buffer.write = write;
+        ahci_ata_setup_dma(&(packet.ata), pos / AHCI_SECTOR_SIZE, len / AHCI_SECTOR_SIZE, write);
+
+        submitted = ktime_get_ns();
+        err = ahci_rate_wait(&(pChannel->rate), &(pFileData->rate), len);
+        if (err)
+            break;
+
+        pPin = ahci_cache_get(pFileData, &(packet.buffer));
+        if (mutex_lock_interruptible(&(pChannel->lock))) {
+            ahci_cache_put(pFileData, pPin);
+            ahci_rate_refund(&(pChannel->rate), &(pFileData->rate), len);
+            err = -ERESTARTSYS;
+            break;
+        }
+        ahci_rate_account(&(pChannel->rate), len, submitted);
+        ahci_rate_account(&(pFileData->rate), len, submitted);
+        err = ahci_worker_run_ata_command(pDrvData, &packet, pPin);
+        failed = packet.timeout || ahci_command_failed(pChannel);
+        mutex_unlock(&(pChannel->lock));
+        ahci_cache_put(pFileData, pPin);
+
+        if (err)
+            break;
+
+        if (failed) {
+            // Short read up to the bad sector, the data before it is transferred already
+            if (!write && !packet.timeout && (packet.errorLba != AHCI_ERROR_LBA_NONE)
+                    && (packet.errorLba >= pos / AHCI_SECTOR_SIZE) && (packet.errorLba < (pos + len) / AHCI_SECTOR_SIZE)) {
+                len = min_t(size_t, (packet.errorLba - pos / AHCI_SECTOR_SIZE) * AHCI_SECTOR_SIZE,
+                            packet.transferred & ~(AHCI_SECTOR_SIZE - 1));
+                iov_iter_advance(pIter, len);
+                pos += len;
+                done += len;
+            }
+            err = -EIO;
+            break;
+        }
+
+        iov_iter_advance(pIter, len);
+        pos += len;
+        done += len;
+    }
+
+    pIocb->ki_pos = pos;
+
+    return done ? done : err;
+}
+
+ssize_t device_read_iter(struct kiocb *pIocb, struct iov_iter *pIter)
+{
+    return device_rw_iter(pIocb, pIter, false);
+}
+
+ssize_t device_write_iter(struct kiocb *pIocb, struct iov_iter *pIter)
+{
+    return device_rw_iter(pIocb, pIter, true);
+}
@@ -0,0 +1,373 @@
+/****************************************************************************
+**
+** This file is part of the MiniAHCI project.
+** Copyright (C) 2024 Alexander E. <aekhv@vk.com>
+** License: GNU GPL v2, see file LICENSE.
+**
+****************************************************************************/
+
+// Simulated HBA: a thread polling the register block like the controller does
+
+#include "hba.h"
+
+// Data sector content: LBA in every 64-bit word
+#define SIM_SECTOR_WORDS        (AHCI_SECTOR_SIZE / sizeof(uint64_t))
+
+// Interrupt status bits
+#define SIM_IS_DHRS             (1U << 0)   // Device to Host Register FIS Interrupt
+#define SIM_IS_TFES             (1U << 30)  // Task File Error Status
+
+// ATA status register values
+#define SIM_STATUS_READY        0x50        // DRDY | DSC
+#define SIM_ERROR_UNC           0x40        // Uncorrectable data error
+#define SIM_ERROR_ICRC          0x84        // Interface CRC error, command aborted
+
+typedef struct {
+    bool issued;            // Command is in progress
+    bool dropped;           // Command will never complete, the device stays busy
+    bool comreset;          // COMRESET is asserted
+    uint64_t deadline;      // Completion time in nanoseconds
+} sim_port_state_t;
+
+static struct {
+    HBA_MEMORY *pAhciMem;
+    sim_hba_config_t config;
+    sim_hba_stats_t stats;
+    sim_port_state_t state[AHCI_NUMBER_OF_PORTS_MAX];
+    uint64_t dataCommands;
+    pthread_t thread;
+    volatile bool stop;
+} _hba;
+
+static uint64_t sim_clock_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void *sim_address(uint32_t low, uint32_t high)
+{
+    return (void *)(uintptr_t)(((uint64_t)high << 32) | low);
+}
+
+static void sim_fill_identify(uint16_t *pIdentify)
+{
+    memset(pIdentify, 0, AHCI_SECTOR_SIZE);
+    pIdentify[60] = _hba.config.capacity > 0x0FFFFFFF ? 0xFFFF : _hba.config.capacity;
+    pIdentify[61] = _hba.config.capacity > 0x0FFFFFFF ? 0x0FFF : _hba.config.capacity >> 16;
+    pIdentify[83] = 1 << 10; // 48-bit address feature set supported
+    for (int i = 0; i < 4; i++)
+        pIdentify[100 + i] = _hba.config.capacity >> (i * 16);
+}
+
+// Copies data between the PRDT buffers and the simulated media, returns transferred byte count
+static uint32_t sim_transfer(HBA_COMMAND_HEADER *pCmdHeader, HBA_COMMAND_TABLE *pCmdTable, uint64_t lba, uint32_t bytes)
+{
+    uint8_t sector[AHCI_SECTOR_SIZE];
+    uint64_t *pWords = (uint64_t *)sector;
+    uint32_t done = 0;
+
+    for (uint32_t i = 0; (i < pCmdHeader->prdtl) && (done < bytes); i++) {
+        HBA_PRDT_ENTRY *pEntry = &(pCmdTable->prdt[i]);
+        uint8_t *pData = sim_address(pEntry->dba, pEntry->dbau);
+        uint32_t len = min_t(uint32_t, pEntry->dbc + 1, bytes - done);
+
+        for (uint32_t n = 0; n < len; ) {
+            uint64_t current = lba + (done + n) / AHCI_SECTOR_SIZE;
+            uint32_t offs = (done + n) % AHCI_SECTOR_SIZE;
+            uint32_t part = min_t(uint32_t, AHCI_SECTOR_SIZE - offs, len - n);
+
+            if (!pCmdHeader->w) {
+                for (uint32_t w = 0; w < SIM_SECTOR_WORDS; w++)
+                    pWords[w] = current;
+                memcpy(pData + n, sector + offs, part);
+            }
+            // Written data is discarded, the media content is fixed
+            n += part;
+        }
+        done += len;
+    }
+
+    return done;
+}
+
+static void sim_complete(HBA_PORT *pPort, uint8_t status, uint8_t error, bool failed)
+{
+    HBA_COMMAND_HEADER *pCmdHeader = sim_address(pPort->clb, pPort->clbu);
+    HBA_COMMAND_TABLE *pCmdTable = sim_address(pCmdHeader->ctba, pCmdHeader->ctbau);
+    HBA_RECEIVED_FIS *pRcvdFis = sim_address(pPort->fb, pPort->fbu);
+    FIS_REG_H2D *pFis = &(pCmdTable->cfis);
+
+    if (pPort->fbs.en)
+        pRcvdFis += pCmdHeader->pmp;
+
+    FIS_REG_D2H *pRfis = &(pRcvdFis->rfis);
+    memset(pRfis, 0, sizeof(FIS_REG_D2H));
+    pRfis->fis_type = FIS_TYPE_REG_D2H;
+    pRfis->status = status;
+    pRfis->error = error;
+    pRfis->lba0 = pFis->lba0;
+    pRfis->lba1 = pFis->lba1;
+    pRfis->lba2 = pFis->lba2;
+    pRfis->lba3 = pFis->lba3;
+    pRfis->lba4 = pFis->lba4;
+    pRfis->lba5 = pFis->lba5;
+
+    HBA_REG_TFD tfd = { .status = status, .error = error };
+    pPort->tfd = tfd;
+
+    // Real PxIS is write-one-to-clear, that can't be trapped here,
+    // so the register is simply overwritten with the completion status
+    if (failed) {
+        pPort->is = SIM_IS_TFES;
+    } else {
+        pPort->ci = 0;
+        pPort->is = SIM_IS_DHRS;
+    }
+}
+
+static void sim_set_error_lba(HBA_PORT *pPort, HBA_COMMAND_HEADER *pCmdHeader, uint64_t lba)
+{
+    HBA_RECEIVED_FIS *pRcvdFis = sim_address(pPort->fb, pPort->fbu);
+
+    if (pPort->fbs.en)
+        pRcvdFis += pCmdHeader->pmp;
+
+    FIS_REG_D2H *pRfis = &(pRcvdFis->rfis);
+    pRfis->lba0 = lba;
+    pRfis->lba1 = lba >> 8;
+    pRfis->lba2 = lba >> 16;
+    pRfis->lba3 = lba >> 24;
+    pRfis->lba4 = lba >> 32;
+    pRfis->lba5 = lba >> 40;
+}
+
+static void sim_execute(uint32_t port)
+{
+    HBA_PORT *pPort = &(_hba.pAhciMem->port[port]);
+    sim_port_state_t *pState = &(_hba.state[port]);
+    HBA_COMMAND_HEADER *pCmdHeader = sim_address(pPort->clb, pPort->clbu);
+    HBA_COMMAND_TABLE *pCmdTable = sim_address(pCmdHeader->ctba, pCmdHeader->ctbau);
+    FIS_REG_H2D *pFis = &(pCmdTable->cfis);
+    uint64_t lba;
+    uint32_t count;
+
+    pState->issued = false;
+
+    // Software reset sequence, SRST set and cleared
+    if (!pFis->c) {
+        if (pFis->control & 0x04)
+            _hba.stats.resets++;
+        sim_complete(pPort, SIM_STATUS_READY, 0, false);
+        return;
+    }
+
+    // Nothing behind the control port, no port multiplier here
+    if (pCmdHeader->pmp == AHCI_PMP_CONTROL_PORT) {
+        _hba.stats.errors++;
+        sim_complete(pPort, SIM_STATUS_READY | ATA_STATUS_ERR, 0x04, true); // ABRT
+        return;
+    }
+
+    lba = (uint64_t)pFis->lba0 | ((uint64_t)pFis->lba1 << 8) | ((uint64_t)pFis->lba2 << 16)
+            | ((uint64_t)pFis->lba3 << 24) | ((uint64_t)pFis->lba4 << 32) | ((uint64_t)pFis->lba5 << 40);
+    count = pFis->countl | (pFis->counth << 8);
+    if (count == 0)
+        count = 65536;
+
+    switch (pFis->command) {
+    case ATA_COMMAND_IDENTIFY_DEVICE:
+        if (pCmdHeader->prdtl)
+            sim_fill_identify(sim_address(pCmdTable->prdt[0].dba, pCmdTable->prdt[0].dbau));
+        pCmdHeader->prdbc = AHCI_SECTOR_SIZE;
+        break;
+
+    case ATA_COMMAND_READ_DMA_EXT:
+    case ATA_COMMAND_WRITE_DMA_EXT:
+        _hba.dataCommands++;
+        // Marginal link, fine at the lowest speed only
+        if (_hba.config.icrcEvery && (pPort->ssts.spd > 1) && (_hba.dataCommands % _hba.config.icrcEvery == 0)) {
+            HBA_REG_SERR serr = { .err = 0x0200, .diag = 0x0020 }; // Persistent error, CRC
+            pPort->serr = serr;
+            _hba.stats.errors++;
+            _hba.stats.icrcErrors++;
+            sim_complete(pPort, SIM_STATUS_READY | ATA_STATUS_ERR, SIM_ERROR_ICRC, true);
+            return;
+        }
+        if (lba + count > _hba.config.capacity) {
+            _hba.stats.errors++;
+            sim_complete(pPort, SIM_STATUS_READY | ATA_STATUS_ERR, 0x10, true); // IDNF
+            return;
+        }
+        // Unreadable media, the data before the first bad sector is transferred
+        if (_hba.config.badEvery && !pCmdHeader->w) {
+            uint64_t bad = lba + (_hba.config.badEvery - 1 - lba % _hba.config.badEvery);
+            if (bad < lba + count) {
+                _hba.stats.errors++;
+                pCmdHeader->prdbc = sim_transfer(pCmdHeader, pCmdTable, lba, (bad - lba) * AHCI_SECTOR_SIZE);
+                sim_complete(pPort, SIM_STATUS_READY | ATA_STATUS_ERR, SIM_ERROR_UNC, true);
+                sim_set_error_lba(pPort, pCmdHeader, bad);
+                return;
+            }
+        }
+        // Bad sector in the middle, the data before it is transferred
+        if (_hba.config.errorEvery && (_hba.dataCommands % _hba.config.errorEvery == 0)) {
+            _hba.stats.errors++;
+            pCmdHeader->prdbc = sim_transfer(pCmdHeader, pCmdTable, lba, (count / 2) * AHCI_SECTOR_SIZE);
+            sim_complete(pPort, SIM_STATUS_READY | ATA_STATUS_ERR, SIM_ERROR_UNC, true);
+            sim_set_error_lba(pPort, pCmdHeader, lba + count / 2);
+            return;
+        }
+        pCmdHeader->prdbc = sim_transfer(pCmdHeader, pCmdTable, lba, count * AHCI_SECTOR_SIZE);
+        _hba.stats.bytes += pCmdHeader->prdbc;
+        break;
+
+    default:
+        _hba.stats.errors++;
+        sim_complete(pPort, SIM_STATUS_READY | ATA_STATUS_ERR, 0x04, true); // ABRT
+        return;
+    }
+
+    _hba.stats.commands++;
+    sim_complete(pPort, SIM_STATUS_READY, 0, false);
+}
+
+static void sim_poll_port(uint32_t port)
+{
+    HBA_PORT *pPort = &(_hba.pAhciMem->port[port]);
+    sim_port_state_t *pState = &(_hba.state[port]);
+
+    // Command list and FIS receive engines follow their enable bits
+    if (pPort->cmd.fr != pPort->cmd.fre)
+        pPort->cmd.fr = pPort->cmd.fre;
+
+    // COMRESET: link goes down while asserted, device comes up ready
+    if (pPort->sctl.det == 1) {
+        if (!pState->comreset) {
+            HBA_REG_SSTS ssts = { .det = 1, .spd = 0, .ipm = 0 };
+            pPort->ssts = ssts;
+            pState->comreset = true;
+            _hba.stats.comresets++;
+        }
+    } else if (pState->comreset) {
+        // Speed Allowed limits the negotiated speed
+        HBA_REG_SSTS ssts = { .det = 3, .spd = pPort->sctl.spd ? min_t(uint32_t, pPort->sctl.spd, 3) : 3, .ipm = 1 };
+        HBA_REG_TFD tfd = { .status = SIM_STATUS_READY };
+        pPort->ssts = ssts;
+        pPort->tfd = tfd;
+        pState->comreset = false;
+    }
+
+    // Command list override clears BSY and DRQ of the task file register
+    if (pPort->cmd.clo) {
+        HBA_REG_TFD tfd = pPort->tfd;
+        tfd.status &= ~(ATA_STATUS_BSY | ATA_STATUS_DRQ);
+        pPort->tfd = tfd;
+        pPort->cmd.clo = 0;
+    }
+
+    if (!pPort->cmd.st) {
+        // Stopping the port drops the outstanding command
+        if (pPort->cmd.cr || pPort->ci) {
+            pPort->ci = 0;
+            pPort->cmd.cr = 0;
+        }
+        pState->issued = false;
+        return;
+    }
+
+    if (!pPort->cmd.cr)
+        pPort->cmd.cr = 1;
+
+    if (!(pPort->ci & 1)) {
+        pState->issued = false;
+        return;
+    }
+
+    if (!pState->issued) {
+        HBA_COMMAND_HEADER *pCmdHeader = sim_address(pPort->clb, pPort->clbu);
+        HBA_COMMAND_TABLE *pCmdTable = sim_address(pCmdHeader->ctba, pCmdHeader->ctbau);
+        uint8_t command = pCmdTable->cfis.command;
+
+        // Real PxSERR is write-one-to-clear too, the bits of the previous command are dropped here
+        HBA_REG_SERR serr = { 0 };
+        pPort->serr = serr;
+
+        pState->issued = true;
+        pState->dropped = false;
+        pState->deadline = sim_clock_ns() + _hba.config.latency * 1000ULL;
+
+        if (pCmdTable->cfis.c && _hba.config.timeoutEvery
+                && ((command == ATA_COMMAND_READ_DMA_EXT) || (command == ATA_COMMAND_WRITE_DMA_EXT))
+                && ((_hba.dataCommands + 1) % _hba.config.timeoutEvery == 0)) {
+            _hba.dataCommands++;
+            _hba.stats.timeouts++;
+            pState->dropped = true;
+            HBA_REG_TFD tfd = { .status = ATA_STATUS_BSY };
+            pPort->tfd = tfd;
+        }
+        return;
+    }
+
+    if (!pState->dropped && (sim_clock_ns() >= pState->deadline))
+        sim_execute(port);
+}
+
+static void *sim_hba_thread(void *pArg)
+{
+    (void)(pArg);
+
+    while (!_hba.stop) {
+        for (uint32_t i = 0; i < _hba.config.ports; i++)
+            sim_poll_port(i);
+        sched_yield();
+    }
+
+    return NULL;
+}
+
+HBA_MEMORY *sim_hba_create(const sim_hba_config_t *pConfig)
+{
+    HBA_MEMORY *pAhciMem = aligned_alloc(PAGE_SIZE, (sizeof(HBA_MEMORY) + PAGE_SIZE - 1) & PAGE_MASK);
+    HBA_REG_CAP cap = { 0 };
+
+    memset((void *)pAhciMem, 0, sizeof(HBA_MEMORY));
+    memset(&_hba, 0, sizeof(_hba));
+    _hba.pAhciMem = pAhciMem;
+    _hba.config = *pConfig;
+
+    cap.np = pConfig->ports - 1;
+    cap.ncs = 31;
+    cap.s64a = 1;
+    cap.sclo = 1;
+    cap.iss = 3; // 6 Gb/s
+    cap.spm = 1;
+    pAhciMem->cap = cap;
+    pAhciMem->pi = (pConfig->ports == 32) ? 0xFFFFFFFF : (1U << pConfig->ports) - 1;
+    pAhciMem->vs = 0x00010301;
+
+    for (uint32_t i = 0; i < pConfig->ports; i++) {
+        HBA_REG_SSTS ssts = { .det = 3, .spd = 3, .ipm = 1 };
+        HBA_REG_TFD tfd = { .status = SIM_STATUS_READY };
+        pAhciMem->port[i].ssts = ssts;
+        pAhciMem->port[i].tfd = tfd;
+        pAhciMem->port[i].sig = 0x00000101; // SATA drive
+    }
+
+    pthread_create(&_hba.thread, NULL, sim_hba_thread, NULL);
+
+    return pAhciMem;
+}
+
+void sim_hba_destroy(HBA_MEMORY *pAhciMem)
+{
+    _hba.stop = true;
+    pthread_join(_hba.thread, NULL);
+    free((void *)pAhciMem);
+}
+
+void sim_hba_get_stats(sim_hba_stats_t *pStats)
+{
+    *pStats = _hba.stats;
+}
@@ -0,0 +1,39 @@
+/****************************************************************************
+**
+** This file is part of the MiniAHCI project.
+** Copyright (C) 2024 Alexander E. <aekhv@vk.com>
+** License: GNU GPL v2, see file LICENSE.
+**
+****************************************************************************/
+
+#ifndef SIM_HBA_H
+#define SIM_HBA_H
+
+#include "sim.h"
+#include "../ahci.h"
+
+typedef struct {
+    uint32_t ports;         // Number of implemented ports
+    uint32_t latency;       // Command latency in microseconds
+    uint32_t errorEvery;    // Every Nth data command fails with UNC error, 0 - never
+    uint32_t timeoutEvery;  // Every Nth data command never completes, 0 - never
+    uint32_t badEvery;      // Every Nth sector is unreadable, its LBA is reported on read, 0 - none
+    uint32_t icrcEvery;     // Every Nth data command fails with interface CRC error above 1.5 Gb/s, 0 - never
+    uint64_t capacity;      // Drive capacity in sectors
+} sim_hba_config_t;
+
+typedef struct {
+    uint64_t commands;      // Completed commands
+    uint64_t errors;        // Commands completed with error
+    uint64_t timeouts;      // Commands dropped
+    uint64_t resets;        // Software resets
+    uint64_t comresets;     // Link resets
+    uint64_t icrcErrors;    // Commands failed with interface CRC error
+    uint64_t bytes;         // Transferred bytes
+} sim_hba_stats_t;
+
+HBA_MEMORY *sim_hba_create(const sim_hba_config_t *pConfig);
+void sim_hba_destroy(HBA_MEMORY *pAhciMem);
+void sim_hba_get_stats(sim_hba_stats_t *pStats);
+
+#endif // SIM_HBA_H
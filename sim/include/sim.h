@@ -0,0 +1,352 @@
+/****************************************************************************
+**
+** This file is part of the MiniAHCI project.
+** Copyright (C) 2024 Alexander E. <aekhv@vk.com>
+** License: GNU GPL v2, see file LICENSE.
+**
+****************************************************************************/
+
+// Userspace stand-ins for the kernel API used by ahci.c
+
+#ifndef SIM_H
+#define SIM_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sched.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <errno.h>
+
+// Kernel integer types, 64-bit ones are long long on every architecture (asm-generic/int-ll64.h),
+// unlike the libc ones. The driver prints them with %llu and %llx.
+
+typedef unsigned char u8;
+typedef unsigned short u16;
+typedef unsigned int u32;
+typedef unsigned long long u64;
+typedef signed long long s64;
+
+#define uint64_t                    u64
+#define int64_t                     s64
+
+// Page
+
+#define PAGE_SHIFT                  12
+#define PAGE_SIZE                   (1UL << PAGE_SHIFT)
+#define PAGE_MASK                   (~(PAGE_SIZE - 1))
+
+// Page pointer is the page virtual address, there is no struct page behind it
+struct page;
+
+#define FOLL_WRITE                  0x01
+#define FOLL_FORCE                  0x10
+#define FOLL_LONGTERM               0x100
+
+static inline long pin_user_pages_fast(unsigned long start, int nr_pages, unsigned int gup_flags, struct page **pages)
+{
+    (void)(gup_flags);
+    for (int i = 0; i < nr_pages; i++)
+        pages[i] = (struct page *)(start + i * PAGE_SIZE);
+    return nr_pages;
+}
+
+static inline void unpin_user_pages(struct page **pages, unsigned long npages)
+{
+    (void)(pages);
+    (void)(npages);
+}
+
+static inline void unpin_user_pages_dirty_lock(struct page **pages, unsigned long npages, bool make_dirty)
+{
+    (void)(pages);
+    (void)(npages);
+    (void)(make_dirty);
+}
+
+static inline void *kmap_local_page(struct page *page)
+{
+    return (void *)page;
+}
+
+static inline void kunmap_local(const void *addr)
+{
+    (void)(addr);
+}
+
+static inline struct page *alloc_page(int gfp)
+{
+    (void)(gfp);
+    return aligned_alloc(PAGE_SIZE, PAGE_SIZE);
+}
+
+static inline void __free_page(struct page *page)
+{
+    free(page);
+}
+
+static inline void *page_address(struct page *page)
+{
+    return (void *)page;
+}
+
+// DMA, bus address is the virtual address
+
+typedef uint64_t dma_addr_t;
+
+enum dma_data_direction {
+    DMA_BIDIRECTIONAL = 0,
+    DMA_TO_DEVICE = 1,
+    DMA_FROM_DEVICE = 2,
+    DMA_NONE = 3,
+};
+
+#define DMA_BIT_MASK(n)             (((n) == 64) ? ~0ULL : ((1ULL << (n)) - 1))
+#define GFP_KERNEL                  0
+
+struct device {
+    uint64_t dmaMask;
+};
+
+struct pci_dev {
+    struct device dev;
+};
+
+static inline int dma_set_mask(struct device *dev, uint64_t mask)
+{
+    dev->dmaMask = mask;
+    return 0;
+}
+
+static inline int dma_set_coherent_mask(struct device *dev, uint64_t mask)
+{
+    (void)(dev);
+    (void)(mask);
+    return 0;
+}
+
+static inline void *dma_alloc_coherent(struct device *dev, size_t size, dma_addr_t *handle, int gfp)
+{
+    (void)(dev);
+    (void)(gfp);
+    void *p = aligned_alloc(PAGE_SIZE, (size + PAGE_SIZE - 1) & PAGE_MASK);
+    *handle = (uintptr_t)p;
+    return p;
+}
+
+static inline void dma_free_coherent(struct device *dev, size_t size, void *cpu_addr, dma_addr_t handle)
+{
+    (void)(dev);
+    (void)(size);
+    (void)(handle);
+    free(cpu_addr);
+}
+
+static inline dma_addr_t dma_map_page(struct device *dev, struct page *page, size_t offset, size_t size, enum dma_data_direction dir)
+{
+    (void)(dev);
+    (void)(size);
+    (void)(dir);
+    return (uintptr_t)page + offset;
+}
+
+static inline void dma_unmap_page(struct device *dev, dma_addr_t addr, size_t size, enum dma_data_direction dir)
+{
+    (void)(dev);
+    (void)(addr);
+    (void)(size);
+    (void)(dir);
+}
+
+static inline void dma_sync_single_for_device(struct device *dev, dma_addr_t addr, size_t size, enum dma_data_direction dir)
+{
+    (void)(dev);
+    (void)(addr);
+    (void)(size);
+    (void)(dir);
+}
+
+static inline void dma_sync_single_for_cpu(struct device *dev, dma_addr_t addr, size_t size, enum dma_data_direction dir)
+{
+    (void)(dev);
+    (void)(addr);
+    (void)(size);
+    (void)(dir);
+}
+
+static inline int dma_mapping_error(struct device *dev, dma_addr_t addr)
+{
+    (void)(dev);
+    return addr == 0;
+}
+
+// Time, one jiffy is one millisecond
+
+#define HZ                          1000
+
+static inline unsigned long sim_jiffies(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000UL + ts.tv_nsec / 1000000UL;
+}
+
+#define jiffies                     sim_jiffies()
+#define msecs_to_jiffies(m)         ((unsigned long)(m))
+#define time_after(a, b)            ((long)((b) - (a)) < 0)
+
+static inline void mdelay(unsigned long msecs)
+{
+    struct timespec ts = { msecs / 1000, (msecs % 1000) * 1000000L };
+    nanosleep(&ts, NULL);
+}
+
+#define msleep(m)                   mdelay(m)
+
+typedef int64_t ktime_t;
+
+static inline ktime_t ktime_get(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+#define ktime_us_delta(a, b)        (((a) - (b)) / 1000)
+#define udelay(u)                   mdelay(((u) + 999) / 1000)
+#define usleep_range(min, max)      mdelay(((min) + 999) / 1000)
+
+// No signals are delivered to the simulation, the task argument is dropped unexpanded
+#define fatal_signal_pending(t)     0
+
+// Busy waits yield, so the simulated HBA gets CPU time on a single core too
+#define cpu_relax()                 sched_yield()
+
+// Locking
+
+struct mutex {
+    pthread_mutex_t m;
+};
+
+#define mutex_init(x)               pthread_mutex_init(&((x)->m), NULL)
+#define mutex_lock(x)               pthread_mutex_lock(&((x)->m))
+#define mutex_unlock(x)             pthread_mutex_unlock(&((x)->m))
+#define mutex_lock_interruptible(x) pthread_mutex_lock(&((x)->m))
+
+typedef pthread_mutex_t spinlock_t;
+
+// Logging
+
+#define KERN_ERR                    ""
+#define KERN_WARNING                ""
+#define KERN_INFO                   ""
+#define printk(...)                 printf(__VA_ARGS__)
+
+// CRC32C (Castagnoli), no pre and post inversion like the kernel one
+
+static inline uint32_t crc32c(uint32_t crc, const void *address, size_t length)
+{
+    static uint32_t table[256];
+    const uint8_t *p = address;
+
+    if (table[1] == 0) {
+        for (uint32_t n = 0; n < 256; n++) {
+            uint32_t c = n;
+            for (int i = 0; i < 8; i++)
+                c = (c >> 1) ^ (0x82F63B78 & -(c & 1));
+            table[n] = c;
+        }
+    }
+
+    while (length--)
+        crc = table[(crc ^ *p++) & 0xFF] ^ (crc >> 8);
+
+    return crc;
+}
+
+// Misc
+
+#define DIV_ROUND_UP(n, d)          (((n) + (d) - 1) / (d))
+
+static inline void *memchr_inv(const void *start, int c, size_t bytes)
+{
+    const uint8_t *p = start;
+
+    for (size_t i = 0; i < bytes; i++)
+        if (p[i] != (uint8_t)c)
+            return (void *)(p + i);
+
+    return NULL;
+}
+
+#define __iomem
+#define ALIGN(x, a)                 (((x) + (a) - 1) & ~((typeof(x))(a) - 1))
+#define min_t(type, x, y)           ((type)(x) < (type)(y) ? (type)(x) : (type)(y))
+#define max_t(type, x, y)           ((type)(x) > (type)(y) ? (type)(x) : (type)(y))
+
+// Memory and library helpers
+
+#define kvmalloc_array(n, size, gfp) ((void)(gfp), malloc((n) * (size)))
+#define kvfree(p)                   free(p)
+#define get_zeroed_page(gfp)        ((void)(gfp), (unsigned long)calloc(1, PAGE_SIZE))
+#define free_page(addr)             free((void *)(addr))
+#define vzalloc(size)               calloc(1, size)
+#define vfree(p)                    free((void *)(p))
+#define array_size(a, b)            ((size_t)(a) * (b))
+#define rounddown_pow_of_two(n)     (1UL << (63 - __builtin_clzl(n)))
+
+// The HBA thread doesn't read driver memory concurrently, compiler barriers are enough
+#define WRITE_ONCE(x, val)          (*(volatile typeof(x) *)&(x) = (val))
+#define smp_wmb()                   __atomic_signal_fence(__ATOMIC_SEQ_CST)
+#define READ_ONCE(x)                (*(volatile typeof(x) *)&(x))
+#define smp_rmb()                   __atomic_signal_fence(__ATOMIC_SEQ_CST)
+
+// Swap callback is never used by the driver, the standard sort is enough
+#define sort(base, num, size, cmp, swap) ((void)(swap), qsort(base, num, size, cmp))
+
+// User memory is the process memory itself
+static inline unsigned long copy_from_user(void *to, const void *from, unsigned long n)
+{
+    memcpy(to, from, n);
+    return 0;
+}
+
+static inline unsigned long copy_to_user(void *to, const void *from, unsigned long n)
+{
+    memcpy(to, from, n);
+    return 0;
+}
+
+// Module
+
+#define MODULE_LICENSE(x)           extern int sim_module_info
+#define MODULE_AUTHOR(x)            extern int sim_module_info
+#define MODULE_DESCRIPTION(x)       extern int sim_module_info
+#define MODULE_VERSION(x)           extern int sim_module_info
+#define module_param(name, type, perm) \
+    static inline void *sim_module_param_##name(void) { return &name; }
+
+// Types used only in declarations of driver.h
+
+struct cdev { int unused; };
+struct blk_mq_tag_set { int unused; };
+struct list_head { struct list_head *next, *prev; };
+struct mmu_interval_notifier { int unused; };
+struct completion { int unused; };
+typedef struct { int unused; } wait_queue_head_t;
+struct gendisk;
+struct task_struct;
+struct mm_struct;
+struct file;
+struct inode;
+struct kiocb;
+struct iov_iter;
+struct file_operations;
+struct vm_area_struct;
+struct dentry;
+
+#endif // SIM_H
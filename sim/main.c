@@ -0,0 +1,442 @@
+/****************************************************************************
+**
+** This file is part of the MiniAHCI project.
+** Copyright (C) 2024 Alexander E. <aekhv@vk.com>
+** License: GNU GPL v2, see file LICENSE.
+**
+****************************************************************************/
+
+// Runs the driver core against the simulated HBA
+
+#include <getopt.h>
+#include "hba.h"
+#include "../driver.h"
+
+static uint64_t clock_ns(clockid_t clock)
+{
+    struct timespec ts;
+    clock_gettime(clock, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// Commands run in the calling thread, as with port workers turned off
+int ahci_worker_run_ata_command(ahci_driver_data_t *pDrvData, ahci_command_packet_t *pCmdPacket, ahci_pin_t *pPin)
+{
+    return ahci_run_ata_command(pDrvData, pCmdPacket, pPin);
+}
+
+// Checks a localized read: bad sectors before the stop point are listed, the rest is read correctly
+static bool verify_locate(ahci_locate_t *pLocate, uint32_t badEvery)
+{
+    const uint64_t *pWords = (const uint64_t *)pLocate->pointer;
+    uint32_t e = 0;
+
+    for (uint64_t lba = pLocate->lba; lba < pLocate->next; lba++) {
+        while ((e < pLocate->extentsCount) && (pLocate->extents[e].lba + pLocate->extents[e].count <= lba))
+            e++;
+        if ((e < pLocate->extentsCount) && (pLocate->extents[e].lba <= lba))
+            continue;
+        if ((badEvery && (lba % badEvery == badEvery - 1))
+                || (pWords[(lba - pLocate->lba) * AHCI_SECTOR_SIZE / sizeof(uint64_t)] != lba))
+            return false;
+    }
+
+    return true;
+}
+
+static ahci_record_t *load_records(const char *path, uint64_t *pCount)
+{
+    ahci_record_t *pRecords = NULL;
+    uint64_t count = 0, size = 0;
+    FILE *pFile = fopen(path, "rb");
+
+    if (!pFile) {
+        perror(path);
+        return NULL;
+    }
+
+    while (true) {
+        if (count == size) {
+            size = size ? size * 2 : 4096;
+            pRecords = realloc(pRecords, size * sizeof(ahci_record_t));
+        }
+        if (fread(&pRecords[count], sizeof(ahci_record_t), 1, pFile) != 1)
+            break;
+        count++;
+    }
+
+    fclose(pFile);
+    *pCount = count;
+    return pRecords;
+}
+
+// Recorder ring content in the debugfs file format
+static uint64_t save_records(ahci_recorder_t *pRecorder, const char *path)
+{
+    const uint64_t head = ahci_record_head(pRecorder);
+    ahci_record_t record;
+    uint64_t saved = 0;
+    FILE *pFile = fopen(path, "wb");
+
+    if (!pFile) {
+        perror(path);
+        return 0;
+    }
+
+    for (uint64_t seq = (head > pRecorder->size) ? head - pRecorder->size : 0; seq < head; seq++)
+        if (ahci_record_fetch(pRecorder, seq, &record) && (fwrite(&record, sizeof(record), 1, pFile) == 1))
+            saved++;
+
+    fclose(pFile);
+    return saved;
+}
+
+static void usage(const char *name)
+{
+    printf("Usage: %s [options]\n"
+           "  -n COMMANDS    number of data commands (default 100000)\n"
+           "  -s SIZE        transfer size in bytes (default 65536)\n"
+           "  -w             issue WRITE DMA EXT instead of READ DMA EXT\n"
+           "  -c             request CRC32C of the buffer and verify it\n"
+           "  -m             request zero and pattern sector bitmaps and verify them\n"
+           "  -l LATENCY     simulated command latency in microseconds (default 0)\n"
+           "  -e N           every Nth command fails with UNC error\n"
+           "  -t N           every Nth command never completes\n"
+           "  -T TIMEOUT     port timeout in milliseconds (default 100)\n"
+           "  -r STAGE       last timeout recovery stage: 1 - stop, 2 - software reset, 3 - COMRESET\n"
+           "  -b N           every Nth sector is unreadable\n"
+           "  -g SECTORS     localized reads: failed ranges are split down to the given granularity\n"
+           "  -B ENTRIES     batched reads of random sectors, ENTRIES reads per batch\n"
+           "  -o ORDER       batch order: 0 - submission, 1 - C-SCAN, 2 - elevator (default 1)\n"
+           "  -i N           every Nth command fails with interface CRC error above 1.5 Gb/s,\n"
+           "                 adaptive link speed is enabled\n"
+           "  -W FILE        save the recorded command stream\n"
+           "  -R FILE        replay a recorded command stream instead of generated commands\n"
+           "  -x SPEED       replay pace relative to the recorded one, 0 - as fast as possible (default 1)\n"
+           "  -U LBA,COUNT   injected unreadable range\n"
+           "  -S LBA,COUNT,US  injected slow range, commands touching it are delayed by US microseconds\n"
+           "  -H N           device hangs after every Nth command until CLO or software reset\n"
+           "  -L N           link drops at every Nth command until COMRESET\n"
+           "  -d             driver debug output\n", name);
+}
+
+int main(int argc, char *argv[])
+{
+    sim_hba_config_t config = {
+        .ports = 1,
+        .latency = 0,
+        .errorEvery = 0,
+        .timeoutEvery = 0,
+        .capacity = 1ULL << 32
+    };
+    uint64_t commands = 100000, failed = 0, timeouts = 0, mismatches = 0;
+    uint64_t recovered[AHCI_RECOVERY_COMRESET + 1] = { 0 };
+    uint64_t extents = 0, reads = 0, incomplete = 0, distance = 0;
+    uint32_t size = 65536, timeout = 100, recovery = AHCI_RECOVERY_NONE, granularity = 0;
+    uint32_t batch = 0, order = AHCI_BATCH_ORDER_CSCAN;
+    bool write = false, digest = false, map = false, debug = false;
+    const char *pSavePath = NULL, *pReplayPath = NULL;
+    ahci_record_t *pRecords = NULL;
+    uint64_t recordedTime = 0, replayedTime = 0;
+    double speed = 1;
+    ahci_fault_t fault = { 0 };
+    int opt;
+
+    while ((opt = getopt(argc, argv, "n:s:wcml:e:t:T:r:b:g:B:o:i:W:R:x:U:S:H:L:dh")) != -1) {
+        switch (opt) {
+        case 'n': commands = strtoull(optarg, NULL, 0); break;
+        case 's': size = strtoul(optarg, NULL, 0); break;
+        case 'w': write = true; break;
+        case 'c': digest = true; break;
+        case 'm': map = true; break;
+        case 'l': config.latency = strtoul(optarg, NULL, 0); break;
+        case 'e': config.errorEvery = strtoul(optarg, NULL, 0); break;
+        case 't': config.timeoutEvery = strtoul(optarg, NULL, 0); break;
+        case 'T': timeout = strtoul(optarg, NULL, 0); break;
+        case 'r': recovery = strtoul(optarg, NULL, 0); break;
+        case 'b': config.badEvery = strtoul(optarg, NULL, 0); break;
+        case 'g': granularity = strtoul(optarg, NULL, 0); break;
+        case 'B': batch = strtoul(optarg, NULL, 0); break;
+        case 'o': order = strtoul(optarg, NULL, 0); break;
+        case 'i': config.icrcEvery = strtoul(optarg, NULL, 0); break;
+        case 'W': pSavePath = optarg; break;
+        case 'R': pReplayPath = optarg; break;
+        case 'x': speed = strtod(optarg, NULL); break;
+        case 'U': sscanf(optarg, "%llu,%u", (unsigned long long *)&(fault.badLba), &(fault.badCount)); break;
+        case 'S': sscanf(optarg, "%llu,%u,%u", (unsigned long long *)&(fault.slowLba), &(fault.slowCount),
+                         &(fault.slowDelay)); break;
+        case 'H': fault.hangEvery = strtoul(optarg, NULL, 0); break;
+        case 'L': fault.linkDropEvery = strtoul(optarg, NULL, 0); break;
+        case 'd': debug = true; break;
+        default:
+            usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    if ((size == 0) || (size > AHCI_DATA_BUFFER_SIZE_MAX) || (size % AHCI_SECTOR_SIZE)
+            || (recovery > AHCI_RECOVERY_COMRESET) || (granularity && write)
+            || (batch > AHCI_BATCH_ENTRIES_MAX) || (batch && (write || granularity)) || (order > AHCI_BATCH_ORDER_SCAN)
+            || (pReplayPath && (batch || granularity)) || (speed < 0)) {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    if (pReplayPath) {
+        pRecords = load_records(pReplayPath, &commands);
+        if (!pRecords || (commands == 0)) {
+            fprintf(stderr, "No records in %s\n", pReplayPath);
+            free(pRecords);
+            return EXIT_FAILURE;
+        }
+        size = AHCI_DATA_BUFFER_SIZE_MAX;
+    }
+
+    static struct pci_dev pciDev;
+    ahci_driver_data_t *pDrvData = calloc(1, sizeof(ahci_driver_data_t));
+    pDrvData->pPciDev = &pciDev;
+    pDrvData->debug = debug;
+    pDrvData->pAhciMem = sim_hba_create(&config);
+
+    ahci_controller_enable(pDrvData);
+
+    ahci_channel_t *pChannel = &(pDrvData->channel[0]);
+    for (uint32_t i = 0; i < AHCI_PMP_PORTS_MAX; i++)
+        pChannel->timeout[i] = timeout;
+    pChannel->recoveryStage = recovery;
+    pChannel->fault = fault;
+    pChannel->fault.enable = fault.badCount || fault.slowCount || fault.hangEvery || fault.linkDropEvery;
+    if (config.icrcEvery) {
+        ahci_link_policy_t policy = { .port = 0, .enable = true, .threshold = 2, .window = 100, .upshift = 0 };
+        ahci_link_set_policy(pDrvData, &policy);
+    }
+
+    // Reset paths
+    ahci_command_packet_t packet;
+    ahci_pmp_info_t info = { .port = 0 };
+
+    memset(&packet, 0, sizeof(packet));
+    mutex_lock(&(pChannel->lock));
+    ahci_port_software_reset(pDrvData, &packet);
+    ahci_port_hardware_reset(pDrvData, &packet);
+    const int pmpErr = ahci_pmp_enumerate(pDrvData, &info);
+    mutex_unlock(&(pChannel->lock));
+    printf("Resets: software %s, port multiplier %s\n", packet.timeout ? "TIMEOUT" : "OK",
+           pmpErr ? "not supported" : (info.ports ? "found" : "not found"));
+
+    // IDENTIFY DEVICE once, the second call is served by the cache
+    uint64_t capacity = 0;
+    if (ahci_port_capacity(pDrvData, 0, 0, &capacity) || ahci_port_capacity(pDrvData, 0, 0, &capacity))
+        printf("Capacity:    IDENTIFY FAILED\n");
+    else
+        printf("Capacity:    %llu sectors\n", (unsigned long long)capacity);
+
+    // Command path
+    uint8_t *pBuffer = aligned_alloc(PAGE_SIZE, batch ? batch * size : size);
+    ahci_batch_entry_t *pEntries = calloc(batch ? batch : 1, sizeof(ahci_batch_entry_t));
+    unsigned int seed = 1;
+    uint32_t sectors = size / AHCI_SECTOR_SIZE;
+    uint64_t lba = 0;
+
+    uint64_t start = clock_ns(CLOCK_MONOTONIC);
+    uint64_t cpuStart = clock_ns(CLOCK_PROCESS_CPUTIME_ID);
+
+    for (uint64_t n = 0; n < commands; n++) {
+        if (batch) {
+            ahci_batch_t request = { .port = 0, .pmp = 0, .order = order, .count = batch, .entries = pEntries };
+
+            // Random chunks of a small area, so some of them are adjacent and merged
+            for (uint32_t i = 0; i < batch; i++) {
+                pEntries[i].pointer = pBuffer + i * size;
+                pEntries[i].lba = (rand_r(&seed) % (batch * 4)) * sectors;
+                pEntries[i].count = sectors;
+            }
+
+            mutex_lock(&(pChannel->lock));
+            if (ahci_batch_read(pDrvData, &request, pEntries) != 0)
+                failed++;
+            mutex_unlock(&(pChannel->lock));
+
+            for (uint32_t i = 0; i < batch; i++) {
+                if (pEntries[i].result == -ETIMEDOUT)
+                    timeouts++;
+                else if (pEntries[i].result != 0)
+                    failed++;
+                else if ((((uint64_t *)pEntries[i].pointer)[0] != pEntries[i].lba)
+                         || (((uint64_t *)(pEntries[i].pointer + size))[-1] != pEntries[i].lba + sectors - 1))
+                    mismatches++;
+            }
+            reads += request.commands;
+            distance += request.distance;
+            continue;
+        }
+
+        if (pRecords) {
+            ahci_record_t *pRecord = &(pRecords[n]);
+            uint64_t issue;
+
+            if (speed != 0) {
+                uint64_t due = start + (uint64_t)((pRecord->time - pRecords[0].time) / speed);
+                struct timespec ts = { due / 1000000000ULL, due % 1000000000ULL };
+                clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+            }
+
+            // Simulated port has no port multiplier, recorded PMP numbers are dropped
+            memset(&packet, 0, sizeof(packet));
+            packet.ata = pRecord->ata;
+            packet.buffer.pointer = pBuffer;
+            packet.buffer.length = pRecord->length;
+            packet.buffer.write = pRecord->write;
+            packet.flags = pRecord->flags & AHCI_COMMAND_FLAG_CRC32C;
+
+            mutex_lock(&(pChannel->lock));
+            issue = clock_ns(CLOCK_MONOTONIC);
+            if (ahci_run_ata_command(pDrvData, &packet, NULL) != 0)
+                failed++;
+            replayedTime += clock_ns(CLOCK_MONOTONIC) - issue;
+            recordedTime += pRecord->duration * 1000ULL;
+            // Recorded failures are expected, only a different outcome counts
+            if ((packet.timeout != pRecord->timeout)
+                    || (!packet.timeout && (ahci_command_failed(pChannel) != ((pRecord->status & ATA_STATUS_ERR) != 0))))
+                mismatches++;
+            if (packet.timeout && ((packet.recovery == AHCI_RECOVERY_NONE) || (packet.recovery == AHCI_RECOVERY_FAILED))) {
+                ahci_port_hardware_reset(pDrvData, &packet);
+                ahci_port_software_reset(pDrvData, &packet);
+            }
+            mutex_unlock(&(pChannel->lock));
+            continue;
+        }
+
+        if (granularity) {
+            ahci_locate_t locate = { .port = 0, .pmp = 0, .pointer = pBuffer, .lba = lba, .count = sectors,
+                                     .granularity = granularity };
+
+            mutex_lock(&(pChannel->lock));
+            if (ahci_locate_read(pDrvData, &locate, NULL) != 0)
+                failed++;
+            else if (!verify_locate(&locate, config.badEvery))
+                mismatches++;
+            // Stopped by the budget or by a timeout the driver hasn't recovered from
+            if (locate.next != lba + sectors)
+                incomplete++;
+            if (locate.timeout) {
+                timeouts++;
+                memset(&packet, 0, sizeof(packet));
+                ahci_port_hardware_reset(pDrvData, &packet);
+                ahci_port_software_reset(pDrvData, &packet);
+            }
+            mutex_unlock(&(pChannel->lock));
+
+            extents += locate.extentsCount;
+            reads += locate.commands;
+            lba += sectors;
+            continue;
+        }
+
+        memset(&packet, 0, sizeof(packet));
+        ahci_ata_setup_dma(&(packet.ata), lba, sectors, write);
+        packet.buffer.pointer = pBuffer;
+        packet.buffer.length = size;
+        packet.buffer.write = write;
+        packet.flags = (digest ? AHCI_COMMAND_FLAG_CRC32C : 0) | (map ? AHCI_COMMAND_FLAG_SECTOR_MAP : 0)
+                | AHCI_COMMAND_FLAG_FIS_SNAPSHOT;
+
+        mutex_lock(&(pChannel->lock));
+        if (ahci_run_ata_command(pDrvData, &packet, NULL) != 0) {
+            failed++;
+        } else if (packet.timeout) {
+            timeouts++;
+            // The driver has restored the port already, or the caller does the rest
+            if (packet.recovery <= AHCI_RECOVERY_COMRESET)
+                recovered[packet.recovery]++;
+            if ((packet.recovery == AHCI_RECOVERY_NONE) || (packet.recovery == AHCI_RECOVERY_FAILED)) {
+                ahci_port_hardware_reset(pDrvData, &packet);
+                ahci_port_software_reset(pDrvData, &packet);
+            }
+        } else if (ahci_command_failed(pChannel)) {
+            failed++;
+            // Interface CRC abort carries no error LBA, the link monitor counts it already
+            if (ahci_ata_error(pChannel) & ATA_ERROR_ICRC) {
+                mutex_unlock(&(pChannel->lock));
+                lba += sectors;
+                continue;
+            }
+            // Simulated bad sector is in the middle, an injected bad range fails at its first sector,
+            // the sectors before are valid
+            uint64_t errorLba = pChannel->fault.tfd ? max_t(uint64_t, lba, fault.badLba) : lba + sectors / 2;
+            if ((packet.errorLba != errorLba) || (packet.transferred != (errorLba - lba) * AHCI_SECTOR_SIZE)
+                    || (!write && (errorLba > lba) && (((uint64_t *)pBuffer)[0] != lba)))
+                mismatches++;
+            // Snapshot holds the same D2H FIS and the error status
+            else if (!(pChannel->snapshot.tfd & ATA_STATUS_ERR) || (pChannel->snapshot.rfis[4] != (uint8_t)errorLba)
+                     || (pChannel->snapshot.rfis[8] != (uint8_t)(errorLba >> 24)))
+                mismatches++;
+        } else if ((!write && (((uint64_t *)pBuffer)[0] != lba))
+                   || (digest && (packet.crc32c != ~crc32c(~0, pBuffer, size)))
+                   || (map && !write && (((pChannel->zeroMap[0] & 1) != 0) != (lba == 0)))
+                   || (map && !write && ((pChannel->patternMap[0] & 1) != 0) != (lba == 0))) {
+            mismatches++;
+        }
+        mutex_unlock(&(pChannel->lock));
+
+        lba += sectors;
+    }
+
+    uint64_t elapsed = clock_ns(CLOCK_MONOTONIC) - start;
+    uint64_t cpuTime = clock_ns(CLOCK_PROCESS_CPUTIME_ID) - cpuStart;
+
+    sim_hba_stats_t stats;
+    sim_hba_get_stats(&stats);
+
+    printf("Commands:    %llu (%llu failed, %llu timeouts, %llu data mismatches)\n",
+           (unsigned long long)commands, (unsigned long long)failed,
+           (unsigned long long)timeouts, (unsigned long long)mismatches);
+    printf("Time:        %.3f s, %.0f commands/s, %.2f MB/s\n", elapsed / 1e9,
+           commands * 1e9 / elapsed, (double)stats.bytes * 1e3 / elapsed);
+    printf("Per command: %.2f us wall, %.2f us CPU (driver and HBA threads)\n",
+           elapsed / 1e3 / commands, cpuTime / 1e3 / commands);
+    printf("HBA:         %llu completed, %llu errors, %llu dropped, %llu resets, %llu COMRESETs\n",
+           (unsigned long long)stats.commands, (unsigned long long)stats.errors,
+           (unsigned long long)stats.timeouts, (unsigned long long)stats.resets,
+           (unsigned long long)stats.comresets);
+    if (batch)
+        printf("Batched:     %llu reads in %llu commands, head travel %.0f sectors per command\n",
+               (unsigned long long)(commands * batch), (unsigned long long)reads,
+               reads ? (double)distance / reads : 0);
+    if (granularity)
+        printf("Localized:   %llu bad extents, %llu read commands, %llu incomplete\n",
+               (unsigned long long)extents, (unsigned long long)reads, (unsigned long long)incomplete);
+    if (pDrvData->pStatusPage)
+        printf("Status page: %llu commands, %llu errors, %llu bytes, seq %u\n",
+               (unsigned long long)pDrvData->pStatusPage->port[0].commands,
+               (unsigned long long)pDrvData->pStatusPage->port[0].errors,
+               (unsigned long long)pDrvData->pStatusPage->port[0].bytes, pDrvData->pStatusPage->port[0].seq);
+    if (pRecords)
+        printf("Replay:      %.2f us recorded, %.2f us replayed service time per command\n",
+               recordedTime / 1e3 / commands, replayedTime / 1e3 / commands);
+    if (pSavePath)
+        printf("Recorder:    %llu commands saved to %s\n",
+               (unsigned long long)save_records(&(pChannel->recorder), pSavePath), pSavePath);
+    if (pChannel->fault.enable)
+        printf("Faults:      %llu commands seen, %llu faults injected\n",
+               (unsigned long long)pChannel->fault.commands, (unsigned long long)pChannel->fault.injected);
+    if (config.icrcEvery)
+        printf("Link:        %llu interface errors, %llu downshifts, speed %d\n",
+               (unsigned long long)pChannel->linkStats.errors, (unsigned long long)pChannel->linkStats.downshifts,
+               pChannel->pPort->ssts.spd);
+    if (recovery != AHCI_RECOVERY_NONE)
+        printf("Recovery:    %llu by stop, %llu by software reset, %llu by COMRESET, %llu failed\n",
+               (unsigned long long)recovered[AHCI_RECOVERY_STOP], (unsigned long long)recovered[AHCI_RECOVERY_SRST],
+               (unsigned long long)recovered[AHCI_RECOVERY_COMRESET],
+               (unsigned long long)(timeouts - recovered[AHCI_RECOVERY_STOP] - recovered[AHCI_RECOVERY_SRST]
+                                    - recovered[AHCI_RECOVERY_COMRESET]));
+
+    free(pRecords);
+    free(pEntries);
+    free(pBuffer);
+    ahci_controller_disable(pDrvData);
+    sim_hba_destroy((HBA_MEMORY *)pDrvData->pAhciMem);
+    free(pDrvData);
+
+    return (failed || timeouts || mismatches) ? EXIT_FAILURE : EXIT_SUCCESS;
+}
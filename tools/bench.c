@@ -0,0 +1,404 @@
+/****************************************************************************
+**
+** This file is part of the MiniAHCI project.
+** Copyright (C) 2024 Alexander E. <aekhv@vk.com>
+** License: GNU GPL v2, see file LICENSE.
+**
+****************************************************************************/
+
+// Command path benchmark, issues READ DMA EXT through AHCI_IOCTL_RUN_ATA_COMMAND or AHCI_IOCTL_READ_BATCH
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/ioctl.h>
+#include "../ioctl.h"
+
+#define SECTOR_SIZE         512
+#define BUFFER_SIZE_MIN     4096
+#define BUFFER_SIZE_MAX     1048576
+#define THREADS_MAX         256
+#define BATCH_MEMORY_MAX    (64 * 1048576)
+
+typedef enum {
+    PATTERN_SEQUENTIAL,
+    PATTERN_RANDOM,
+    PATTERN_STRIDED
+} pattern_t;
+
+typedef struct {
+    const char *device;
+    uint32_t ports;         // Ports bit mask
+    uint32_t threads;       // Threads per port
+    uint32_t size;          // Transfer size in bytes
+    pattern_t pattern;
+    uint64_t stride;        // Stride in sectors, strided pattern only
+    uint64_t lba;           // First LBA of the tested area
+    uint64_t count;         // Tested area size in sectors
+    uint32_t seconds;       // Test duration
+    uint32_t batch;         // Reads per AHCI_IOCTL_READ_BATCH, 0 - single commands
+    uint8_t order;          // AHCI_BATCH_ORDER_*
+    bool descending;        // Batch sweep direction
+} config_t;
+
+typedef struct {
+    pthread_t thread;
+    const config_t *pConfig;
+    uint8_t port;
+    uint32_t index;         // Thread index within port
+    uint64_t commands;      // Reads, batch entries in batch mode
+    uint64_t errors;
+    uint64_t issued;        // Commands issued by the driver after merging, batch mode only
+    uint64_t distance;      // Head travel in sectors, batch mode only
+    uint64_t cpuTime;       // Thread CPU time in nanoseconds
+    uint64_t *pLatency;     // Command latencies in nanoseconds
+    uint64_t latencyCount;
+    uint64_t latencySize;
+} worker_t;
+
+static volatile bool _stop = false;
+
+static uint64_t clock_ns(clockid_t clock)
+{
+    struct timespec ts;
+    clock_gettime(clock, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static uint64_t parse_size(const char *str)
+{
+    char *end;
+    uint64_t value = strtoull(str, &end, 0);
+
+    switch (*end) {
+    case 'k': case 'K': return value * 1024;
+    case 'm': case 'M': return value * 1024 * 1024;
+    default: return value;
+    }
+}
+
+static uint32_t parse_ports(const char *str)
+{
+    uint32_t mask = 0;
+    char *copy = strdup(str);
+
+    for (char *token = strtok(copy, ","); token; token = strtok(NULL, ",")) {
+        unsigned long port = strtoul(token, NULL, 0);
+        if (port < 32)
+            mask |= 1U << port;
+    }
+
+    free(copy);
+    return mask;
+}
+
+static void latency_add(worker_t *pWorker, uint64_t value)
+{
+    if (pWorker->latencyCount == pWorker->latencySize) {
+        pWorker->latencySize = pWorker->latencySize ? pWorker->latencySize * 2 : 65536;
+        pWorker->pLatency = realloc(pWorker->pLatency, pWorker->latencySize * sizeof(uint64_t));
+        if (!pWorker->pLatency) {
+            perror("realloc");
+            exit(EXIT_FAILURE);
+        }
+    }
+    pWorker->pLatency[pWorker->latencyCount++] = value;
+}
+
+static uint64_t next_lba(worker_t *pWorker, unsigned int *pSeed, uint64_t *pNext)
+{
+    const config_t *pConfig = pWorker->pConfig;
+    const uint32_t sectors = pConfig->size / SECTOR_SIZE;
+    const uint64_t chunks = pConfig->count / sectors;
+    uint64_t lba;
+
+    switch (pConfig->pattern) {
+    case PATTERN_RANDOM:
+        lba = pConfig->lba + ((((uint64_t)rand_r(pSeed) << 31) | rand_r(pSeed)) % chunks) * sectors;
+        break;
+    case PATTERN_STRIDED:
+        lba = pConfig->lba + (*pNext * pConfig->stride) % (pConfig->count - sectors + 1);
+        *pNext += pConfig->threads;
+        break;
+    default:
+        lba = pConfig->lba + (*pNext % chunks) * sectors;
+        *pNext += pConfig->threads;
+        break;
+    }
+
+    return lba;
+}
+
+// Reads of a whole batch are submitted at once, the driver sorts and merges them
+static void run_batch(worker_t *pWorker, int fd, uint8_t *pBuffer, ahci_batch_entry_t *pEntries,
+                      unsigned int *pSeed, uint64_t *pNext)
+{
+    const config_t *pConfig = pWorker->pConfig;
+    ahci_batch_t batch;
+    uint64_t start;
+
+    for (uint32_t i = 0; i < pConfig->batch; i++) {
+        pEntries[i].pointer = pBuffer + (uint64_t)i * pConfig->size;
+        pEntries[i].lba = next_lba(pWorker, pSeed, pNext);
+        pEntries[i].count = pConfig->size / SECTOR_SIZE;
+    }
+
+    memset(&batch, 0, sizeof(batch));
+    batch.port = pWorker->port;
+    batch.order = pConfig->order;
+    batch.descending = pConfig->descending;
+    batch.count = pConfig->batch;
+    batch.entries = pEntries;
+
+    start = clock_ns(CLOCK_MONOTONIC);
+    if (ioctl(fd, AHCI_IOCTL_READ_BATCH, &batch) != 0) {
+        pWorker->errors += pConfig->batch;
+    } else {
+        for (uint32_t i = 0; i < pConfig->batch; i++)
+            if (pEntries[i].result != 0)
+                pWorker->errors++;
+        pWorker->issued += batch.commands;
+        pWorker->distance += batch.distance;
+    }
+    // Latency of the whole batch
+    latency_add(pWorker, clock_ns(CLOCK_MONOTONIC) - start);
+    pWorker->commands += pConfig->batch;
+}
+
+static void *worker_thread(void *pArg)
+{
+    worker_t *pWorker = pArg;
+    const config_t *pConfig = pWorker->pConfig;
+    const uint32_t sectors = pConfig->size / SECTOR_SIZE;
+    const uint64_t bufferSize = (uint64_t)pConfig->size * (pConfig->batch ? pConfig->batch : 1);
+    ahci_command_packet_t packet;
+    ahci_batch_entry_t *pEntries = NULL;
+    unsigned int seed = pWorker->port * THREADS_MAX + pWorker->index;
+    uint64_t next, lba, start;
+    uint8_t *pBuffer;
+    int fd;
+
+    fd = open(pConfig->device, O_RDWR);
+    if (fd < 0) {
+        perror(pConfig->device);
+        return NULL;
+    }
+
+    pBuffer = aligned_alloc(4096, bufferSize);
+    if (pConfig->batch)
+        pEntries = calloc(pConfig->batch, sizeof(ahci_batch_entry_t));
+    if (!pBuffer || (pConfig->batch && !pEntries)) {
+        perror("alloc");
+        free(pBuffer);
+        close(fd);
+        return NULL;
+    }
+
+    // Threads of the same port work on interleaved chunks
+    next = pWorker->index;
+    uint64_t cpuStart = clock_ns(CLOCK_THREAD_CPUTIME_ID);
+
+    while (!_stop) {
+        if (pConfig->batch) {
+            run_batch(pWorker, fd, pBuffer, pEntries, &seed, &next);
+            continue;
+        }
+
+        lba = next_lba(pWorker, &seed, &next);
+
+        memset(&packet, 0, sizeof(packet));
+        packet.port = pWorker->port;
+        packet.buffer.pointer = pBuffer;
+        packet.buffer.length = pConfig->size;
+        packet.buffer.write = false;
+        packet.ata.count[0] = sectors;
+        packet.ata.count[1] = sectors >> 8;
+        for (int i = 0; i < 6; i++)
+            packet.ata.lba[i] = lba >> (i * 8);
+        packet.ata.device = 0x40;
+        packet.ata.command = 0x25; // READ DMA EXT
+
+        start = clock_ns(CLOCK_MONOTONIC);
+        if ((ioctl(fd, AHCI_IOCTL_RUN_ATA_COMMAND, &packet) != 0) || packet.timeout)
+            pWorker->errors++;
+        latency_add(pWorker, clock_ns(CLOCK_MONOTONIC) - start);
+        pWorker->commands++;
+    }
+
+    pWorker->cpuTime = clock_ns(CLOCK_THREAD_CPUTIME_ID) - cpuStart;
+
+    free(pEntries);
+    free(pBuffer);
+    close(fd);
+
+    return NULL;
+}
+
+static int compare_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+static double percentile(const uint64_t *pSorted, uint64_t count, double p)
+{
+    if (count == 0)
+        return 0;
+    uint64_t i = (uint64_t)(p / 100.0 * (count - 1) + 0.5);
+    return pSorted[i] / 1000.0;
+}
+
+static void usage(const char *name)
+{
+    printf("Usage: %s -d DEVICE [options]\n"
+           "  -d DEVICE      character device, e.g. /dev/miniahci5\n"
+           "  -p PORTS       comma separated port list (default 0)\n"
+           "  -t THREADS     threads per port (default 1)\n"
+           "  -s SIZE        transfer size, 4K...1M (default 64K)\n"
+           "  -m PATTERN     seq, random or strided (default seq)\n"
+           "  -S STRIDE      stride size for strided pattern (default 1M)\n"
+           "  -l LBA         first LBA of the tested area (default 0)\n"
+           "  -c SECTORS     tested area size in sectors (default 2097152)\n"
+           "  -T SECONDS     test duration (default 10)\n"
+           "  -B ENTRIES     submit reads in batches with AHCI_IOCTL_READ_BATCH, up to %d\n"
+           "  -o ORDER       batch order: none, cscan or scan (default cscan)\n"
+           "  -D             batch sweep towards lower LBAs first\n", name, AHCI_BATCH_ENTRIES_MAX);
+}
+
+int main(int argc, char *argv[])
+{
+    config_t config = {
+        .device = NULL,
+        .ports = 1,
+        .threads = 1,
+        .size = 65536,
+        .pattern = PATTERN_SEQUENTIAL,
+        .stride = 1048576 / SECTOR_SIZE,
+        .lba = 0,
+        .count = 2097152,
+        .seconds = 10,
+        .batch = 0,
+        .order = AHCI_BATCH_ORDER_CSCAN,
+        .descending = false
+    };
+    worker_t workers[THREADS_MAX];
+    uint32_t workersCount = 0;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "d:p:t:s:m:S:l:c:T:B:o:Dh")) != -1) {
+        switch (opt) {
+        case 'd': config.device = optarg; break;
+        case 'p': config.ports = parse_ports(optarg); break;
+        case 't': config.threads = strtoul(optarg, NULL, 0); break;
+        case 's': config.size = parse_size(optarg); break;
+        case 'm':
+            if (!strcmp(optarg, "random"))
+                config.pattern = PATTERN_RANDOM;
+            else if (!strcmp(optarg, "strided"))
+                config.pattern = PATTERN_STRIDED;
+            else
+                config.pattern = PATTERN_SEQUENTIAL;
+            break;
+        case 'S': config.stride = parse_size(optarg) / SECTOR_SIZE; break;
+        case 'l': config.lba = strtoull(optarg, NULL, 0); break;
+        case 'c': config.count = strtoull(optarg, NULL, 0); break;
+        case 'T': config.seconds = strtoul(optarg, NULL, 0); break;
+        case 'B': config.batch = strtoul(optarg, NULL, 0); break;
+        case 'o':
+            if (!strcmp(optarg, "none"))
+                config.order = AHCI_BATCH_ORDER_NONE;
+            else if (!strcmp(optarg, "scan"))
+                config.order = AHCI_BATCH_ORDER_SCAN;
+            else
+                config.order = AHCI_BATCH_ORDER_CSCAN;
+            break;
+        case 'D': config.descending = true; break;
+        default:
+            usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (!config.device || !config.ports || !config.threads || !config.seconds
+            || (config.size < BUFFER_SIZE_MIN) || (config.size > BUFFER_SIZE_MAX) || (config.size % SECTOR_SIZE)
+            || (config.count < config.size / SECTOR_SIZE) || (config.stride == 0)
+            || (config.batch > AHCI_BATCH_ENTRIES_MAX) || ((uint64_t)config.batch * config.size > BATCH_MEMORY_MAX)) {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    memset(workers, 0, sizeof(workers));
+    for (uint8_t port = 0; port < 32; port++) {
+        if (!(config.ports & (1U << port)))
+            continue;
+        for (uint32_t i = 0; i < config.threads; i++) {
+            if (workersCount == THREADS_MAX) {
+                fprintf(stderr, "Too many threads\n");
+                return EXIT_FAILURE;
+            }
+            worker_t *pWorker = &workers[workersCount++];
+            pWorker->pConfig = &config;
+            pWorker->port = port;
+            pWorker->index = i;
+        }
+    }
+
+    uint64_t start = clock_ns(CLOCK_MONOTONIC);
+    for (uint32_t i = 0; i < workersCount; i++)
+        pthread_create(&workers[i].thread, NULL, worker_thread, &workers[i]);
+
+    sleep(config.seconds);
+    _stop = true;
+
+    for (uint32_t i = 0; i < workersCount; i++)
+        pthread_join(workers[i].thread, NULL);
+    double elapsed = (clock_ns(CLOCK_MONOTONIC) - start) / 1e9;
+
+    uint64_t commands = 0, errors = 0, cpuTime = 0, latencyCount = 0, issued = 0, distance = 0;
+    for (uint32_t i = 0; i < workersCount; i++) {
+        commands += workers[i].commands;
+        errors += workers[i].errors;
+        issued += workers[i].issued;
+        distance += workers[i].distance;
+        cpuTime += workers[i].cpuTime;
+        latencyCount += workers[i].latencyCount;
+    }
+
+    uint64_t *pLatency = malloc((latencyCount + 1) * sizeof(uint64_t));
+    uint64_t n = 0;
+    for (uint32_t i = 0; i < workersCount; i++) {
+        memcpy(pLatency + n, workers[i].pLatency, workers[i].latencyCount * sizeof(uint64_t));
+        n += workers[i].latencyCount;
+        free(workers[i].pLatency);
+    }
+    qsort(pLatency, latencyCount, sizeof(uint64_t), compare_u64);
+
+    double sum = 0;
+    for (uint64_t i = 0; i < latencyCount; i++)
+        sum += pLatency[i];
+
+    printf("Commands:    %llu (%llu errors) in %.2f s\n", (unsigned long long)commands, (unsigned long long)errors, elapsed);
+    printf("IOPS:        %.0f\n", commands / elapsed);
+    printf("Throughput:  %.2f MB/s\n", (double)(commands - errors) * config.size / elapsed / 1e6);
+    if (config.batch)
+        printf("Batches:     %llu commands after merging, head travel %.0f sectors per command (latency is per batch)\n",
+               (unsigned long long)issued, issued ? (double)distance / issued : 0);
+    printf("Latency, us: avg %.1f, p50 %.1f, p90 %.1f, p99 %.1f, p99.9 %.1f, max %.1f\n",
+           latencyCount ? sum / latencyCount / 1000.0 : 0,
+           percentile(pLatency, latencyCount, 50), percentile(pLatency, latencyCount, 90),
+           percentile(pLatency, latencyCount, 99), percentile(pLatency, latencyCount, 99.9),
+           percentile(pLatency, latencyCount, 100));
+    printf("CPU time:    %.2f us per command\n", commands ? cpuTime / 1000.0 / commands : 0);
+
+    free(pLatency);
+
+    return errors ? EXIT_FAILURE : EXIT_SUCCESS;
+}
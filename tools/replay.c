@@ -0,0 +1,210 @@
+/****************************************************************************
+**
+** This file is part of the MiniAHCI project.
+** Copyright (C) 2024 Alexander E. <aekhv@vk.com>
+** License: GNU GPL v2, see file LICENSE.
+**
+****************************************************************************/
+
+// Command stream replay, re-issues commands recorded by the driver through AHCI_IOCTL_RUN_ATA_COMMAND
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <time.h>
+#include <sys/ioctl.h>
+#include "../ioctl.h"
+
+#define BUFFER_SIZE_MAX     1048576
+#define ATA_STATUS_ERR      0x01
+
+typedef struct {
+    const char *device;
+    const char *path;       // Recorded stream, e.g. /sys/kernel/debug/miniahci/5/port2/record
+    uint8_t port;
+    double speed;           // Pace relative to the recorded one, 0 - as fast as possible
+    bool writes;            // Replay write commands too
+} config_t;
+
+static uint64_t clock_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void sleep_until(uint64_t ns)
+{
+    struct timespec ts = { ns / 1000000000ULL, ns % 1000000000ULL };
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+        ;
+}
+
+static ahci_record_t *load_records(const char *path, uint64_t *pCount)
+{
+    ahci_record_t *pRecords = NULL;
+    uint64_t count = 0, size = 0;
+    FILE *pFile = fopen(path, "rb");
+
+    if (!pFile) {
+        perror(path);
+        return NULL;
+    }
+
+    while (true) {
+        if (count == size) {
+            size = size ? size * 2 : 4096;
+            pRecords = realloc(pRecords, size * sizeof(ahci_record_t));
+            if (!pRecords) {
+                perror("realloc");
+                exit(EXIT_FAILURE);
+            }
+        }
+        if (fread(&pRecords[count], sizeof(ahci_record_t), 1, pFile) != 1)
+            break;
+        count++;
+    }
+
+    fclose(pFile);
+    *pCount = count;
+    return pRecords;
+}
+
+// 0 - success, 1 - device error, 2 - timeout
+static int outcome(bool timeout, uint8_t status)
+{
+    return timeout ? 2 : ((status & ATA_STATUS_ERR) ? 1 : 0);
+}
+
+static void usage(const char *name)
+{
+    printf("Usage: %s -d DEVICE -f FILE [options]\n"
+           "  -d DEVICE      character device, e.g. /dev/miniahci5 or /dev/miniahci5.2\n"
+           "  -f FILE        recorded stream, e.g. /sys/kernel/debug/miniahci/5/port2/record\n"
+           "  -p PORT        port to replay on, the node port for port nodes (default 0)\n"
+           "  -x SPEED       pace relative to the recorded one, 0 - as fast as possible (default 1)\n"
+           "  -w             replay write commands too, they are skipped by default\n", name);
+}
+
+int main(int argc, char *argv[])
+{
+    config_t config = {
+        .device = NULL,
+        .path = NULL,
+        .port = 0,
+        .speed = 1,
+        .writes = false
+    };
+    uint64_t count = 0, issued = 0, skipped = 0, errors = 0, diverged = 0;
+    uint64_t recordedTime = 0, replayedTime = 0;
+    ahci_command_packet_t packet;
+    ahci_fis_snapshot_t snapshot;
+    ahci_record_t *pRecords;
+    uint8_t *pBuffer;
+    int fd, opt;
+
+    while ((opt = getopt(argc, argv, "d:f:p:x:wh")) != -1) {
+        switch (opt) {
+        case 'd': config.device = optarg; break;
+        case 'f': config.path = optarg; break;
+        case 'p': config.port = strtoul(optarg, NULL, 0); break;
+        case 'x': config.speed = strtod(optarg, NULL); break;
+        case 'w': config.writes = true; break;
+        default:
+            usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (!config.device || !config.path || (config.port >= 32) || (config.speed < 0)) {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    pRecords = load_records(config.path, &count);
+    if (!pRecords)
+        return EXIT_FAILURE;
+    if (count == 0) {
+        fprintf(stderr, "No records in %s\n", config.path);
+        free(pRecords);
+        return EXIT_FAILURE;
+    }
+
+    fd = open(config.device, O_RDWR);
+    if (fd < 0) {
+        perror(config.device);
+        free(pRecords);
+        return EXIT_FAILURE;
+    }
+
+    pBuffer = aligned_alloc(4096, BUFFER_SIZE_MAX);
+    if (!pBuffer) {
+        perror("alloc");
+        close(fd);
+        free(pRecords);
+        return EXIT_FAILURE;
+    }
+    memset(pBuffer, 0, BUFFER_SIZE_MAX);
+
+    uint64_t start = clock_ns();
+
+    for (uint64_t i = 0; i < count; i++) {
+        ahci_record_t *pRecord = &pRecords[i];
+
+        if (pRecord->write && !config.writes) {
+            skipped++;
+            continue;
+        }
+
+        // Gaps between commands are kept, service times are the device's own
+        if (config.speed != 0)
+            sleep_until(start + (uint64_t)((pRecord->time - pRecords[0].time) / config.speed));
+
+        memset(&packet, 0, sizeof(packet));
+        packet.port = config.port;
+        packet.pmp = pRecord->pmp;
+        packet.ata = pRecord->ata;
+        packet.buffer.pointer = pBuffer;
+        packet.buffer.length = pRecord->length;
+        packet.buffer.write = pRecord->write;
+        packet.flags = (pRecord->flags & AHCI_COMMAND_FLAG_CRC32C) | AHCI_COMMAND_FLAG_FIS_SNAPSHOT;
+        packet.snapshot = &snapshot;
+
+        uint64_t issue = clock_ns();
+        if (ioctl(fd, AHCI_IOCTL_RUN_ATA_COMMAND, &packet) != 0) {
+            perror("AHCI_IOCTL_RUN_ATA_COMMAND");
+            break;
+        }
+        replayedTime += clock_ns() - issue;
+        recordedTime += pRecord->duration * 1000ULL;
+        issued++;
+
+        // ATA status comes with the command, no extra status request
+        if (outcome(packet.timeout, snapshot.tfd) != 0)
+            errors++;
+        if (outcome(packet.timeout, snapshot.tfd) != outcome(pRecord->timeout, pRecord->status))
+            diverged++;
+    }
+
+    double elapsed = (clock_ns() - start) / 1e9;
+    double span = (pRecords[count - 1].time - pRecords[0].time) / 1e9;
+
+    printf("Records:     %llu (%llu writes skipped)\n", (unsigned long long)count, (unsigned long long)skipped);
+    printf("Replayed:    %llu commands (%llu errors, %llu outcomes differ from the recorded ones)\n",
+           (unsigned long long)issued, (unsigned long long)errors, (unsigned long long)diverged);
+    printf("Time:        %.2f s, recorded session %.2f s\n", elapsed, span);
+    printf("Service, us: avg %.1f replayed, %.1f recorded\n",
+           issued ? replayedTime / 1e3 / issued : 0, issued ? recordedTime / 1e3 / issued : 0);
+
+    free(pBuffer);
+    close(fd);
+    free(pRecords);
+
+    return (issued == count - skipped) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,143 @@
+/****************************************************************************
+**
+** This file is part of the MiniAHCI project.
+** Copyright (C) 2024 Alexander E. <aekhv@vk.com>
+** License: GNU GPL v2, see file LICENSE.
+**
+****************************************************************************/
+
+#include "driver.h"
+#include <linux/kthread.h>
+#include <linux/sched/mm.h>
+
+// Use "insmod miniahci.ko workers=1" to execute commands in per port threads
+static bool workers = 0;
+module_param(workers, bool, 0);
+
+// Use "insmod miniahci.ko workers=1 worker_cpu=2,3" to bind port 0 worker to CPU 2, port 1 worker to CPU 3 and so on
+static int worker_cpu[AHCI_NUMBER_OF_PORTS_MAX];
+static int worker_cpu_count = 0; // Workers of other ports are not bound
+module_param_array(worker_cpu, int, &worker_cpu_count, 0);
+
+static ahci_work_t *ahci_worker_dequeue(ahci_channel_t *pChannel)
+{
+    ahci_work_t *pWork = NULL;
+
+    spin_lock(&(pChannel->workLock));
+    if (!list_empty(&(pChannel->workQueue))) {
+        pWork = list_first_entry(&(pChannel->workQueue), ahci_work_t, list);
+        list_del(&(pWork->list));
+    }
+    spin_unlock(&(pChannel->workLock));
+
+    return pWork;
+}
+
+static int ahci_worker_thread(void *pData)
+{
+    ahci_channel_t *pChannel = pData;
+    ahci_driver_data_t *pDrvData = pChannel->pDrvData;
+    ahci_work_t *pWork;
+
+    while (true) {
+        wait_event_interruptible(pChannel->workWait, !list_empty(&(pChannel->workQueue)) || kthread_should_stop());
+
+        pWork = ahci_worker_dequeue(pChannel);
+        if (!pWork) {
+            if (kthread_should_stop())
+                break;
+            continue;
+        }
+
+        // User buffer is pinned or copied in the address space of the submitter
+        kthread_use_mm(pWork->pMm);
+        pWork->result = ahci_run_ata_command(pDrvData, pWork->pCmdPacket, pWork->pPin);
+        kthread_unuse_mm(pWork->pMm);
+
+        complete(&(pWork->done));
+    }
+
+    return 0;
+}
+
+void ahci_worker_start(ahci_driver_data_t *pDrvData)
+{
+    HBA_MEMORY *pAhciMem = pDrvData->pAhciMem;
+    struct task_struct *pThread;
+    uint32_t i;
+
+    for (i = 0; i < AHCI_NUMBER_OF_PORTS_MAX; i++) {
+        ahci_channel_t *pChannel = &(pDrvData->channel[i]);
+
+        spin_lock_init(&(pChannel->workLock));
+        INIT_LIST_HEAD(&(pChannel->workQueue));
+        init_waitqueue_head(&(pChannel->workWait));
+
+        if (!workers || !(pAhciMem->pi & (1 << i)))
+            continue;
+
+        pThread = kthread_create(ahci_worker_thread, pChannel, "%s-%d:%d", KBUILD_MODNAME, pDrvData->pPciDev->bus->number, i);
+        if (IS_ERR(pThread)) {
+            printk(KERN_ERR "%s: Port %d worker creation failed, commands run in the caller context\n", KBUILD_MODNAME, i);
+            continue;
+        }
+
+        if ((i < worker_cpu_count) && (worker_cpu[i] >= 0) && (worker_cpu[i] < nr_cpu_ids) && cpu_online(worker_cpu[i])) {
+            kthread_bind(pThread, worker_cpu[i]);
+            if (pDrvData->debug)
+                printk(KERN_INFO "%s: Port %d worker bound to CPU %d\n", KBUILD_MODNAME, i, worker_cpu[i]);
+        }
+
+        pChannel->pWorker = pThread;
+        wake_up_process(pThread);
+    }
+}
+
+void ahci_worker_stop(ahci_driver_data_t *pDrvData)
+{
+    ahci_work_t *pWork;
+    uint32_t i;
+
+    for (i = 0; i < AHCI_NUMBER_OF_PORTS_MAX; i++) {
+        ahci_channel_t *pChannel = &(pDrvData->channel[i]);
+
+        if (!pChannel->pWorker)
+            continue;
+
+        kthread_stop(pChannel->pWorker);
+        pChannel->pWorker = NULL;
+
+        // Nothing is left normally, submitters hold the channel lock until completion
+        while ((pWork = ahci_worker_dequeue(pChannel))) {
+            pWork->result = -ENODEV;
+            complete(&(pWork->done));
+        }
+    }
+}
+
+// Caller must hold channel lock, so there is a single command per port queue and the caller sleeps until completion
+int ahci_worker_run_ata_command(ahci_driver_data_t *pDrvData, ahci_command_packet_t *pCmdPacket, ahci_pin_t *pPin)
+{
+    ahci_channel_t *pChannel = &(pDrvData->channel[pCmdPacket->port]);
+    ahci_work_t work;
+
+    // Kernel threads have no user buffers
+    if (!pChannel->pWorker || !current->mm)
+        return ahci_run_ata_command(pDrvData, pCmdPacket, pPin);
+
+    work.pCmdPacket = pCmdPacket;
+    work.pPin = pPin;
+    work.pMm = current->mm;
+    work.result = 0;
+    init_completion(&(work.done));
+
+    spin_lock(&(pChannel->workLock));
+    list_add_tail(&(work.list), &(pChannel->workQueue));
+    spin_unlock(&(pChannel->workLock));
+    wake_up(&(pChannel->workWait));
+
+    // Command always completes or times out, and the work lives on this stack
+    wait_for_completion(&(work.done));
+
+    return work.result;
+}